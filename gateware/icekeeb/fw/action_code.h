@@ -200,6 +200,8 @@ enum mods_bit {
     MOD_RALT = 0x14,
     MOD_RGUI = 0x18,
 };
+/* HID modifier bits of the mod bits above */
+#define MODS_TO_HID(mods) (((mods)&0x10) ? ((mods)&0x0F) << 4 : (mods)&0x0F)
 enum mods_codes {
     MODS_ONESHOT    = 0x00,
     MODS_TAP_TOGGLE = 0x01,
@@ -0,0 +1,181 @@
+/*
+ * auto_shift.c
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Auto shift.
+ *
+ * The press of a key that can be auto shifted is held back. The next
+ * event decides it from the timestamps: its own release sends a tap,
+ * shifted if it was held for at least the timeout. Any other event
+ * first sends the held back key as pressed, shifted if the timeout has
+ * passed by then, and the key is released along with its own release.
+ *
+ * Nothing runs in between events, a key held without anything else
+ * happening is only sent when released. The shift is a weak modifier
+ * going out in the report of the key press, a tap still takes just the
+ * press and the release report.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "auto_shift.h"
+#include "keyboard.h"
+#include "usb_hid.h"
+
+#include "keycode.h"
+#include "keymap.h"
+#include "quantum_keycodes.h"
+
+struct auto_shift_cfg auto_shift_cfg = {
+    .enabled = false,
+    .timeout = AUTO_SHIFT_TIMEOUT,
+    .alpha = true,
+    .numeric = true,
+    .special = true,
+};
+
+static struct {
+    /* Held back press */
+    bool pending;
+    struct key_event press;
+    uint16_t keycode;
+
+    /* Keycode sent for the keys pressed through us, to release it */
+    uint16_t keys[MATRIX_ROWS][MATRIX_COLS];
+} as_state;
+
+static bool
+as_eligible(uint16_t keycode)
+{
+    switch (keycode) {
+        case KC_A...KC_Z:
+            return auto_shift_cfg.alpha;
+        case KC_1...KC_0:
+            return auto_shift_cfg.numeric;
+        case KC_MINS...KC_SLSH:
+            /* - = [ ] \ # ; ' ` , . / */
+            return auto_shift_cfg.special;
+        default:
+            return false;
+    }
+}
+
+/* Send the held back key as pressed, shifted if it was held long enough by now */
+static void
+as_resolve(uint32_t now)
+{
+    unsigned int col = as_state.press.col;
+    unsigned int row = as_state.press.row;
+    uint16_t keycode = as_state.keycode;
+
+    as_state.pending = false;
+
+    if ((now - as_state.press.time) >= auto_shift_cfg.timeout) {
+        keycode = LSFT(keycode);
+    }
+
+    as_state.keys[row][col] = keycode;
+    keyboard_do_code(col, row, keycode, true);
+}
+
+/* Returns true if the event was taken care of */
+bool
+auto_shift_process(const struct key_event *ev, uint16_t keycode)
+{
+    uint16_t *sent = &as_state.keys[ev->row][ev->col];
+
+    if (as_state.pending) {
+        if (!ev->down && (ev->col == as_state.press.col) && (ev->row == as_state.press.row)) {
+            as_resolve(ev->time);
+            keyboard_do_code(ev->col, ev->row, *sent, false);
+            *sent = KC_NO;
+            return true;
+        }
+        as_resolve(ev->time);
+    }
+
+    if (!ev->down) {
+        if (*sent != KC_NO) {
+            keyboard_do_code(ev->col, ev->row, *sent, false);
+            *sent = KC_NO;
+            return true;
+        }
+        return false;
+    }
+
+    /* Shortcuts and explicitly shifted keys go as they are */
+    if (!auto_shift_cfg.enabled || !as_eligible(keycode) || usb_hid_get_mods()) {
+        return false;
+    }
+
+    as_state.pending = true;
+    as_state.press = *ev;
+    as_state.keycode = keycode;
+
+    return true;
+}
+
+/* KC_ASxx configuration keys */
+void
+auto_shift_config(uint16_t keycode)
+{
+    switch (keycode) {
+#ifndef AUTO_SHIFT_NO_SETUP
+        case KC_ASUP:
+            auto_shift_cfg.timeout += 5;
+            break;
+        case KC_ASDN:
+            if (auto_shift_cfg.timeout > 5) {
+                auto_shift_cfg.timeout -= 5;
+            }
+            break;
+        case KC_ASRP:
+            auto_shift_print_state();
+            break;
+#endif
+        case KC_ASTG:
+            auto_shift_cfg.enabled = !auto_shift_cfg.enabled;
+            break;
+        case KC_ASON:
+            auto_shift_cfg.enabled = true;
+            break;
+        case KC_ASOFF:
+            auto_shift_cfg.enabled = false;
+            break;
+    }
+}
+
+void
+auto_shift_print_state(void)
+{
+    printf("auto shift %s timeout %d pending %d\n",
+        auto_shift_cfg.enabled ? "on" : "off", auto_shift_cfg.timeout, as_state.pending);
+}
+
+void
+auto_shift_init(void)
+{
+    memset(&as_state, 0, sizeof(as_state));
+}
@@ -0,0 +1,50 @@
+/*
+ * auto_shift.h
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "keyboard.h"
+
+#ifndef AUTO_SHIFT_TIMEOUT
+#define AUTO_SHIFT_TIMEOUT 175
+#endif
+
+struct auto_shift_cfg {
+    bool enabled;
+    /* Held at least this long in ms, the key is sent shifted */
+    uint16_t timeout;
+    /* Key classes that get auto shifted */
+    bool alpha;
+    bool numeric;
+    bool special;
+};
+
+extern struct auto_shift_cfg auto_shift_cfg;
+
+bool auto_shift_process(const struct key_event *ev, uint16_t keycode);
+void auto_shift_config(uint16_t keycode);
+void auto_shift_print_state(void);
+void auto_shift_init(void);
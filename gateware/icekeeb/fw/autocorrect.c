@@ -0,0 +1,274 @@
+/*
+ * autocorrect.c
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Autocorrect.
+ *
+ * The last keys typed are kept in a ring. On each key press, the key and
+ * the ring are walked newest first down the reverse trie of the typos,
+ * which stops at the first mismatch, so most keys only look at the root
+ * node. The start of the dictionary is cached in RAM, deeper nodes are
+ * read from flash a small window at a time.
+ *
+ * When a typo matches, the key completing it is swallowed and the
+ * backspaces and correction are typed by the macro player.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "autocorrect.h"
+#include "dynamic_macro.h"
+#include "macro.h"
+#include "spi.h"
+#include "usb_hid.h"
+
+#include "keycode.h"
+#include "keymap.h"
+
+#define AC_WINDOW 16
+#define AC_TEXT   32
+
+struct autocorrect_cfg autocorrect_cfg = {
+    .enabled = true,
+};
+
+static struct {
+    /* Dictionary */
+    unsigned int len;
+    uint8_t cache[AUTOCORRECT_CACHE];
+    unsigned int cache_len;
+    uint8_t window[AC_WINDOW];
+    unsigned int window_ofs;
+
+    /* Recent keys, ring[(head - 1) % size] is the last one */
+    uint8_t ring[AUTOCORRECT_BUFFER];
+    unsigned int head;
+    unsigned int count;
+
+    /* Keys swallowed, their release is swallowed as well */
+    matrix_mask_t swallowed;
+
+    /* Correction typed by the macro player */
+    uint8_t out[64 + AC_TEXT];
+
+    /* A byte past the cache was needed while the flash was busy */
+    bool missed;
+
+    unsigned int corrections;
+    unsigned int skipped;
+} ac_state;
+
+static uint8_t
+ac_byte(unsigned int ofs)
+{
+    if (ofs < ac_state.cache_len) {
+        return ac_state.cache[ofs];
+    }
+
+    if ((ofs - ac_state.window_ofs) >= AC_WINDOW) {
+        /* The store is programming or erasing, waiting for it would
+         * stall the scan. 0 never matches, the lookup fails. */
+        if (!flash_ready()) {
+            ac_state.missed = true;
+            return 0;
+        }
+        ac_state.window_ofs = ofs;
+        flash_read(ac_state.window, AUTOCORRECT_FLASH_ADDR + 4 + ofs, AC_WINDOW);
+    }
+    return ac_state.window[ofs - ac_state.window_ofs];
+}
+
+static void
+ac_reset(void)
+{
+    /* The start of the ring is a word boundary */
+    ac_state.ring[0] = KC_SPC;
+    ac_state.head = 1;
+    ac_state.count = 1;
+}
+
+static void
+ac_push(uint8_t key)
+{
+    ac_state.ring[ac_state.head] = key;
+    ac_state.head = (ac_state.head + 1) % AUTOCORRECT_BUFFER;
+    if (ac_state.count < AUTOCORRECT_BUFFER) {
+        ac_state.count++;
+    }
+}
+
+/* Walk the trie with key, then the ring. Returns the offset of the
+ * match node, or 0 if there is none. */
+static unsigned int
+ac_find(uint8_t key)
+{
+    unsigned int node = 0;
+    unsigned int idx = ac_state.head;
+
+    for (unsigned int i = 0; i <= ac_state.count; i++) {
+        uint8_t b = ac_byte(node);
+
+        if (b & AUTOCORRECT_BRANCH) {
+            unsigned int e = node + 1;
+            uint8_t c;
+
+            while ((c = ac_byte(e)) && (c != key)) {
+                e += 3;
+            }
+            if (!c) {
+                return 0;
+            }
+            node = ac_byte(e + 1) | (ac_byte(e + 2) << 8);
+        } else {
+            if (b != key) {
+                return 0;
+            }
+            node++;
+            if (!ac_byte(node)) {
+                node++;
+            }
+        }
+
+        if (ac_byte(node) & AUTOCORRECT_MATCH) {
+            return node;
+        }
+
+        if (i == ac_state.count) {
+            break;
+        }
+        idx = (idx + AUTOCORRECT_BUFFER - 1) % AUTOCORRECT_BUFFER;
+        key = ac_state.ring[idx];
+    }
+
+    return 0;
+}
+
+static void
+ac_correct(unsigned int node)
+{
+    unsigned int n = 0;
+    unsigned int bs = ac_byte(node++) & 0x3F;
+    uint8_t c;
+
+    while (bs--) {
+        ac_state.out[n++] = '\b';
+    }
+    while ((c = ac_byte(node++)) && (n < (sizeof(ac_state.out) - 1))) {
+        ac_state.out[n++] = c;
+    }
+    ac_state.out[n] = MACRO_END;
+
+    ac_state.corrections++;
+    macro_play(ac_state.out);
+}
+
+/* Returns true if the key was swallowed by a correction */
+bool
+autocorrect_process(unsigned int col, unsigned int row, uint16_t keycode, bool down)
+{
+    matrix_mask_t bit = MATRIX_BIT(col, row);
+
+    if (!down) {
+        if (ac_state.swallowed & bit) {
+            ac_state.swallowed &= ~bit;
+            return true;
+        }
+        return false;
+    }
+
+    if (!autocorrect_cfg.enabled || !ac_state.len || !IS_KEY(keycode)) {
+        return false;
+    }
+
+    /* Shortcuts aren't typing */
+    if (usb_hid_get_mods() & ~MOD_MASK_SHIFT) {
+        ac_reset();
+        return false;
+    }
+
+    if (keycode == KC_BSPC) {
+        if (ac_state.count > 1) {
+            ac_state.head = (ac_state.head + AUTOCORRECT_BUFFER - 1) % AUTOCORRECT_BUFFER;
+            ac_state.count--;
+        }
+        return false;
+    }
+
+    if (!(((keycode >= KC_A) && (keycode <= KC_Z)) || (keycode == KC_QUOT) || (keycode == KC_SPC))) {
+        ac_reset();
+        return false;
+    }
+
+    /* The macro player is busy, don't bother */
+    if (macro_playing() || dynamic_macro_playing()) {
+        ac_push(keycode);
+        return false;
+    }
+
+    ac_state.missed = false;
+    unsigned int node = ac_find(keycode);
+    if (ac_state.missed) {
+        ac_state.skipped++;
+        node = 0;
+    }
+    if (!node) {
+        ac_push(keycode);
+        return false;
+    }
+
+    ac_correct(node);
+    ac_reset();
+    ac_state.swallowed |= bit;
+
+    return true;
+}
+
+void
+autocorrect_print_state(void)
+{
+    printf("autocorrect %s dictionary %d bytes (%d cached) buffer %d corrections %d skipped %d\n",
+        autocorrect_cfg.enabled ? "on" : "off", ac_state.len, ac_state.cache_len,
+        ac_state.count, ac_state.corrections, ac_state.skipped);
+}
+
+void
+autocorrect_init(void)
+{
+    uint8_t hdr[4];
+
+    memset(&ac_state, 0, sizeof(ac_state));
+    ac_reset();
+
+    flash_read(hdr, AUTOCORRECT_FLASH_ADDR, sizeof(hdr));
+    if ((hdr[0] != 'A') || (hdr[1] != 'C')) {
+        /* No dictionary programmed */
+        return;
+    }
+
+    ac_state.len = hdr[2] | (hdr[3] << 8);
+    ac_state.cache_len = ac_state.len < AUTOCORRECT_CACHE ? ac_state.len : AUTOCORRECT_CACHE;
+    flash_read(ac_state.cache, AUTOCORRECT_FLASH_ADDR + 4, ac_state.cache_len);
+    ac_state.window_ofs = -AC_WINDOW;
+}
@@ -0,0 +1,62 @@
+/*
+ * autocorrect.h
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Dictionary image built by autocorrect_gen.py, programmed after the
+ * firmware image */
+#define AUTOCORRECT_FLASH_ADDR  0x000c0000
+
+/* Keys looked back at, bounds the work done per key */
+#define AUTOCORRECT_BUFFER      16
+
+/* Start of the dictionary kept in RAM, the nodes every key goes through */
+#define AUTOCORRECT_CACHE       512
+
+/* Dictionary format.
+ *
+ * 'A' 'C' and the 16 bit little endian length of the node data, then the
+ * nodes of a trie over the typos, last key first. Keys are the keycodes
+ * of a-z, ' and space for a word boundary, all below 0x40.
+ *
+ *   0x40 { key, child offset (16 bit LE) } ... 0x00     branch
+ *   key ... 0x00, followed by the next node             chain
+ *   0x80 | backspaces, correction text ... 0x00         match
+ *
+ * Child offsets are relative to the start of the node data.
+ */
+#define AUTOCORRECT_BRANCH      0x40
+#define AUTOCORRECT_MATCH       0x80
+
+struct autocorrect_cfg {
+    bool enabled;
+};
+
+extern struct autocorrect_cfg autocorrect_cfg;
+
+bool autocorrect_process(unsigned int col, unsigned int row, uint16_t keycode, bool down);
+void autocorrect_print_state(void);
+void autocorrect_init(void);
@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+#
+# Compiles the typo list into the dictionary image autocorrect.c reads
+# from flash, see autocorrect.h for the format.
+#
+# Each line of the list is 'typo -> correction', with ':' at either end
+# of the typo matching a word boundary. Lines starting with '#' are
+# comments.
+#
+
+import struct
+import sys
+
+
+def keycode(c):
+	if 'a' <= c <= 'z':
+		return 0x04 + ord(c) - ord('a')
+	if c == "'":
+		return 0x34
+	if c == ':':
+		return 0x2c
+	raise ValueError('unsupported character %r' % c)
+
+
+def parse(name):
+	entries = []
+	with open(name, 'r') as fh:
+		for line in fh:
+			line = line.strip()
+			if not line or line.startswith('#'):
+				continue
+			typo, correction = [x.strip() for x in line.split('->')]
+			entries.append((typo.lower(), correction))
+	return entries
+
+
+class Node:
+	def __init__(self):
+		self.children = {}
+		self.leaf = None
+		self.ofs = None
+
+
+def build(entries):
+	root = Node()
+	for typo, correction in entries:
+		# The last key typed is the first one looked at
+		node = root
+		for c in reversed(typo):
+			if node.leaf:
+				raise ValueError('%s has another typo as suffix' % typo)
+			node = node.children.setdefault(keycode(c), Node())
+		if node.children or node.leaf:
+			raise ValueError('%s is the suffix of another typo' % typo)
+
+		# The last key is held back, whatever was typed before it and the
+		# correction have in common doesn't need to be retyped. A word
+		# boundary at the end is the held back space.
+		typed = typo.lstrip(':').replace(':', ' ')[:-1]
+		if typo.endswith(':'):
+			correction += ' '
+		common = 0
+		while common < min(len(typed), len(correction)) and typed[common] == correction[common]:
+			common += 1
+		node.leaf = (len(typed) - common, correction[common:])
+	return root
+
+
+def serialize(root):
+	# Breadth first over the branches, so the nodes visited for every key
+	# end up at the start of the image and in the RAM cache.
+	data = bytearray()
+	fixups = []
+	queue = [root]
+
+	while queue:
+		node = queue.pop(0)
+		node.ofs = len(data)
+
+		# Chains of single children are stored inline
+		chain = []
+		while not node.leaf and len(node.children) == 1:
+			(c, child), = node.children.items()
+			chain.append(c)
+			node = child
+		if chain:
+			data += bytes(chain) + b'\x00'
+
+		if node.leaf:
+			bs, text = node.leaf
+			if bs > 0x3f:
+				raise ValueError('too many backspaces for %r' % text)
+			data += bytes([0x80 | bs]) + text.encode('ascii') + b'\x00'
+		else:
+			data += b'\x40'
+			for c in sorted(node.children):
+				data += bytes([c, 0, 0])
+				fixups.append((len(data) - 2, node.children[c]))
+				queue.append(node.children[c])
+			data += b'\x00'
+
+	for pos, child in fixups:
+		struct.pack_into('<H', data, pos, child.ofs)
+
+	if len(data) > 0xffff:
+		raise ValueError('dictionary too large')
+
+	return data
+
+
+def main(argv0, in_name, out_name):
+	data = serialize(build(parse(in_name)))
+
+	with open(out_name, 'wb') as fh:
+		fh.write(b'AC' + struct.pack('<H', len(data)) + data)
+
+if __name__ == '__main__':
+	main(*sys.argv)
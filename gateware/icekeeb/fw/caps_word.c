@@ -0,0 +1,104 @@
+/*
+ * caps_word.c
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Caps word.
+ *
+ * While active, letters and '-' are sent with a weak shift, in the same
+ * report as the key press. Digits, backspace and delete continue the
+ * word unshifted, any other key ends it. The idle timeout is checked
+ * against the time of the next key press, not by a timer.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "caps_word.h"
+#include "usb_hid.h"
+
+#include "keycode.h"
+
+#include <no2usb/usb.h>
+
+static struct {
+    bool active;
+    uint32_t last;
+} cw_state;
+
+void
+caps_word_toggle(void)
+{
+    cw_state.active = !cw_state.active;
+    cw_state.last = usb_get_tick();
+}
+
+bool
+caps_word_active(void)
+{
+    return cw_state.active;
+}
+
+/* Called for each basic key, before it goes to the HID layer */
+void
+caps_word_key(uint16_t keycode, bool down, uint32_t now)
+{
+    if (!cw_state.active || !down || IS_MOD(keycode)) {
+        return;
+    }
+
+    if (CAPS_WORD_IDLE_TIMEOUT && ((now - cw_state.last) >= CAPS_WORD_IDLE_TIMEOUT)) {
+        cw_state.active = false;
+        return;
+    }
+    cw_state.last = now;
+
+    switch (keycode) {
+        case KC_A...KC_Z:
+        case KC_MINS:
+            /* Weak modifiers only last for the next report */
+            usb_hid_set_weak_mod(MOD_BIT(KC_LSHIFT));
+            break;
+
+        case KC_1...KC_0:
+        case KC_BSPC:
+        case KC_DEL:
+            break;
+
+        default:
+            cw_state.active = false;
+            break;
+    }
+}
+
+void
+caps_word_print_state(void)
+{
+    printf("caps word active %d\n", cw_state.active);
+}
+
+void
+caps_word_init(void)
+{
+    memset(&cw_state, 0, sizeof(cw_state));
+}
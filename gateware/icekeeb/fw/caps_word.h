@@ -0,0 +1,38 @@
+/*
+ * caps_word.h
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Caps word turns itself off after this many ms without a key press, 0 to disable */
+#ifndef CAPS_WORD_IDLE_TIMEOUT
+#define CAPS_WORD_IDLE_TIMEOUT 5000
+#endif
+
+void caps_word_toggle(void);
+bool caps_word_active(void);
+void caps_word_key(uint16_t keycode, bool down, uint32_t now);
+void caps_word_print_state(void);
+void caps_word_init(void);
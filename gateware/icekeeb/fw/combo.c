@@ -0,0 +1,445 @@
+/*
+ * combo.c
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Chorded combos.
+ *
+ * Every combo is a mask over the matrix. At init, all the combo masks and
+ * all their proper sub-chords are put into a small open addressing hash
+ * table, tagged as "exact" and/or "prefix". While keys are being pressed,
+ * the set of pressed combo keys is looked up in that table, so deciding
+ * whether to fire, wait or give up costs one probe whatever the number of
+ * combos is.
+ *
+ * A combo has at most COMBO_MAX_KEYS keys, so it takes at most 15 slots.
+ * The table is sized from the combos at init and never more than half
+ * full, which keeps the probe sequences short, misses included. Combos
+ * that don't fit are dropped and counted.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "combo.h"
+#include "keyboard.h"
+#include "keymap.h"
+#include "steno.h"
+
+#include "keycode.h"
+
+#define COMBO_HASH_MAX (1 << COMBO_HASH_MAX_BITS)
+
+#define COMBO_EXACT  (1 << 14)   /* the mask is a combo */
+#define COMBO_PREFIX (1 << 15)   /* the mask is a strict subset of a combo */
+#define COMBO_INDEX  0x3FFF
+
+/* Packed in 8 bytes, the matrix fits in 48 bits */
+struct combo_slot {
+    uint32_t lo;
+    uint16_t hi;
+    uint16_t info;
+};
+
+_Static_assert(MATRIX_ROWS * MATRIX_COLS <= 48, "combo slots can't hold the matrix");
+
+static struct {
+    bool enabled;
+
+    /* Union of all the keys used in any combo */
+    matrix_mask_t members;
+
+    struct combo_slot table[COMBO_HASH_MAX];
+    unsigned int hash_mask;
+    unsigned int used;
+    unsigned int dropped;
+
+    /* Chord being collected */
+    matrix_mask_t pressed;
+    uint32_t start;
+    struct key_event buf[COMBO_BUFFER];
+    int buf_len;
+
+    /* Fired combos whose keys are still held */
+    struct {
+        matrix_mask_t keys;
+        uint16_t keycode;
+        uint8_t col;
+        uint8_t row;
+        bool released;
+    } active[COMBO_MAX_ACTIVE];
+    matrix_mask_t held;
+} combo_state;
+
+static unsigned int
+combo_hash(uint32_t lo, uint32_t hi)
+{
+    uint32_t h = lo ^ (hi << 5);
+
+    h ^= h >> 15;
+    h ^= h >> 7;
+    return h & combo_state.hash_mask;
+}
+
+static struct combo_slot *
+combo_find(matrix_mask_t keys, bool insert)
+{
+    uint32_t lo = keys;
+    uint32_t hi = keys >> 32;
+    unsigned int i = combo_hash(lo, hi);
+
+    for (unsigned int n = 0; n <= combo_state.hash_mask; n++) {
+        struct combo_slot *slot = &combo_state.table[i];
+        if ((slot->lo == lo) && (slot->hi == hi)) {
+            return slot->info ? slot : NULL;
+        }
+        if (!slot->info) {
+            if (!insert) {
+                return NULL;
+            }
+            slot->lo = lo;
+            slot->hi = hi;
+            combo_state.used++;
+            return slot;
+        }
+        i = (i + 1) & combo_state.hash_mask;
+    }
+
+    return NULL;
+}
+
+/* combo_init() made sure there is room */
+static void
+combo_insert(matrix_mask_t keys, uint16_t flags, uint16_t combo)
+{
+    struct combo_slot *slot = combo_find(keys, true);
+
+    /* The first combo defined wins for duplicate masks */
+    if ((flags & COMBO_EXACT) && !(slot->info & COMBO_EXACT)) {
+        slot->info |= combo;
+    }
+    slot->info |= flags;
+}
+
+static uint16_t
+combo_flags(matrix_mask_t keys)
+{
+    struct combo_slot *slot = combo_find(keys, false);
+
+    return slot ? slot->info & (COMBO_EXACT | COMBO_PREFIX) : 0;
+}
+
+/* The later stages never call back into the combo stage, so the buffer
+ * can be replayed in place without a copy on the (small) stack.
+ */
+static void
+combo_flush(void)
+{
+    int n = combo_state.buf_len;
+
+    combo_state.pressed = 0;
+    combo_state.buf_len = 0;
+
+    for (int i = 0; i < n; i++) {
+        keyboard_event(KB_STAGE_TAP_HOLD, &combo_state.buf[i]);
+    }
+}
+
+static void
+combo_fire(void)
+{
+    struct combo_slot *slot = combo_find(combo_state.pressed, false);
+    uint16_t keycode = keymap_combos[slot->info & COMBO_INDEX].keycode;
+    matrix_mask_t keys = combo_state.pressed;
+    int i, n = combo_state.buf_len;
+
+    for (i = 0; i < COMBO_MAX_ACTIVE; i++) {
+        if (!combo_state.active[i].keys) {
+            break;
+        }
+    }
+
+    if (i == COMBO_MAX_ACTIVE) {
+        /* No room to track it, just type the keys */
+        combo_flush();
+        return;
+    }
+
+    /* Report the combo from the position of its first key */
+    for (int j = 0; j < n; j++) {
+        struct key_event *ev = &combo_state.buf[j];
+        if (ev->down && (keys & MATRIX_BIT(ev->col, ev->row))) {
+            combo_state.active[i].col = ev->col;
+            combo_state.active[i].row = ev->row;
+            break;
+        }
+    }
+
+    combo_state.active[i].keys = keys;
+    combo_state.active[i].keycode = keycode;
+    combo_state.active[i].released = false;
+    combo_state.held |= keys;
+
+    combo_state.pressed = 0;
+    combo_state.buf_len = 0;
+
+    keyboard_do_code(combo_state.active[i].col, combo_state.active[i].row, keycode, true);
+
+    /* Unrelated events that were held back with the chord */
+    for (int j = 0; j < n; j++) {
+        struct key_event *ev = &combo_state.buf[j];
+        if (!(ev->down && (keys & MATRIX_BIT(ev->col, ev->row)))) {
+            keyboard_event(KB_STAGE_TAP_HOLD, ev);
+        }
+    }
+}
+
+/* Settle the current chord with what we know right now */
+static void
+combo_decide(void)
+{
+    if (combo_flags(combo_state.pressed) & COMBO_EXACT) {
+        combo_fire();
+    } else {
+        combo_flush();
+    }
+}
+
+static void
+combo_release(matrix_mask_t bit)
+{
+    for (int i = 0; i < COMBO_MAX_ACTIVE; i++) {
+        if (!(combo_state.active[i].keys & bit)) {
+            continue;
+        }
+
+        /* The first key going up releases the combo, the others are eaten */
+        if (!combo_state.active[i].released) {
+            keyboard_do_code(combo_state.active[i].col, combo_state.active[i].row,
+                combo_state.active[i].keycode, false);
+            combo_state.active[i].released = true;
+        }
+
+        combo_state.active[i].keys &= ~bit;
+        break;
+    }
+
+    combo_state.held &= ~bit;
+}
+
+/* Returns true if the event was consumed by the combo engine */
+bool
+combo_process(const struct key_event *ev)
+{
+    matrix_mask_t bit = MATRIX_BIT(ev->col, ev->row);
+
+    if (combo_state.held & bit) {
+        if (!ev->down) {
+            combo_release(bit);
+        }
+        return true;
+    }
+
+    if (!combo_state.enabled) {
+        return false;
+    }
+
+    /* Steno chords belong to the steno engine, whatever their shape */
+    if (IS_STENO(keymap_get_code(ev->col, ev->row))) {
+        if (combo_state.pressed) {
+            combo_decide();
+        }
+        return false;
+    }
+
+    if (!ev->down) {
+        if (combo_state.pressed & bit) {
+            /* A chord key went up before anything was decided */
+            combo_decide();
+            return combo_process(ev);
+        }
+
+        if (combo_state.pressed) {
+            if (combo_state.buf_len == COMBO_BUFFER) {
+                combo_decide();
+                return false;
+            }
+            /* Keep the order with the chord presses we are holding back */
+            combo_state.buf[combo_state.buf_len++] = *ev;
+            return true;
+        }
+
+        return false;
+    }
+
+    if (!(combo_state.members & bit)) {
+        if (combo_state.pressed) {
+            combo_decide();
+        }
+        return false;
+    }
+
+    if (combo_state.pressed && ((ev->time - combo_state.start) >= COMBO_TERM)) {
+        combo_decide();
+    }
+
+    matrix_mask_t next = combo_state.pressed | bit;
+    uint16_t flags = combo_flags(next);
+
+    if (!flags || (combo_state.buf_len == COMBO_BUFFER)) {
+        /* This key doesn't extend the chord, settle it and start over */
+        combo_decide();
+        if (!combo_flags(bit)) {
+            return false;
+        }
+        next = bit;
+        flags = combo_flags(next);
+    }
+
+    if (!combo_state.pressed) {
+        combo_state.start = ev->time;
+    }
+
+    combo_state.pressed = next;
+    combo_state.buf[combo_state.buf_len++] = *ev;
+
+    /* Nothing larger to wait for, no need to wait for the term */
+    if (flags == COMBO_EXACT) {
+        combo_fire();
+    }
+
+    return true;
+}
+
+void
+combo_task(uint32_t now)
+{
+    if (combo_state.pressed && ((now - combo_state.start) >= COMBO_TERM)) {
+        combo_decide();
+    }
+}
+
+void
+combo_enable(bool enable)
+{
+    if (!enable && combo_state.pressed) {
+        combo_flush();
+    }
+    combo_state.enabled = enable;
+}
+
+bool
+combo_enabled(void)
+{
+    return combo_state.enabled;
+}
+
+void
+combo_print_state(void)
+{
+    printf("combos %d (%d dropped) slots %d/%d\n", keymap_combo_count, combo_state.dropped,
+        combo_state.used, combo_state.hash_mask + 1);
+    printf("enabled %d pressed %08X%08X held %08X%08X\n",
+        combo_state.enabled,
+        (uint32_t)(combo_state.pressed >> 32), (uint32_t)combo_state.pressed,
+        (uint32_t)(combo_state.held >> 32), (uint32_t)combo_state.held);
+}
+
+/* Slots a combo needs at most, 0 if it can't be one */
+static unsigned int
+combo_slots(matrix_mask_t keys)
+{
+    unsigned int n = 0;
+
+    for (; keys; keys &= keys - 1) {
+        n++;
+    }
+
+    return (n && (n <= COMBO_MAX_KEYS)) ? (1 << n) - 1 : 0;
+}
+
+/* Slots a combo would add, sub-chords of other combos are shared */
+static unsigned int
+combo_new_slots(matrix_mask_t keys)
+{
+    unsigned int n = !combo_find(keys, false);
+
+    for (matrix_mask_t sub = (keys - 1) & keys; sub; sub = (sub - 1) & keys) {
+        n += !combo_find(sub, false);
+    }
+
+    return n;
+}
+
+void
+combo_init(void)
+{
+    unsigned int need = 0;
+    unsigned int size = 16;
+
+    memset(&combo_state, 0, sizeof(combo_state));
+
+    /* Twice the worst case, shared sub-chords only make it emptier */
+    for (unsigned int i = 0; i < keymap_combo_count; i++) {
+        need += combo_slots(keymap_combos[i].keys);
+    }
+    while ((size < (need << 1)) && (size < COMBO_HASH_MAX)) {
+        size <<= 1;
+    }
+    combo_state.hash_mask = size - 1;
+
+    for (unsigned int i = 0; i < keymap_combo_count; i++) {
+        matrix_mask_t keys = keymap_combos[i].keys;
+        if (!combo_slots(keys) || ((combo_state.used + combo_new_slots(keys)) > (size >> 1))) {
+            combo_state.dropped++;
+            continue;
+        }
+
+        combo_insert(keys, COMBO_EXACT, i);
+
+        /* Every strict non empty subset is a prefix of this combo */
+        for (matrix_mask_t sub = (keys - 1) & keys; sub; sub = (sub - 1) & keys) {
+            combo_insert(sub, COMBO_PREFIX, 0);
+        }
+
+        combo_state.members |= keys;
+    }
+
+    if (combo_state.dropped) {
+        printf("%d combos dropped, too many keys or no room\n", combo_state.dropped);
+    }
+
+    combo_state.enabled = true;
+}
+
+/* Rebuilds the lookup table after the combos changed, keys pressed at the
+ * time are resolved against the old one first */
+void
+combo_reload(void)
+{
+    bool enabled = combo_state.enabled;
+
+    combo_enable(false);
+    combo_init();
+    combo_state.enabled = enabled;
+}
@@ -0,0 +1,61 @@
+/*
+ * combo.h
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "keyboard.h"
+
+/* Time in ms in which all the keys of a combo have to be pressed */
+#ifndef COMBO_TERM
+#define COMBO_TERM 50
+#endif
+
+/* Keys in a combo at most, a combo takes 2^keys - 1 lookup slots */
+#ifndef COMBO_MAX_KEYS
+#define COMBO_MAX_KEYS 4
+#endif
+
+/* Largest lookup table (log2). The size used is picked at init from the
+ * combos, it is kept at most half full. */
+#ifndef COMBO_HASH_MAX_BITS
+#define COMBO_HASH_MAX_BITS 10
+#endif
+
+#ifndef COMBO_BUFFER
+#define COMBO_BUFFER 8
+#endif
+
+#ifndef COMBO_MAX_ACTIVE
+#define COMBO_MAX_ACTIVE 4
+#endif
+
+bool combo_process(const struct key_event *ev);
+void combo_task(uint32_t now);
+void combo_enable(bool enable);
+bool combo_enabled(void);
+void combo_print_state(void);
+void combo_reload(void);
+void combo_init(void);
@@ -24,6 +24,7 @@
 #include <stdint.h>
 
 #include "config.h"
+#include "console.h"
 #include "mini-printf.h"
 
 
@@ -34,42 +35,142 @@ struct wb_uart {
 
 static volatile struct wb_uart * const uart_regs = (void*)(UART_BASE);
 
+/* Data register read bits. Reading it also pops the RX FIFO. */
+#define UART_RX_EMPTY	(1 << 31)
+#define UART_TX_FULL	(1 << 30)
+
+/* UART output is queued here and sent by console_poll() as the FIFO
+ * frees up, so printing never holds the main loop at the UART speed */
+#define UART_TX_SIZE	2048	/* bytes, power of 2 */
+#define UART_TX_BURST	16	/* bytes per console_poll() at most */
+
 
 static char _printf_buf[128];
 
+/* NULL for the UART */
+static const struct console_port *console_port;
+
+static struct {
+	char buf[UART_TX_SIZE];
+	uint32_t head;
+	uint32_t tail;
+	uint32_t dropped;
+
+	/* A character read while looking at the TX FIFO state, -1 if none */
+	int rx_held;
+} uart_tx;
+
 void console_init(void)
 {
 	uart_regs->clkdiv = 22;	/* 1 Mbaud with clk=24MHz */
+	uart_tx.rx_held = -1;
 }
 
-char getchar(void)
+static int _uart_read(void)
 {
 	int32_t c;
+
+	if (uart_tx.rx_held >= 0) {
+		c = uart_tx.rx_held;
+		uart_tx.rx_held = -1;
+		return c;
+	}
+
+	c = uart_regs->data;
+	return c & UART_RX_EMPTY ? -1 : (c & 0xff);
+}
+
+void console_poll(void)
+{
+	int32_t s;
+	int n;
+
+	for (n = 0; n < UART_TX_BURST; n++) {
+		/* While a character is held, looking at the FIFO state would
+		 * pop the next one */
+		if ((uart_tx.head == uart_tx.tail) || (uart_tx.rx_held >= 0))
+			break;
+
+		s = uart_regs->data;
+		if (!(s & UART_RX_EMPTY))
+			uart_tx.rx_held = s & 0xff;
+		if (s & UART_TX_FULL)
+			break;
+
+		uart_regs->data = uart_tx.buf[uart_tx.tail++ & (UART_TX_SIZE - 1)];
+	}
+}
+
+unsigned int console_dropped(void)
+{
+	return uart_tx.dropped;
+}
+
+void console_set_port(const struct console_port *port)
+{
+	console_port = port;
+}
+
+const struct console_port *console_get_port(void)
+{
+	return console_port;
+}
+
+static void _console_write(const char *p, int len)
+{
+	if (console_port) {
+		console_port->write(p, len);
+		return;
+	}
+
+	while (len--) {
+		if ((uart_tx.head - uart_tx.tail) == UART_TX_SIZE) {
+			uart_tx.dropped += len + 1;
+			break;
+		}
+		uart_tx.buf[uart_tx.head++ & (UART_TX_SIZE - 1)] = *(p++);
+	}
+}
+
+char getchar(void)
+{
+	int c;
 	do {
-		c = uart_regs->data;
-	} while (c & 0x80000000);
+		console_poll();
+		c = getchar_nowait();
+	} while (c < 0);
 	return c;
 }
 
+/* The UART is read whatever the port, so it can always take the
+ * console back */
 int getchar_nowait(void)
 {
-	int32_t c;
-	c = uart_regs->data;
-	return c & 0x80000000 ? -1 : (c & 0xff);
+	int c = _uart_read();
+	if (c >= 0)
+		return c;
+	return console_port ? console_port->getc() : -1;
 }
 
 void putchar(char c)
 {
-	uart_regs->data = c;
+	_console_write(&c, 1);
 }
 
+/* Line by line, so a port gets the text in as few writes as possible */
 void puts(const char *p)
 {
-	char c;
-	while ((c = *(p++)) != 0x00) {
-		if (c == '\n')
-			uart_regs->data = '\r';
-		uart_regs->data = c;
+	const char *s = p;
+
+	while (1) {
+		while (*p && (*p != '\n'))
+			p++;
+		if (p != s)
+			_console_write(s, p - s);
+		if (!*p)
+			break;
+		_console_write("\r\n", 2);
+		s = ++p;
 	}
 }
 
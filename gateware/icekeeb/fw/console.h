@@ -23,7 +23,18 @@
 
 #pragma once
 
+/* Where the console output goes instead of the UART. write() may drop
+ * what doesn't fit, getc() returns -1 when there is nothing to read. */
+struct console_port {
+	void (*write)(const char *p, int len);
+	int  (*getc)(void);
+};
+
 void console_init(void);
+void console_poll(void);
+unsigned int console_dropped(void);
+void console_set_port(const struct console_port *port);
+const struct console_port *console_get_port(void);
 
 char getchar(void);
 int  getchar_nowait(void);
@@ -0,0 +1,272 @@
+/*
+ * dynamic_macro.c
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Dynamic macros, recorded into RAM at runtime.
+ *
+ * The recordings live in the SPRAM left free after .bss, between the
+ * _heap_start and _heap_end linker symbols. Slot 0 grows up from the
+ * bottom, slot 1 grows down from the top, so either can use all the
+ * space the other one doesn't.
+ *
+ * Each event is delta encoded against the previous one:
+ *
+ *   D E t t t t t t   D: press, E: more delay bytes follow, t: delay [5:0]
+ *   [C d d d d d d d] C: more delay bytes follow, d: next 7 delay bits
+ *   keycode
+ *
+ * so keys typed less than 64 ms apart take two bytes.
+ *
+ * Replay goes through the macro keys of the HID layer, usb_hid_poll()
+ * calls dynamic_macro_step() each time the IN buffer is free.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dynamic_macro.h"
+#include "macro.h"
+#include "usb_hid.h"
+
+#include "keycode.h"
+
+#include <no2usb/usb.h>
+
+extern uint8_t _heap_start;
+extern uint8_t _heap_end;
+
+struct dynamic_macro_cfg dynamic_macro_cfg = {
+    .real_time = false,
+};
+
+struct dm_slot {
+    uint8_t *base;
+    int dir;
+    unsigned int len;
+};
+
+static struct {
+    struct dm_slot slots[2];
+
+    /* Recording */
+    int rec;
+    uint32_t rec_time;
+
+    /* Replay */
+    int play;
+    unsigned int pos;
+    bool started;
+    uint32_t last_time;
+    uint8_t mods;
+} dm_state;
+
+static uint8_t *
+dm_byte(struct dm_slot *slot, unsigned int pos)
+{
+    return slot->dir > 0 ? slot->base + pos : slot->base - pos;
+}
+
+static unsigned int
+dm_free(void)
+{
+    return (&_heap_end - &_heap_start) - dm_state.slots[0].len - dm_state.slots[1].len;
+}
+
+void
+dynamic_macro_record_start(int slot)
+{
+    /* Hitting the record key again ends the recording */
+    if (dm_state.rec == slot) {
+        dm_state.rec = -1;
+        return;
+    }
+
+    dynamic_macro_abort();
+
+    dm_state.rec = slot;
+    dm_state.rec_time = usb_get_tick();
+    dm_state.slots[slot].len = 0;
+}
+
+void
+dynamic_macro_record_stop(void)
+{
+    dm_state.rec = -1;
+}
+
+void
+dynamic_macro_record(uint8_t keycode, bool down)
+{
+    uint8_t buf[6];
+    unsigned int n = 0;
+
+    if (dm_state.rec < 0) {
+        return;
+    }
+
+    uint32_t now = usb_get_tick();
+    uint32_t delay = now - dm_state.rec_time;
+    dm_state.rec_time = now;
+
+    buf[n++] = (down ? 0x80 : 0x00) | (delay > 0x3F ? 0x40 : 0x00) | (delay & 0x3F);
+    delay >>= 6;
+    while (delay) {
+        buf[n++] = (delay > 0x7F ? 0x80 : 0x00) | (delay & 0x7F);
+        delay >>= 7;
+    }
+    buf[n++] = keycode;
+
+    if (n > dm_free()) {
+        /* Arena full, keep what we have */
+        printf("dynamic macro %d full\n", dm_state.rec + 1);
+        dm_state.rec = -1;
+        return;
+    }
+
+    struct dm_slot *slot = &dm_state.slots[dm_state.rec];
+    for (unsigned int i = 0; i < n; i++) {
+        *dm_byte(slot, slot->len++) = buf[i];
+    }
+}
+
+void
+dynamic_macro_play(int slot)
+{
+    if (dm_state.rec >= 0) {
+        /* Playing back from within the recording would loop forever */
+        return;
+    }
+
+    /* Pressing the key of a running replay stops it */
+    if (dm_state.play == slot) {
+        dynamic_macro_abort();
+        return;
+    }
+
+    macro_abort();
+    dynamic_macro_abort();
+
+    dm_state.play = slot;
+    dm_state.pos = 0;
+    dm_state.started = false;
+    dm_state.mods = 0;
+}
+
+void
+dynamic_macro_abort(void)
+{
+    if (dm_state.play >= 0) {
+        dm_state.play = -1;
+        usb_hid_macro_clear();
+    }
+}
+
+bool
+dynamic_macro_playing(void)
+{
+    return dm_state.play >= 0;
+}
+
+/* Apply the next recorded event, returns true if a report has to be sent */
+bool
+dynamic_macro_step(uint32_t now)
+{
+    if (dm_state.play < 0) {
+        return false;
+    }
+
+    struct dm_slot *slot = &dm_state.slots[dm_state.play];
+
+    if (dm_state.pos >= slot->len) {
+        dynamic_macro_abort();
+        return true;
+    }
+
+    unsigned int pos = dm_state.pos;
+    uint8_t hdr = *dm_byte(slot, pos++);
+    uint32_t delay = hdr & 0x3F;
+    bool more = (hdr & 0x40) != 0;
+
+    for (int shift = 6; more; shift += 7) {
+        uint8_t b = *dm_byte(slot, pos++);
+        delay |= (uint32_t)(b & 0x7F) << shift;
+        more = (b & 0x80) != 0;
+    }
+
+    if (!dm_state.started) {
+        dm_state.started = true;
+        dm_state.last_time = now;
+    }
+
+    /* Events are scheduled against the previous one's due time, not the
+     * time it actually went out, so waiting for the endpoint doesn't add
+     * up over the replay. */
+    if (dynamic_macro_cfg.real_time) {
+        if ((int32_t)(now - (dm_state.last_time + delay)) < 0) {
+            return false;
+        }
+        dm_state.last_time += delay;
+    }
+
+    uint8_t keycode = *dm_byte(slot, pos++);
+    dm_state.pos = pos;
+
+    if (IS_MOD(keycode)) {
+        if (hdr & 0x80) {
+            dm_state.mods |= MOD_BIT(keycode);
+        } else {
+            dm_state.mods &= ~MOD_BIT(keycode);
+        }
+        usb_hid_macro_mods(dm_state.mods);
+    } else if (hdr & 0x80) {
+        usb_hid_macro_press(keycode);
+    } else {
+        usb_hid_macro_release(keycode);
+    }
+
+    return true;
+}
+
+void
+dynamic_macro_print_state(void)
+{
+    printf("dynamic macros: %d / %d bytes, free %d, recording %d playing %d%s\n",
+        dm_state.slots[0].len, dm_state.slots[1].len, dm_free(),
+        dm_state.rec + 1, dm_state.play + 1,
+        dynamic_macro_cfg.real_time ? " (real time)" : "");
+}
+
+void
+dynamic_macro_init(void)
+{
+    memset(&dm_state, 0, sizeof(dm_state));
+
+    dm_state.slots[0].base = &_heap_start;
+    dm_state.slots[0].dir = 1;
+    dm_state.slots[1].base = &_heap_end - 1;
+    dm_state.slots[1].dir = -1;
+
+    dm_state.rec = -1;
+    dm_state.play = -1;
+}
@@ -0,0 +1,44 @@
+/*
+ * dynamic_macro.h
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct dynamic_macro_cfg {
+    /* Replay with the recorded timing instead of as fast as possible */
+    bool real_time;
+};
+
+extern struct dynamic_macro_cfg dynamic_macro_cfg;
+
+void dynamic_macro_record_start(int slot);
+void dynamic_macro_record_stop(void);
+void dynamic_macro_record(uint8_t keycode, bool down);
+void dynamic_macro_play(int slot);
+void dynamic_macro_abort(void);
+bool dynamic_macro_playing(void);
+bool dynamic_macro_step(uint32_t now);
+void dynamic_macro_print_state(void);
+void dynamic_macro_init(void);
@@ -32,9 +32,30 @@
 #include "spi.h"
 #include "utils.h"
 
+#include "usb_cdc.h"
+#include "usb_extra.h"
 #include "usb_hid.h"
+#include "usb_mouse.h"
+#include "usb_raw.h"
 #include "keyboard.h"
+#include "auto_shift.h"
+#include "autocorrect.h"
+#include "caps_word.h"
+#include "key_override.h"
 #include "keymap.h"
+#include "kvstore.h"
+#include "leader.h"
+#include "combo.h"
+#include "dynamic_macro.h"
+#include "macro.h"
+#include "mousekey.h"
+#include "oneshot.h"
+#include "steno.h"
+#include "swap_hands.h"
+#include "tap_dance.h"
+#include "tap_hold.h"
+#include "trace.h"
+#include "unicode.h"
 
 #include <no2usb/usb.h>
 #include <no2usb/usb_dfu_rt.h>
@@ -91,7 +112,33 @@ help(void)
 		"  d: Disconnect USB\n"
 		"  r: Read row values\n"
 		"  h: Print hid internal state\n"
+		"  N: Toggle NKRO\n"
 		"  k: Print keymap state\n"
+		"  t: Print tap-hold state\n"
+		"  o: Print combo state\n"
+		"  y: Print tap dance state\n"
+		"  1: Print one-shot state\n"
+		"  m: Print macro state\n"
+		"  M: Print dynamic macro state\n"
+		"  R: Toggle real time dynamic macro replay\n"
+		"  u: Print unicode state\n"
+		"  a: Toggle autocorrect\n"
+		"  v: Print key override state\n"
+		"  w: Print swap hands state\n"
+		"  s: Print auto shift and caps word state\n"
+		"  n: Print steno, CDC and console state\n"
+		"  x: Print mouse keys state\n"
+		"  e: Print media keys state\n"
+		"  g: Print keymap config interface state\n"
+		"  f: Print flash store state\n"
+		"  F: Save the tuning to flash\n"
+		"  C: Move the console between UART and USB serial\n"
+#ifdef LEADER_ENABLE
+		"  l: Print leader state\n"
+#endif
+#ifdef TRACE_ENABLE
+		"  T: Switch the trace output\n"
+#endif
 	);
 }
 
@@ -117,9 +164,20 @@ void main()
 
 	/* Enable USB directly */
 	serial_no_init();
+	kv_init();
 	usb_init(&app_stack_desc);
 	usb_dfu_rt_init();
 	usb_hid_init();
+	usb_cdc_init();
+#ifdef TRACE_ENABLE
+	trace_init();
+#endif
+#ifdef CDC_CONSOLE_ENABLE
+	console_set_port(&usb_cdc_console);
+#endif
+	usb_mouse_init();
+	usb_extra_init();
+	usb_raw_init();
 	usb_connect();
 	keyboard_init();
 
@@ -163,9 +221,93 @@ void main()
 			case 'h':
 				hid_print = !hid_print;
 				break;
+			case 'N':
+				usb_hid_set_nkro(!usb_hid_get_nkro());
+				printf("NKRO %s\n", usb_hid_get_nkro() ? "on" : "off");
+				break;
 			case 'k':
 				keymap_print_state();
 				break;
+			case 't':
+				tap_hold_print_state();
+				break;
+			case 'o':
+				combo_print_state();
+				break;
+			case 'y':
+				tap_dance_print_state();
+				break;
+			case '1':
+				oneshot_print_state();
+				break;
+			case 'm':
+				macro_print_state();
+				break;
+			case 'M':
+				dynamic_macro_print_state();
+				break;
+#ifdef LEADER_ENABLE
+			case 'l':
+				leader_print_state();
+				break;
+#endif
+#ifdef TRACE_ENABLE
+			case 'T':
+				trace_set_output(trace_get_output() == TRACE_OUT_OFF ?
+					TRACE_OUT_CONSOLE : trace_get_output() + 1);
+				trace_print_state();
+				break;
+#endif
+			case 's':
+				auto_shift_print_state();
+				caps_word_print_state();
+				break;
+			case 'w':
+				swap_hands_print_state();
+				break;
+			case 'x':
+				mousekey_print_state();
+				break;
+			case 'e':
+				usb_extra_debug_print();
+				break;
+			case 'g':
+				usb_raw_debug_print();
+				break;
+			case 'f':
+				kv_print_state();
+				break;
+			case 'F':
+				if (!keyboard_settings_save())
+					printf("No room in the flash store\n");
+				break;
+			case 'C':
+				if (!console_get_port() && steno_active()) {
+					printf("USB serial in use by steno\n");
+					break;
+				}
+				console_set_port(console_get_port() ? NULL : &usb_cdc_console);
+				printf("Console on %s\n", console_get_port() ? "USB serial" : "UART");
+				break;
+			case 'n':
+				steno_print_state();
+				usb_cdc_debug_print();
+				printf("UART console dropped %d bytes\n", (int)console_dropped());
+				break;
+			case 'v':
+				key_override_print_state();
+				break;
+			case 'a':
+				autocorrect_cfg.enabled = !autocorrect_cfg.enabled;
+				autocorrect_print_state();
+				break;
+			case 'u':
+				unicode_print_state();
+				break;
+			case 'R':
+				dynamic_macro_cfg.real_time = !dynamic_macro_cfg.real_time;
+				dynamic_macro_print_state();
+				break;
 			default:
 				printf("Unknown command '%c'\r\n", cmd);
 				help();
@@ -177,9 +319,20 @@ void main()
 			keyboard_print_state();
 		}
 
+		/* Console output, a bounded burst per pass */
+		console_poll();
+
 		/* Key poll */
 		keyboard_poll();
 
+		/* Flash store writes, a step at a time */
+		kv_poll();
+
+#ifdef TRACE_ENABLE
+		/* Trace records, formatted or sent out */
+		trace_poll();
+#endif
+
 		if (hid_print) {
 			usb_hid_debug_print();
 		}
@@ -187,5 +340,9 @@ void main()
 		/* USB poll */
 		usb_poll();
 		usb_hid_poll();
+		usb_mouse_poll();
+		usb_extra_poll();
+		usb_raw_poll();
+		usb_cdc_poll();
 	}
 }
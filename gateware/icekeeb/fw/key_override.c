@@ -0,0 +1,90 @@
+/*
+ * key_override.c
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Key overrides.
+ *
+ * Applied by the HID layer while building a report, on the keys and
+ * modifiers it is about to send. Each key is looked up in a table indexed
+ * by keycode, built at init from the keymap, so a key without override
+ * costs a single probe. The modifiers to suppress and add are collected
+ * for the whole report, and go out in the same report as the replaced
+ * key.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "key_override.h"
+
+#include "action_code.h"
+#include "keycode.h"
+
+static struct {
+    /* Index + 1 into keymap_key_overrides, by trigger keycode */
+    uint8_t index[256];
+    unsigned int active;
+} ko_state;
+
+uint8_t
+key_override_apply(uint8_t keycode, uint8_t mods, uint8_t *suppressed, uint8_t *added)
+{
+    unsigned int i = ko_state.index[keycode];
+
+    if (!i) {
+        return keycode;
+    }
+
+    const struct key_override *ko = &keymap_key_overrides[i - 1];
+    if (!(mods & ko->trigger_mods)) {
+        return keycode;
+    }
+
+    ko_state.active++;
+    *suppressed |= ko->suppressed_mods;
+    *added |= MODS_TO_HID(ko->replacement >> 8);
+    return ko->replacement & 0xFF;
+}
+
+void
+key_override_print_state(void)
+{
+    printf("key overrides %d applied %d\n", keymap_key_override_count, ko_state.active);
+}
+
+void
+key_override_init(void)
+{
+    memset(&ko_state, 0, sizeof(ko_state));
+
+    for (unsigned int i = 0; i < keymap_key_override_count; i++) {
+        uint8_t trigger = keymap_key_overrides[i].trigger;
+
+        if (ko_state.index[trigger] || (i > 254)) {
+            printf("key override %d ignored\n", i);
+            continue;
+        }
+        ko_state.index[trigger] = i + 1;
+    }
+}
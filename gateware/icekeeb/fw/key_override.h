@@ -0,0 +1,47 @@
+/*
+ * key_override.h
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* While trigger_mods (any of them, HID bits) are held, trigger is sent as
+ * replacement instead, without the suppressed modifiers. replacement
+ * can carry modifiers of its own, e.g. LCTL(KC_DEL). */
+struct key_override {
+    uint8_t trigger;
+    uint8_t trigger_mods;
+    uint8_t suppressed_mods;
+    uint16_t replacement;
+};
+
+#define KEY_OVERRIDE(mods, trigger, replacement) \
+    { (trigger), (mods), (mods), (replacement) }
+
+extern const struct key_override keymap_key_overrides[];
+extern const unsigned int keymap_key_override_count;
+
+uint8_t key_override_apply(uint8_t keycode, uint8_t mods, uint8_t *suppressed, uint8_t *added);
+void key_override_print_state(void);
+void key_override_init(void);
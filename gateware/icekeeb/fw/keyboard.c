@@ -24,16 +24,38 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 
+#include "auto_shift.h"
+#include "autocorrect.h"
+#include "caps_word.h"
+#include "combo.h"
+#include "dynamic_macro.h"
+#include "key_override.h"
 #include "keyboard.h"
+#include "kvstore.h"
+#include "leader.h"
+#include "macro.h"
+#include "mousekey.h"
+#include "oneshot.h"
+#include "steno.h"
+#include "swap_hands.h"
+#include "tap_dance.h"
+#include "tap_hold.h"
+#include "trace.h"
+#include "unicode.h"
+#include "usb_extra.h"
 #include "usb_hid.h"
 
 #include "config.h"
 
+#include "action_code.h"
 #include "keycode.h"
 #include "keymap.h"
 #include "quantum_keycodes.h"
 
+#include <no2usb/usb.h>
+
 struct keyscan {
 	uint32_t csr;
 	uint32_t _res[3];
@@ -42,10 +64,64 @@ struct keyscan {
 
 static volatile struct keyscan * const keyscan_regs = (void*)(KEYSCAN_BASE);
 
+/* How long after the last matrix change the keyboard still counts as
+ * active, see keyboard_active() */
+#define KEYBOARD_ACTIVE_MS  100
+
 static struct {
     uint32_t prev_rows[4];
+    uint32_t last_change;
+
+    /* Keycode each held key was pressed as. The layer can change while it
+     * is held, the release must undo what the press did. */
+    uint16_t keys[MATRIX_ROWS][MATRIX_COLS];
 } keyboard_state;
 
+/* Tuning kept in the flash store, loaded over the defaults at boot */
+static const struct {
+    unsigned int key;
+    void *cfg;
+    unsigned int len;
+} keyboard_settings[] = {
+    { KV_TAP_HOLD_CFG,      &tap_hold_cfg,      sizeof(tap_hold_cfg) },
+    { KV_ONESHOT_CFG,       &oneshot_cfg,       sizeof(oneshot_cfg) },
+    { KV_AUTO_SHIFT_CFG,    &auto_shift_cfg,    sizeof(auto_shift_cfg) },
+    { KV_AUTOCORRECT_CFG,   &autocorrect_cfg,   sizeof(autocorrect_cfg) },
+    { KV_DYNAMIC_MACRO_CFG, &dynamic_macro_cfg, sizeof(dynamic_macro_cfg) },
+    { KV_MOUSEKEY_CFG,      &mousekey_cfg,      sizeof(mousekey_cfg) },
+    { KV_UNICODE_CFG,       &unicode_cfg,       sizeof(unicode_cfg) },
+};
+
+/* System and consumer keys, as the usage actions they stand for */
+static const uint16_t keyboard_usages[] = {
+    [KC_SYSTEM_POWER       - KC_SYSTEM_POWER] = ACTION_USAGE_SYSTEM(0x081),
+    [KC_SYSTEM_SLEEP       - KC_SYSTEM_POWER] = ACTION_USAGE_SYSTEM(0x082),
+    [KC_SYSTEM_WAKE        - KC_SYSTEM_POWER] = ACTION_USAGE_SYSTEM(0x083),
+    [KC_AUDIO_MUTE         - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x0E2),
+    [KC_AUDIO_VOL_UP       - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x0E9),
+    [KC_AUDIO_VOL_DOWN     - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x0EA),
+    [KC_MEDIA_NEXT_TRACK   - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x0B5),
+    [KC_MEDIA_PREV_TRACK   - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x0B6),
+    [KC_MEDIA_STOP         - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x0B7),
+    [KC_MEDIA_PLAY_PAUSE   - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x0CD),
+    [KC_MEDIA_SELECT       - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x183),
+    [KC_MEDIA_EJECT        - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x0B8),
+    [KC_MAIL               - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x18A),
+    [KC_CALCULATOR         - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x192),
+    [KC_MY_COMPUTER        - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x194),
+    [KC_WWW_SEARCH         - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x221),
+    [KC_WWW_HOME           - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x223),
+    [KC_WWW_BACK           - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x224),
+    [KC_WWW_FORWARD        - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x225),
+    [KC_WWW_STOP           - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x226),
+    [KC_WWW_REFRESH        - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x227),
+    [KC_WWW_FAVORITES      - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x22A),
+    [KC_MEDIA_FAST_FORWARD - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x0B3),
+    [KC_MEDIA_REWIND       - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x0B4),
+    [KC_BRIGHTNESS_UP      - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x06F),
+    [KC_BRIGHTNESS_DOWN    - KC_SYSTEM_POWER] = ACTION_USAGE_CONSUMER(0x070),
+};
+
 static char *tobits(uint32_t v)
 {
         static char buf[13];
@@ -67,10 +143,42 @@ keyboard_print_state(void)
 }
 
 void
-keyboard_do_key(unsigned int col, unsigned int row, bool down)
+keyboard_do_key(const struct key_event *ev)
+{
+    uint16_t *key = &keyboard_state.keys[ev->row][ev->col];
+    uint16_t keycode;
+
+    if (ev->down) {
+        keycode = *key = keymap_get_code(ev->col, ev->row);
+    } else {
+        keycode = *key;
+        *key = KC_NO;
+    }
+    TRACE("do c%d r%d %c kc%02X\n", ev->col, ev->row, ev->down ? 'v' : '^', keycode);
+
+    if (auto_shift_process(ev, keycode)) {
+        return;
+    }
+
+    keyboard_do_code(ev->col, ev->row, keycode, ev->down);
+}
+
+void
+keyboard_do_code(unsigned int col, unsigned int row, uint16_t keycode, bool down)
 {
-    uint16_t keycode = keymap_get_code(col, row);
-    //printf("do c%d r%d %c kc%02X\n", col, row, down?'v':'^', keycode);
+#ifdef LEADER_ENABLE
+    if (leader_process(col, row, keycode, down)) {
+        return;
+    }
+#endif
+
+    if (autocorrect_process(col, row, keycode, down)) {
+        return;
+    }
+
+    if (IS_KEY(keycode) || ((keycode >= QK_MODS) && (keycode <= QK_MODS_MAX))) {
+        caps_word_key(keycode & 0xFF, down, usb_get_tick());
+    }
 
     // Handle regular keycodes
     if (IS_KEY(keycode)) {
@@ -91,16 +199,109 @@ keyboard_do_key(unsigned int col, unsigned int row, bool down)
         }
     }
 
+    // Whatever ends up in the report goes into a dynamic macro recording
+    if (IS_KEY(keycode) || IS_MOD(keycode)) {
+        dynamic_macro_record(keycode, down);
+    }
+
     switch (keycode) {
         case QK_MODS...QK_MODS_MAX:
             if (down) {
-                usb_hid_set_weak_mod(keycode >> 8);
+                usb_hid_set_weak_mod(MODS_TO_HID(keycode >> 8));
                 usb_hid_press_key(col, row, keycode & 0xFF);
             } else {
-                usb_hid_reset_weak_mod(keycode >> 8);
+                usb_hid_reset_weak_mod(MODS_TO_HID(keycode >> 8));
                 usb_hid_release_key(col, row);
             }
+            for (int i = 0; i < 8; i++) {
+                if (MODS_TO_HID(keycode >> 8) & (1 << i)) {
+                    dynamic_macro_record(KC_LCTRL + i, down);
+                }
+            }
+            dynamic_macro_record(keycode & 0xFF, down);
+            break;
+        case QK_MACRO...QK_MACRO_MAX:
+            if (down) {
+                macro_start(keycode & 0xFF);
+            }
+            break;
+
+        case DYN_REC_START1:
+        case DYN_REC_START2:
+            if (down) {
+                dynamic_macro_record_start(keycode - DYN_REC_START1);
+            }
+            break;
+
+        case DYN_REC_STOP:
+            if (down) {
+                dynamic_macro_record_stop();
+            }
+            break;
+
+        case DYN_MACRO_PLAY1:
+        case DYN_MACRO_PLAY2:
+            if (down) {
+                dynamic_macro_play(keycode - DYN_MACRO_PLAY1);
+            }
+            break;
+
+        case QK_UNICODE...QK_UNICODE_MAX:
+        case UNICODE_MODE_FORWARD...UNICODE_MODE_WINC:
+            unicode_process(keycode, down);
+            break;
+
+#ifdef LEADER_ENABLE
+        case KC_LEAD:
+            if (down) {
+                leader_start();
+            }
+            break;
+#endif
+
+#ifndef AUTO_SHIFT_NO_SETUP
+        case KC_ASUP:
+        case KC_ASDN:
+        case KC_ASRP:
+#endif
+        case KC_ASTG:
+        case KC_ASON:
+        case KC_ASOFF:
+            if (down) {
+                auto_shift_config(keycode);
+            }
+            break;
+
+        case QK_SWAP_HANDS...QK_SWAP_HANDS_MAX:
+            swap_hands_process(col, row, keycode, down);
+            break;
+
+        case MAGIC_HOST_NKRO:
+        case MAGIC_UNHOST_NKRO:
+        case MAGIC_TOGGLE_NKRO:
+            if (down) {
+                usb_hid_set_nkro(keycode == MAGIC_TOGGLE_NKRO ? !usb_hid_get_nkro() : keycode == MAGIC_HOST_NKRO);
+            }
+            break;
+
+        case KC_SYSTEM_POWER...KC_BRIGHTNESS_DOWN:
+            usb_extra_usage(keyboard_usages[keycode - KC_SYSTEM_POWER], down);
             break;
+
+        case KC_MS_UP...KC_MS_ACCEL2:
+            mousekey_process(keycode, down);
+            break;
+
+        case QK_STENO...QK_STENO_MAX:
+            steno_process(col, row, keycode, down);
+            break;
+
+        case CAPS_WORD:
+            if (down) {
+                caps_word_toggle();
+            }
+            break;
+
         case QK_TO...QK_TO_MAX:
             // The keycode contains a param at bit 4 to be active at press
             if (down && (keycode & 0x10)) {
@@ -115,7 +316,7 @@ keyboard_do_key(unsigned int col, unsigned int row, bool down)
             if (down) {
                 keymap_set_layer(keycode & 0x0F);
             } else {
-                keymap_set_layer(0);
+                keymap_set_layer(keymap_default_layer);
             }
             break;
 
@@ -123,34 +324,168 @@ keyboard_do_key(unsigned int col, unsigned int row, bool down)
             if (down) {
                 keymap_toggle_layer(keycode & 0x0F);
             }
+            break;
+
+        case QK_ONE_SHOT_LAYER...QK_ONE_SHOT_LAYER_MAX:
+            oneshot_layer(keycode & 0x0F, down);
+            break;
+
+        case QK_ONE_SHOT_MOD...QK_ONE_SHOT_MOD_MAX:
+            oneshot_mod(keycode & 0xFF, down);
+            break;
+
+        case CMB_ON:
+        case CMB_OFF:
+        case CMB_TOG:
+            if (down) {
+                combo_enable(keycode == CMB_TOG ? !combo_enabled() : keycode == CMB_ON);
+            }
+            break;
+    }
+
+    // A real key press consumes the armed one-shots
+    if (down && (IS_KEY(keycode) || ((keycode >= QK_MODS) && (keycode <= QK_MODS_MAX)))) {
+        oneshot_key_pressed();
+    }
+}
+
+/* Press and release a keycode on behalf of the given matrix position.
+ * The HID layer makes sure the press is reported before the release.
+ */
+void
+keyboard_tap_code(unsigned int col, unsigned int row, uint16_t keycode)
+{
+    keyboard_do_code(col, row, keycode, true);
+    keyboard_do_code(col, row, keycode, false);
+}
+
+void
+keyboard_event(enum keyboard_stage stage, const struct key_event *ev)
+{
+    switch (stage) {
+        case KB_STAGE_COMBO:
+            if (combo_process(ev)) {
+                return;
+            }
+            /* fall through */
+        case KB_STAGE_TAP_HOLD:
+            if (tap_hold_process(ev)) {
+                return;
+            }
+            /* fall through */
+        case KB_STAGE_TAP_DANCE:
+            if (tap_dance_process(ev)) {
+                return;
+            }
+            /* fall through */
+        case KB_STAGE_KEY:
+            keyboard_do_key(ev);
+            break;
     }
 }
 
 void
 keyboard_poll(void)
 {
+    struct key_event ev;
+
+    ev.time = usb_get_tick();
+
     // get keyboard state
     for (int i = 0; i < MATRIX_ROWS; i++) {
         uint32_t row = keyscan_regs->rows[i];
         uint32_t mask = keyboard_state.prev_rows[i] ^ row;
         if (mask) {
             uint32_t window = 1;
+            keyboard_state.last_change = ev.time;
             for (int j = 0; j < MATRIX_COLS; j++, window <<= 1) {
                 if (mask & window) {
-                    keyboard_do_key(j, i, (row & window) != 0);
+                    ev.col = j;
+                    ev.row = i;
+                    ev.down = (row & window) != 0;
+                    swap_hands_event(&ev);
+                    keyboard_event(KB_STAGE_COMBO, &ev);
                 }
             }
         }
         keyboard_state.prev_rows[i] = row;
     }
+
+    // resolve the decisions that timed out
+    combo_task(ev.time);
+    tap_hold_task(ev.time);
+    tap_dance_task(ev.time);
+    oneshot_task(ev.time);
+    steno_task();
+#ifdef LEADER_ENABLE
+    leader_task(ev.time);
+#endif
+}
+
+/* True while keys are held or were just released, for background work
+ * that should stay out of the way of typing */
+bool
+keyboard_active(void)
+{
+    for (int i = 0; i < MATRIX_ROWS; i++) {
+        if (keyboard_state.prev_rows[i]) {
+            return true;
+        }
+    }
+
+    return (usb_get_tick() - keyboard_state.last_change) < KEYBOARD_ACTIVE_MS;
+}
+
+/* Queues the current tuning to be saved, it goes to flash in the
+ * background */
+bool
+keyboard_settings_save(void)
+{
+    bool ok = true;
+
+    for (unsigned int i = 0; i < sizeof(keyboard_settings) / sizeof(keyboard_settings[0]); i++) {
+        ok &= kv_write(keyboard_settings[i].key, keyboard_settings[i].cfg, keyboard_settings[i].len);
+    }
+
+    return ok;
+}
+
+static void
+keyboard_settings_load(void)
+{
+    for (unsigned int i = 0; i < sizeof(keyboard_settings) / sizeof(keyboard_settings[0]); i++) {
+        /* A saved one of another size is from another firmware */
+        if (kv_read(keyboard_settings[i].key, NULL, 0) == (int)keyboard_settings[i].len) {
+            kv_read(keyboard_settings[i].key, keyboard_settings[i].cfg, keyboard_settings[i].len);
+        }
+    }
 }
 
 void
 keyboard_init(void)
 {
     keymap_init();
+    combo_init();
+    tap_hold_init();
+    tap_dance_init();
+    oneshot_init();
+    macro_init();
+    dynamic_macro_init();
+    unicode_init();
+#ifdef LEADER_ENABLE
+    leader_init();
+#endif
+    autocorrect_init();
+    auto_shift_init();
+    caps_word_init();
+    key_override_init();
+    swap_hands_init();
+    steno_init();
+    mousekey_init();
+    keyboard_settings_load();
 
     for (int i = 0; i < 4; i++) {
         keyboard_state.prev_rows[i] = 0x00000000;
     }
+    memset(keyboard_state.keys, 0, sizeof(keyboard_state.keys));
 }
\ No newline at end of file
@@ -23,6 +23,33 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
+
+/* A single matrix transition, timestamped with the USB ms tick */
+struct key_event {
+    uint8_t col;
+    uint8_t row;
+    bool down;
+    uint32_t time;
+};
+
+/* Processing stages a key event goes through, in order. A stage that
+ * held events back replays them into the stage after itself.
+ */
+enum keyboard_stage {
+    KB_STAGE_COMBO,
+    KB_STAGE_TAP_HOLD,
+    KB_STAGE_TAP_DANCE,
+    KB_STAGE_KEY,
+};
+
+void keyboard_do_key(const struct key_event *ev);
+void keyboard_do_code(unsigned int col, unsigned int row, uint16_t keycode, bool down);
+void keyboard_tap_code(unsigned int col, unsigned int row, uint16_t keycode);
+void keyboard_event(enum keyboard_stage stage, const struct key_event *ev);
+bool keyboard_settings_save(void);
+bool keyboard_active(void);
 void keyboard_print_state(void);
 void keyboard_poll(void);
-void keyboard_init(void);
\ No newline at end of file
+void keyboard_init(void);
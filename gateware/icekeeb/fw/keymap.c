@@ -24,15 +24,30 @@
 /* This file defines the mapping of the keyboard */
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "keymap.h"
 #include "keycode.h"
 #include "quantum_keycodes.h"
 #include "action_code.h"
+#include "key_override.h"
+#include "leader.h"
+#include "macro.h"
+#include "steno.h"
+#include "swap_hands.h"
+#include "tap_dance.h"
+#include "unicode.h"
+#include "kvstore.h"
+#include "utils.h"
 
 #define XXX KC_NO
 
+#ifndef LEADER_ENABLE
+#define KC_LEAD KC_NO
+#endif
+
 #define LAYOUT(                                                  \
   k00, k01, k02, k03, k04,           k05, k06, k07, k08, k09,    \
   k10, k11, k12, k13, k14,           k15, k16, k17, k18, k19,    \
@@ -48,8 +63,9 @@
 
 /* This layout is a slightly modified dvorak layout for the Keyboardio Atreus keyboard.
  * This layout is closer to the keyboardio Model 01 keyboard default layout than the default Atreus layout is.
+ * It's the default, until a keymap edited from the host is saved to flash.
  */
-const uint16_t keymaps[][MATRIX_ROWS][MATRIX_COLS] = {
+static const uint16_t keymaps_default[][MATRIX_ROWS][MATRIX_COLS] = {
 	[0] = LAYOUT(KC_QUOT, KC_COMM, KC_DOT,  KC_P,    KC_Y,                      KC_F,    KC_G,    KC_C,    KC_R,    KC_L,
                  KC_A,    KC_O,    KC_E,    KC_U,    KC_I,                      KC_D,    KC_H,    KC_T,    KC_N,    KC_S,
                  KC_SCLN, KC_Q,    KC_J,    KC_K,    KC_X,    KC_TAB,  KC_ENT,  KC_B,    KC_M,    KC_W,    KC_V,    KC_Z,
@@ -60,8 +76,112 @@ const uint16_t keymaps[][MATRIX_ROWS][MATRIX_COLS] = {
                  TG(2),   KC_CIRC, KC_LCTL, KC_LSFT, KC_DEL,  KC_LGUI, KC_LALT, KC_SPC,  KC_TRNS, KC_DOT,  KC_0,    KC_EQL),
 	[2] = LAYOUT(KC_INS,  KC_HOME, KC_UP,   KC_END,  KC_PGUP,                   KC_UP,   KC_F7,   KC_F8,   KC_F9,   KC_F10,
                  KC_DEL,  KC_LEFT, KC_DOWN, KC_RGHT, KC_PGDN,                   KC_DOWN, KC_F4,   KC_F5,   KC_F6,   KC_F11,
-                 KC_NO,   KC_VOLU, KC_NO,   KC_NO,   RESET,   KC_TRNS, KC_TRNS, KC_NO,   KC_F1,   KC_F2,   KC_F3,   KC_F12,
-                 KC_TRNS, KC_VOLD, KC_LCTL, KC_LSFT, KC_DEL,  KC_LGUI, KC_LALT, KC_SPC,  TO(0),   KC_PSCR, KC_SLCK, KC_PAUS)
+                 KC_LEAD, KC_VOLU, CAPSWRD, TG(3),   RESET,   KC_TRNS, KC_TRNS, SH_TT,   KC_F1,   KC_F2,   KC_F3,   KC_F12,
+                 KC_TRNS, KC_VOLD, KC_LCTL, KC_LSFT, KC_DEL,  KC_LGUI, KC_LALT, KC_SPC,  TO(0),   KC_PSCR, KC_SLCK, KC_PAUS),
+	/* Mouse keys, over the navigation cluster of layer 2, and the way to steno */
+	[3] = LAYOUT(KC_TRNS, KC_BTN1, KC_MS_U, KC_BTN2, KC_WH_U,                   KC_TRNS, KC_TRNS, KC_TRNS, KC_TRNS, KC_TRNS,
+                 KC_TRNS, KC_MS_L, KC_MS_D, KC_MS_R, KC_WH_D,                   KC_TRNS, KC_TRNS, KC_TRNS, KC_TRNS, KC_TRNS,
+                 KC_TRNS, KC_TRNS, KC_TRNS, KC_TRNS, TO(4),   KC_ASTG, KC_ACL0, KC_TRNS, KC_TRNS, KC_TRNS, KC_TRNS, KC_TRNS,
+                 KC_TRNS, KC_TRNS, KC_TRNS, KC_TRNS, KC_TRNS, KC_TRNS, KC_TRNS, KC_TRNS, KC_TRNS, KC_TRNS, KC_TRNS, KC_TRNS),
+	/* Steno, strokes go out on the serial port. Vowels on the thumbs */
+	[4] = LAYOUT(STN_N1,  STN_N2,  STN_N3,  STN_N4,  STN_N5,                    STN_N6,  STN_N7,  STN_N8,  STN_N9,  STN_NA,
+                 STN_S1,  STN_TL,  STN_PL,  STN_HL,  STN_ST1,                   STN_FR,  STN_PR,  STN_LR,  STN_TR,  STN_DR,
+                 STN_S2,  STN_KL,  STN_WL,  STN_RL,  STN_ST2, STN_ST3, STN_ST4, STN_RR,  STN_BR,  STN_GR,  STN_SR,  STN_ZR,
+                 TO(0),   STN_BOLT, STN_GEM, STN_A,   STN_O,   XXX,     XXX,     STN_E,   STN_U,   XXX,     XXX,     XXX)
+};
+
+/* Mirrored positions for swap hands */
+#include "keymap_swap_hands.gen.h"
+
+/* Chorded combos, keys are given by their matrix position (col, row).
+ * Every key of a combo is held back until the chord is decided, which
+ * delays it and its repeat, so none by default. For example:
+ *
+ *    { MATRIX_BIT(1, 2) | MATRIX_BIT(2, 2), KC_CAPS },   (Q + J)
+ */
+static const struct combo keymap_combos_default[] = {
+};
+
+/* Key overrides, applied while any of the modifiers is held */
+const struct key_override keymap_key_overrides[] = {
+    KEY_OVERRIDE(MOD_MASK_SHIFT, KC_BSPC, KC_DEL),      /* Shift + Backspace = Delete */
+};
+
+const unsigned int keymap_key_override_count = sizeof(keymap_key_overrides) / sizeof(keymap_key_overrides[0]);
+
+/* Macros, referenced from the layers as M(index) */
+static const uint8_t * const keymap_macros_default[] = {
+    [0] = MACRO_TEXT("iCEKeeb\n"),
+    [1] = MACRO(MC_MODS_ON(MOD_BIT(KC_LCTRL)), MC_TAP(KC_C), MC_MODS_OFF(MOD_BIT(KC_LCTRL))),
+};
+
+/* Tap dances, referenced from the layers as TD(index) */
+struct tap_dance_action keymap_tap_dances[] = {
+    [0] = ACTION_TAP_DANCE_DOUBLE(KC_SCLN, KC_COLN),
+};
+
+const unsigned int keymap_tap_dance_count = sizeof(keymap_tap_dances) / sizeof(keymap_tap_dances[0]);
+
+/* Unicode code points, referenced from the layers as X(index) or XP(index, shifted index) */
+const uint8_t keymap_unicode_map[][3] = {
+    [0] = UCP(0x00E4),      /* ä */
+    [1] = UCP(0x00C4),      /* Ä */
+    [2] = UCP(0x2192),      /* → */
+    [3] = UCP(0x1F600),     /* 😀 */
+};
+
+const unsigned int keymap_unicode_count = sizeof(keymap_unicode_map) / sizeof(keymap_unicode_map[0]);
+
+#ifdef LEADER_ENABLE
+/* Leader sequences, LEADER_SEQ(action, keys...). KC_LEAD is on layer 2,
+ * TO(0) then brings the letters back for the sequence. */
+LEADER_SEQ(M(0),            KC_I, KC_K)
+LEADER_SEQ(LCTL(KC_C),      KC_C)
+LEADER_SEQ(LCTL(KC_V),      KC_V)
+LEADER_SEQ(X(2),            KC_A)
+LEADER_SEQ(X(3),            KC_S, KC_M)
+LEADER_SEQ(KC_CAPS,         KC_S, KC_M, KC_C)
+
+#include "keymap_leader.gen.h"
+#endif
+
+/* The keymap in use, as edited from the host. Macros are stored back to
+ * back in the buffer, up to the first empty one. */
+uint16_t keymap_layers[KEYMAP_LAYERS][MATRIX_ROWS][MATRIX_COLS] __attribute__ ((aligned(4)));
+unsigned int keymap_layer_count;
+unsigned int keymap_default_layer;
+
+struct combo keymap_combos[KEYMAP_COMBOS];
+unsigned int keymap_combo_count;
+
+uint8_t keymap_macro_buf[KEYMAP_MACRO_SIZE] __attribute__ ((aligned(4)));
+const uint8_t *keymap_macros[KEYMAP_MACROS];
+unsigned int keymap_macro_count;
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+/* Saved in the flash store, as they are in RAM. The info record holds
+ * the CRC of each of the others as saved together with it, a reset in
+ * the middle of a save leaves records that don't match it. */
+struct keymap_info {
+    uint8_t layer_count;
+    uint8_t combo_count;
+    uint8_t default_layer;
+    uint8_t _res;
+    uint32_t crc[3];
+};
+
+static struct keymap_info keymap_info;
+
+static const struct {
+    unsigned int key;
+    void *data;
+    unsigned int len;
+} keymap_values[] = {
+    { KV_KEYMAP_INFO,   &keymap_info,       sizeof(keymap_info) },
+    { KV_KEYMAP_LAYERS, keymap_layers,      sizeof(keymap_layers) },
+    { KV_KEYMAP_COMBOS, keymap_combos,      sizeof(keymap_combos) },
+    { KV_KEYMAP_MACROS, keymap_macro_buf,   sizeof(keymap_macro_buf) },
 };
 
 static struct {
@@ -69,6 +189,117 @@ static struct {
     int active_layer;
 } keymap_state;
 
+void
+keymap_macros_update(void)
+{
+    unsigned int ofs = 0;
+
+    keymap_macro_count = 0;
+
+    while ((keymap_macro_count < KEYMAP_MACROS) && (ofs < KEYMAP_MACRO_SIZE) &&
+           (keymap_macro_buf[ofs] != MACRO_END)) {
+        unsigned int len = macro_size(&keymap_macro_buf[ofs], KEYMAP_MACRO_SIZE - ofs);
+        if (!len) {
+            break;
+        }
+        keymap_macros[keymap_macro_count++] = &keymap_macro_buf[ofs];
+        ofs += len;
+    }
+}
+
+void
+keymap_load_defaults(void)
+{
+    unsigned int ofs = 0;
+
+    /* Layers past the default ones fall through to them */
+    for (int l = 0; l < KEYMAP_LAYERS; l++) {
+        for (int r = 0; r < MATRIX_ROWS; r++) {
+            for (int c = 0; c < MATRIX_COLS; c++) {
+                keymap_layers[l][r][c] = (l < (int)ARRAY_SIZE(keymaps_default)) ?
+                    keymaps_default[l][r][c] : KC_TRNS;
+            }
+        }
+    }
+    keymap_layer_count = ARRAY_SIZE(keymaps_default);
+    keymap_default_layer = 0;
+
+    memset(keymap_combos, 0, sizeof(keymap_combos));
+    keymap_combo_count = 0;
+    while ((keymap_combo_count < ARRAY_SIZE(keymap_combos_default)) && (keymap_combo_count < KEYMAP_COMBOS)) {
+        keymap_combos[keymap_combo_count] = keymap_combos_default[keymap_combo_count];
+        keymap_combo_count++;
+    }
+
+    memset(keymap_macro_buf, 0, sizeof(keymap_macro_buf));
+    for (unsigned int i = 0; i < ARRAY_SIZE(keymap_macros_default); i++) {
+        /* Keep a 0 after the last one */
+        unsigned int len = macro_size(keymap_macros_default[i], KEYMAP_MACRO_SIZE - 1 - ofs);
+        if (!len) {
+            printf("macro %d doesn't fit, %d macros dropped\n", i, (int)(ARRAY_SIZE(keymap_macros_default) - i));
+            break;
+        }
+        memcpy(&keymap_macro_buf[ofs], keymap_macros_default[i], len);
+        ofs += len;
+    }
+    keymap_macros_update();
+}
+
+/* All of it or nothing, the caller loads the defaults if it fails */
+static bool
+keymap_load(void)
+{
+    struct keymap_info info;
+
+    if (kv_read(KV_KEYMAP_INFO, &info, sizeof(info)) != sizeof(info)) {
+        return false;
+    }
+    if (!info.layer_count || (info.layer_count > KEYMAP_LAYERS) ||
+        (info.combo_count > KEYMAP_COMBOS) || (info.default_layer >= info.layer_count)) {
+        return false;
+    }
+    for (unsigned int i = 1; i < ARRAY_SIZE(keymap_values); i++) {
+        if (kv_read(keymap_values[i].key, NULL, 0) != (int)keymap_values[i].len) {
+            return false;
+        }
+    }
+
+    for (unsigned int i = 1; i < ARRAY_SIZE(keymap_values); i++) {
+        kv_read(keymap_values[i].key, keymap_values[i].data, keymap_values[i].len);
+        if (crc32(0, keymap_values[i].data, keymap_values[i].len) != info.crc[i - 1]) {
+            return false;
+        }
+    }
+    keymap_layer_count = info.layer_count;
+    keymap_combo_count = info.combo_count;
+    keymap_default_layer = info.default_layer;
+    keymap_macros_update();
+
+    return true;
+}
+
+/* Queues the keymap in use to be saved, it goes to flash in the
+ * background. The tables are read as they are written, they must not
+ * change before kv_busy() is false again. */
+bool
+keymap_save(void)
+{
+    bool ok = true;
+
+    keymap_info.layer_count = keymap_layer_count;
+    keymap_info.combo_count = keymap_combo_count;
+    keymap_info.default_layer = keymap_default_layer;
+    for (unsigned int i = 1; i < ARRAY_SIZE(keymap_values); i++) {
+        keymap_info.crc[i - 1] = crc32(0, keymap_values[i].data, keymap_values[i].len);
+    }
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(keymap_values); i++) {
+        ok &= kv_write(keymap_values[i].key, keymap_values[i].data, keymap_values[i].len);
+    }
+
+    return ok;
+}
+
 uint16_t
 keymap_get_code(unsigned int col, unsigned int row)
 {
@@ -80,7 +311,7 @@ keymap_get_layer_code(int layer, unsigned int col, unsigned int row)
 {
     uint16_t code;
     do {
-        code = keymaps[layer][row][col];
+        code = keymap_layers[layer][row][col];
         layer--;
     } while ((code == KC_TRNS) && (layer >= 0));
 
@@ -90,12 +321,18 @@ keymap_get_layer_code(int layer, unsigned int col, unsigned int row)
 void
 keymap_set_layer(int layer)
 {
+    if (layer >= (int)keymap_layer_count) {
+        return;
+    }
     keymap_state.active_layer = layer;
 }
 
 void
 keymap_toggle_layer(int layer)
 {
+    if (layer >= (int)keymap_layer_count) {
+        return;
+    }
     if (keymap_state.active_layer != layer) {
         keymap_state.prev_layer = keymap_state.active_layer;
         keymap_state.active_layer = layer;
@@ -108,10 +345,15 @@ void
 keymap_print_state(void)
 {
     printf("prev layer %d current layer %d\n", keymap_state.prev_layer, keymap_state.active_layer);
+    printf("%d layers, %d combos, %d macros\n", keymap_layer_count, keymap_combo_count, keymap_macro_count);
 }
 
 void
 keymap_init(void)
 {
-    keymap_state.active_layer = 0;
+    if (!keymap_load()) {
+        keymap_load_defaults();
+    }
+    keymap_state.active_layer = keymap_default_layer;
+    keymap_state.prev_layer = keymap_default_layer;
 }
\ No newline at end of file
@@ -24,11 +24,43 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
 /* key matrix size */
 #define MATRIX_ROWS 4
 #define MATRIX_COLS 12
 
+/* One bit per matrix position, row major */
+typedef uint64_t matrix_mask_t;
+#define MATRIX_BIT(col, row) ((matrix_mask_t)1 << ((row) * MATRIX_COLS + (col)))
+
+/* Room for the keymap as edited from the host, the compiled in one is
+ * only the default. The raw interface counts combos in a byte, and the
+ * combo lookup table keeps 255 two key combos well under half full. */
+#define KEYMAP_LAYERS       8
+#define KEYMAP_COMBOS       255
+#define KEYMAP_MACROS       32
+#define KEYMAP_MACRO_SIZE   512
+
+/* A combo emits keycode when exactly the keys in the mask are pressed
+ * together. Packed, 10 bytes instead of 16 in RAM and in the store. */
+struct combo {
+    matrix_mask_t keys;
+    uint16_t keycode;
+} __attribute__((packed, aligned(2)));
+
+extern struct combo keymap_combos[KEYMAP_COMBOS];
+extern unsigned int keymap_combo_count;
+
+extern uint16_t keymap_layers[KEYMAP_LAYERS][MATRIX_ROWS][MATRIX_COLS];
+extern unsigned int keymap_layer_count;
+extern unsigned int keymap_default_layer;
+
+extern uint8_t keymap_macro_buf[KEYMAP_MACRO_SIZE];
+
+void keymap_macros_update(void);
+void keymap_load_defaults(void);
+bool keymap_save(void);
 uint16_t keymap_get_layer_code(int layer, unsigned int col, unsigned int row);
 uint16_t keymap_get_code(unsigned int col, unsigned int row);
 void keymap_set_layer(int layer);
@@ -0,0 +1,489 @@
+/*
+ * kvstore.c
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Log structured key / value store in flash.
+ *
+ * Values are appended as records to the head sector. A record is a
+ * header (key, length, CRC-32 over both and the data) followed by the
+ * data, padded to a word. The key and length are programmed first, the
+ * CRC last, so a record cut short by a reset never checks out.
+ *
+ * The sectors form a ring, each starting with a sequence number. When the
+ * head is full the next sector, always kept erased, becomes the head. The
+ * one after it is the oldest: its records still current are copied to
+ * the fresh head, then it's erased to be the next spare. Every sector
+ * so gets erased in turn.
+ *
+ * At boot all the sectors are read once, in order, to find the latest
+ * record of each key and where the head ends.
+ *
+ * Writes are queued and carried out by kv_poll() from the main loop, one
+ * page program or sector erase per call, and only once the flash is done
+ * with the previous one. Key scanning never waits for the flash.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "kvstore.h"
+#include "spi.h"
+#include "utils.h"
+
+#define KV_MAGIC        0x4b565331      /* 'KVS1' */
+#define KV_PAGE         256
+
+struct kv_sector_hdr {
+    uint32_t magic;
+    uint32_t seq;
+};
+
+struct kv_rec_hdr {
+    uint16_t key;
+    uint16_t len;
+    uint32_t crc;
+};
+
+#define KV_SECTOR_ADDR(s)   (KV_FLASH_ADDR + (s) * KV_SECTOR_SIZE)
+#define KV_SECTOR_OF(addr)  (((addr) - KV_FLASH_ADDR) / KV_SECTOR_SIZE)
+#define KV_REC_SIZE(len)    (sizeof(struct kv_rec_hdr) + (((len) + 3) & ~3))
+#define KV_SPACE            (KV_SECTOR_SIZE - sizeof(struct kv_sector_hdr))
+
+_Static_assert((KV_SECTORS & (KV_SECTORS - 1)) == 0, "sector count must be a power of 2");
+_Static_assert(KV_KEYS <= 32, "dirty mask too small");
+
+enum kv_step {
+    KV_IDLE,            /* Waiting for a value to write */
+    KV_REC_DATA,        /* Header programmed, data next */
+    KV_REC_CRC,         /* Data programmed, CRC next */
+    KV_ADVANCE,         /* Head full, next sector becomes the head */
+    KV_COMPACT,         /* Copying the current records out of the oldest sector */
+    KV_ERASE,           /* Oldest sector erase issued */
+};
+
+static struct {
+    /* Latest record of each key, 0 if none */
+    uint32_t index[KV_KEYS];
+    uint16_t index_len[KV_KEYS];
+
+    /* Head sector, its sequence number and where the next record goes */
+    unsigned int head;
+    uint32_t seq;
+    unsigned int wofs;
+
+    /* Sectors known to be erased */
+    uint32_t clean;
+
+    /* Values waiting to be written */
+    uint32_t dirty;
+    const void *src[KV_KEYS];
+    uint16_t len[KV_KEYS];
+
+    /* Record in progress, from RAM or copied from another record */
+    enum kv_step step;
+    enum kv_step ret;
+    unsigned int key;
+    unsigned int rec_len;
+    uint32_t rec_addr;
+    const uint8_t *ram;
+    uint32_t from;
+    unsigned int done;
+    uint32_t crc;
+
+    /* Sector being emptied */
+    unsigned int victim;
+
+    /* Stats */
+    unsigned int records;
+    unsigned int erases;
+    unsigned int dropped;
+
+    uint8_t page[KV_PAGE] __attribute__ ((aligned(4)));
+} kv_state;
+
+
+static unsigned int
+kv_live_size(void)
+{
+    unsigned int size = 0;
+
+    for (unsigned int k = 0; k < KV_KEYS; k++) {
+        if (kv_state.index[k]) {
+            size += KV_REC_SIZE(kv_state.index_len[k]);
+        }
+    }
+
+    return size;
+}
+
+/* Size of the current records once everything queued is written, with
+ * len bytes for key */
+static unsigned int
+kv_final_size(unsigned int key, unsigned int len)
+{
+    bool writing = (kv_state.ret == KV_IDLE) &&
+        ((kv_state.step == KV_REC_DATA) || (kv_state.step == KV_REC_CRC));
+    unsigned int size = 0;
+
+    for (unsigned int k = 1; k < KV_KEYS; k++) {
+        if (k == key) {
+            size += KV_REC_SIZE(len);
+        } else if (kv_state.dirty & (1 << k)) {
+            size += KV_REC_SIZE(kv_state.len[k]);
+        } else if (writing && (k == kv_state.key)) {
+            size += KV_REC_SIZE(kv_state.rec_len);
+        } else if (kv_state.index[k]) {
+            size += KV_REC_SIZE(kv_state.index_len[k]);
+        }
+    }
+
+    return size;
+}
+
+/* Copies up to len bytes of the latest value, returns its full length or
+ * -1 if there is none */
+int
+kv_read(unsigned int key, void *data, unsigned int len)
+{
+    if ((key >= KV_KEYS) || !kv_state.index[key]) {
+        return -1;
+    }
+
+    if (len > kv_state.index_len[key]) {
+        len = kv_state.index_len[key];
+    }
+    if (len) {
+        flash_read(data, kv_state.index[key] + sizeof(struct kv_rec_hdr), len);
+    }
+
+    return kv_state.index_len[key];
+}
+
+/* Queues a value, it's read from data when its turn comes so data must
+ * stay around. Writing the same key again before that only keeps the
+ * latest. */
+bool
+kv_write(unsigned int key, const void *data, unsigned int len)
+{
+    if ((key == 0) || (key >= KV_KEYS) || (KV_REC_SIZE(len) > KV_SPACE)) {
+        return false;
+    }
+
+    /* Everything current, queued values included, must fit in the ring
+     * minus the spare and the head being filled */
+    if (kv_final_size(key, len) > (KV_SECTORS - 2) * KV_SPACE) {
+        return false;
+    }
+
+    kv_state.src[key] = data;
+    kv_state.len[key] = len;
+    kv_state.dirty |= 1 << key;
+
+    return true;
+}
+
+bool
+kv_busy(void)
+{
+    return kv_state.dirty || (kv_state.step != KV_IDLE);
+}
+
+static void
+kv_program(uint32_t addr, const void *data, unsigned int len)
+{
+    flash_write_enable();
+    flash_page_program((void *)data, addr, len);
+}
+
+/* Places a record in the head and programs its header, the caller knows
+ * it fits */
+static void
+kv_rec_start(unsigned int key, unsigned int len, const void *ram, uint32_t from)
+{
+    struct kv_rec_hdr hdr = { .key = key, .len = len };
+
+    kv_state.key = key;
+    kv_state.rec_len = len;
+    kv_state.rec_addr = KV_SECTOR_ADDR(kv_state.head) + kv_state.wofs;
+    kv_state.ram = ram;
+    kv_state.from = from;
+    kv_state.done = 0;
+    kv_state.crc = crc32(0, &hdr, 4);
+
+    kv_state.wofs += KV_REC_SIZE(len);
+
+    kv_program(kv_state.rec_addr, &hdr, 4);
+    kv_state.step = len ? KV_REC_DATA : KV_REC_CRC;
+}
+
+/* Programs the next piece of data, up to the end of the flash page */
+static void
+kv_rec_data(void)
+{
+    uint32_t addr = kv_state.rec_addr + sizeof(struct kv_rec_hdr) + kv_state.done;
+    unsigned int n = KV_PAGE - (addr & (KV_PAGE - 1));
+
+    if (n > kv_state.rec_len - kv_state.done) {
+        n = kv_state.rec_len - kv_state.done;
+    }
+
+    /* Through the page buffer, the CRC is over exactly what's written */
+    if (kv_state.ram) {
+        memcpy(kv_state.page, kv_state.ram + kv_state.done, n);
+    } else {
+        flash_read(kv_state.page, kv_state.from + sizeof(struct kv_rec_hdr) + kv_state.done, n);
+    }
+    kv_state.crc = crc32(kv_state.crc, kv_state.page, n);
+
+    kv_program(addr, kv_state.page, n);
+
+    kv_state.done += n;
+    if (kv_state.done == kv_state.rec_len) {
+        kv_state.step = KV_REC_CRC;
+    }
+}
+
+static void
+kv_rec_end(void)
+{
+    kv_program(kv_state.rec_addr + 4, &kv_state.crc, 4);
+
+    kv_state.index[kv_state.key] = kv_state.rec_addr;
+    kv_state.index_len[kv_state.key] = kv_state.rec_len;
+    kv_state.records++;
+
+    kv_state.step = kv_state.ret;
+}
+
+static void
+kv_start_write(void)
+{
+    unsigned int key;
+
+    for (key = 0; !(kv_state.dirty & (1 << key)); key++);
+
+    if (kv_state.wofs + KV_REC_SIZE(kv_state.len[key]) > KV_SECTOR_SIZE) {
+        kv_state.step = KV_ADVANCE;
+        return;
+    }
+
+    kv_state.dirty &= ~(1 << key);
+    kv_state.ret = KV_IDLE;
+    kv_rec_start(key, kv_state.len[key], kv_state.src[key], 0);
+}
+
+static void
+kv_advance(void)
+{
+    unsigned int next = (kv_state.head + 1) & (KV_SECTORS - 1);
+    struct kv_sector_hdr hdr;
+
+    /* Only after a reset can the next one be anything but erased */
+    if (!(kv_state.clean & (1 << next))) {
+        kv_state.victim = next;
+        kv_state.step = KV_COMPACT;
+        return;
+    }
+
+    hdr.magic = KV_MAGIC;
+    hdr.seq = ++kv_state.seq;
+    kv_program(KV_SECTOR_ADDR(next), &hdr, sizeof(hdr));
+
+    kv_state.head = next;
+    kv_state.wofs = sizeof(hdr);
+    kv_state.clean &= ~(1 << next);
+
+    /* The oldest gets emptied right away, while there's room for its
+     * records in the new head */
+    kv_state.victim = (next + 1) & (KV_SECTORS - 1);
+    kv_state.step = KV_COMPACT;
+}
+
+static void
+kv_compact(void)
+{
+    for (unsigned int k = 0; k < KV_KEYS; k++) {
+        unsigned int len = kv_state.index_len[k];
+
+        if (!kv_state.index[k] || (KV_SECTOR_OF(kv_state.index[k]) != kv_state.victim)) {
+            continue;
+        }
+
+        /* Can only happen when resuming after a reset mid compaction */
+        if (kv_state.wofs + KV_REC_SIZE(len) > KV_SECTOR_SIZE) {
+            printf("kv: no room to keep key %d\n", k);
+            kv_state.index[k] = 0;
+            kv_state.dropped++;
+            continue;
+        }
+
+        kv_state.ret = KV_COMPACT;
+        kv_rec_start(k, len, NULL, kv_state.index[k]);
+        return;
+    }
+
+    /* Nothing current left in there */
+    flash_write_enable();
+    flash_sector_erase(KV_SECTOR_ADDR(kv_state.victim));
+    kv_state.erases++;
+    kv_state.step = KV_ERASE;
+}
+
+void
+kv_poll(void)
+{
+    /* One flash operation at a time, the main loop goes on meanwhile */
+    if (!flash_ready()) {
+        return;
+    }
+
+    switch (kv_state.step) {
+        case KV_IDLE:
+            if (kv_state.dirty) {
+                kv_start_write();
+            }
+            break;
+
+        case KV_REC_DATA:
+            kv_rec_data();
+            break;
+
+        case KV_REC_CRC:
+            kv_rec_end();
+            break;
+
+        case KV_ADVANCE:
+            kv_advance();
+            break;
+
+        case KV_COMPACT:
+            kv_compact();
+            break;
+
+        case KV_ERASE:
+            kv_state.clean |= 1 << kv_state.victim;
+            kv_state.step = KV_IDLE;
+            break;
+    }
+}
+
+void
+kv_print_state(void)
+{
+    printf("kv: head %d seq %d ofs %d, clean %x, live %d bytes, dirty %x, step %d\n",
+        kv_state.head, (int)kv_state.seq, kv_state.wofs, (int)kv_state.clean,
+        kv_live_size(), (int)kv_state.dirty, kv_state.step);
+    printf("kv: %d records, %d erases, %d dropped\n",
+        kv_state.records, kv_state.erases, kv_state.dropped);
+}
+
+/* Walks the records of a sector, returns where its free space starts */
+static unsigned int
+kv_scan_sector(unsigned int s, uint32_t seq, uint32_t *index_seq)
+{
+    unsigned int ofs = sizeof(struct kv_sector_hdr);
+
+    while (ofs + sizeof(struct kv_rec_hdr) <= KV_SECTOR_SIZE) {
+        uint32_t addr = KV_SECTOR_ADDR(s) + ofs;
+        struct kv_rec_hdr hdr;
+        uint32_t crc;
+
+        flash_read(&hdr, addr, sizeof(hdr));
+
+        if ((hdr.key == 0xffff) && (hdr.len == 0xffff)) {
+            return ofs;
+        }
+
+        /* Garbage, nothing more to trust in this sector */
+        if (KV_REC_SIZE(hdr.len) > KV_SECTOR_SIZE - ofs) {
+            return KV_SECTOR_SIZE;
+        }
+
+        crc = crc32(0, &hdr, 4);
+        for (unsigned int done = 0; done < hdr.len; ) {
+            unsigned int n = hdr.len - done;
+            if (n > KV_PAGE) {
+                n = KV_PAGE;
+            }
+            flash_read(kv_state.page, addr + sizeof(hdr) + done, n);
+            crc = crc32(crc, kv_state.page, n);
+            done += n;
+        }
+
+        /* Later in the ring is newer, records cut short are skipped */
+        if ((crc == hdr.crc) && (hdr.key < KV_KEYS) &&
+            (!kv_state.index[hdr.key] || (seq >= index_seq[hdr.key]))) {
+            kv_state.index[hdr.key] = addr;
+            kv_state.index_len[hdr.key] = hdr.len;
+            index_seq[hdr.key] = seq;
+        }
+
+        ofs += KV_REC_SIZE(hdr.len);
+    }
+
+    return KV_SECTOR_SIZE;
+}
+
+void
+kv_init(void)
+{
+    uint32_t index_seq[KV_KEYS];
+    uint32_t used = 0;
+    bool found = false;
+
+    memset(&kv_state, 0, sizeof(kv_state));
+
+    for (unsigned int s = 0; s < KV_SECTORS; s++) {
+        struct kv_sector_hdr hdr;
+        unsigned int end;
+
+        flash_read(&hdr, KV_SECTOR_ADDR(s), sizeof(hdr));
+        if (hdr.magic != KV_MAGIC) {
+            continue;
+        }
+
+        end = kv_scan_sector(s, hdr.seq, index_seq);
+        used |= 1 << s;
+
+        if (!found || (hdr.seq > kv_state.seq)) {
+            found = true;
+            kv_state.head = s;
+            kv_state.seq = hdr.seq;
+            kv_state.wofs = end;
+        }
+    }
+
+    kv_state.step = KV_IDLE;
+
+    if (!found) {
+        /* Empty store, the first write starts over at sector 0 */
+        kv_state.head = KV_SECTORS - 1;
+        kv_state.wofs = KV_SECTOR_SIZE;
+    } else if (used & (1 << ((kv_state.head + 1) & (KV_SECTORS - 1)))) {
+        /* The oldest sector wasn't emptied, a reset came in the middle of
+         * a compaction. Finish it while the head still has the room. */
+        kv_state.victim = (kv_state.head + 1) & (KV_SECTORS - 1);
+        kv_state.step = KV_COMPACT;
+    }
+}
@@ -0,0 +1,56 @@
+/*
+ * kvstore.h
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Flash region of the store, after the autocorrect dictionary. The
+ * sectors are used as a ring, one of them always kept erased. */
+#define KV_FLASH_ADDR       0x000d0000
+#define KV_SECTORS          4
+#define KV_SECTOR_SIZE      4096
+
+/* Keys of the values kept in the store */
+enum kv_key {
+    KV_KEYMAP_INFO = 1,
+    KV_KEYMAP_LAYERS,
+    KV_KEYMAP_COMBOS,
+    KV_KEYMAP_MACROS,
+    KV_TAP_HOLD_CFG,
+    KV_ONESHOT_CFG,
+    KV_AUTO_SHIFT_CFG,
+    KV_AUTOCORRECT_CFG,
+    KV_DYNAMIC_MACRO_CFG,
+    KV_MOUSEKEY_CFG,
+    KV_UNICODE_CFG,
+    KV_KEYS,
+};
+
+int kv_read(unsigned int key, void *data, unsigned int len);
+bool kv_write(unsigned int key, const void *data, unsigned int len);
+bool kv_busy(void);
+void kv_poll(void);
+void kv_print_state(void);
+void kv_init(void);
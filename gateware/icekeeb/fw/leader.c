@@ -0,0 +1,179 @@
+/*
+ * leader.c
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Leader key.
+ *
+ * After KC_LEAD, the basic keys pressed walk down the trie compiled from
+ * the keymap, one node per key, a binary search over the node's edges.
+ * A node without edges is a sequence nobody can extend, so its action
+ * fires right away. Only when a sequence is the prefix of a longer one
+ * the decision waits for LEADER_TIMEOUT.
+ *
+ * Keys that are part of a sequence never reach the host. Layer switches
+ * go through without ending it, so the sequence can be typed on another
+ * layer than the one with the leader key.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "keyboard.h"
+#include "leader.h"
+
+#include "keycode.h"
+#include "keymap.h"
+#include "quantum_keycodes.h"
+
+#include <no2usb/usb.h>
+
+static struct {
+    bool active;
+    unsigned int node;
+    uint32_t timer;
+
+    /* Position of the last key, the action is tapped on its behalf */
+    unsigned int col;
+    unsigned int row;
+
+    /* Keys eaten by the sequence, their release is eaten as well */
+    matrix_mask_t swallowed;
+
+    unsigned int fired;
+    unsigned int failed;
+} leader_state;
+
+static void
+leader_end(bool fire)
+{
+    const uint16_t *node = &keymap_leader_trie[leader_state.node];
+    matrix_mask_t bit = MATRIX_BIT(leader_state.col, leader_state.row);
+    matrix_mask_t held = leader_state.swallowed & bit;
+
+    leader_state.active = false;
+
+    if (fire && LEADER_NODE_ACTION(node[0])) {
+        leader_state.fired++;
+        /* The tap comes back through leader_process(), its release must
+         * not be taken for the swallowed release of the last key */
+        leader_state.swallowed &= ~bit;
+        keyboard_tap_code(leader_state.col, leader_state.row, node[1]);
+        leader_state.swallowed |= held;
+    } else {
+        leader_state.failed++;
+    }
+}
+
+void
+leader_start(void)
+{
+    leader_state.active = true;
+    leader_state.node = 0;
+    leader_state.timer = usb_get_tick();
+}
+
+/* Returns true if the key was consumed by the leader sequence */
+bool
+leader_process(unsigned int col, unsigned int row, uint16_t keycode, bool down)
+{
+    matrix_mask_t bit = MATRIX_BIT(col, row);
+
+    if (!down) {
+        if (leader_state.swallowed & bit) {
+            leader_state.swallowed &= ~bit;
+            return true;
+        }
+        return false;
+    }
+
+    if (!leader_state.active || IS_MOD(keycode)) {
+        return false;
+    }
+
+    if ((keycode >= QK_TO) && (keycode <= QK_TOGGLE_LAYER_MAX)) {
+        leader_state.timer = usb_get_tick();
+        return false;
+    }
+
+    if (!IS_KEY(keycode)) {
+        /* Anything else ends the sequence and does its own thing */
+        leader_end(false);
+        return false;
+    }
+
+    leader_state.swallowed |= bit;
+    leader_state.timer = usb_get_tick();
+    leader_state.col = col;
+    leader_state.row = row;
+
+    /* Look for the key among the node's edges */
+    const uint16_t *node = &keymap_leader_trie[leader_state.node];
+    unsigned int n = LEADER_NODE_EDGES(node[0]);
+    const uint16_t *keys = node + 1 + LEADER_NODE_ACTION(node[0]);
+    unsigned int lo = 0, hi = n;
+
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) >> 1;
+        if (keys[mid] < keycode) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if ((lo == n) || (keys[lo] != keycode)) {
+        leader_end(false);
+        return true;
+    }
+
+    leader_state.node = keys[n + lo];
+
+    /* Unambiguous, no need to wait */
+    if (!LEADER_NODE_EDGES(keymap_leader_trie[leader_state.node])) {
+        leader_end(true);
+    }
+
+    return true;
+}
+
+void
+leader_task(uint32_t now)
+{
+    if (leader_state.active && ((now - leader_state.timer) > LEADER_TIMEOUT)) {
+        leader_end(true);
+    }
+}
+
+void
+leader_print_state(void)
+{
+    printf("leader active %d node %d fired %d failed %d\n",
+        leader_state.active, leader_state.node, leader_state.fired, leader_state.failed);
+}
+
+void
+leader_init(void)
+{
+    memset(&leader_state, 0, sizeof(leader_state));
+}
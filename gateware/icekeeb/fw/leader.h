@@ -0,0 +1,56 @@
+/*
+ * leader.h
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Time to wait for more keys when a sequence is the prefix of another one */
+#define LEADER_TIMEOUT 300
+
+/* Leader sequences are listed in the keymap as LEADER_SEQ(action, keys...)
+ * at file scope. leader_gen.py compiles them into keymap_leader_trie at
+ * build time, for the compiler they are empty. */
+#define LEADER_SEQ(...)
+
+/* The trie is an array of 16 bit words, each node laid out as
+ *
+ *   LEADER_NODE(n, has_action)
+ *   action keycode                  if has_action
+ *   key[0] .. key[n - 1]            sorted basic keycodes
+ *   child[0] .. child[n - 1]        word offsets of the child nodes
+ *
+ * with the root at offset 0.
+ */
+#define LEADER_NODE(n, has_action) (((n) << 8) | (has_action))
+#define LEADER_NODE_EDGES(w)       ((w) >> 8)
+#define LEADER_NODE_ACTION(w)      ((w) & 1)
+
+extern const uint16_t keymap_leader_trie[];
+
+void leader_start(void);
+bool leader_process(unsigned int col, unsigned int row, uint16_t keycode, bool down);
+void leader_task(uint32_t now);
+void leader_print_state(void);
+void leader_init(void);
@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+#
+# Compiles the LEADER_SEQ(action, keys...) entries of the keymap into the
+# trie walked by leader.c, see leader.h for the node layout.
+#
+# Keys are resolved against keycode.h so the edges of each node can be
+# sorted. The output still uses the names, and checks the order it relied
+# on with static asserts.
+#
+
+import re
+import sys
+
+
+def parse_keycodes(name):
+	values = {}
+	aliases = {}
+	skip = 0
+	enum = False
+	val = 0
+
+	with open(name, 'r') as fh:
+		for line in fh:
+			line = line.split('//')[0].strip()
+
+			# Preprocessor conditionals, only '#if 0' is used in there
+			if line.startswith('#if'):
+				skip += 1 if (skip or line == '#if 0') else 0
+				continue
+			if line.startswith('#endif'):
+				skip = max(skip - 1, 0)
+				continue
+			if skip:
+				continue
+
+			m = re.match(r'#define\s+(KC_\w+)\s+(KC_\w+)$', line)
+			if m:
+				aliases[m.group(1)] = m.group(2)
+				continue
+
+			if line.startswith('enum'):
+				enum = True
+				val = 0
+				continue
+			if line.startswith('}'):
+				enum = False
+				continue
+
+			if enum:
+				m = re.match(r'(KC_\w+)\s*(?:=\s*(\w+))?\s*,?', line)
+				if m:
+					if m.group(2):
+						v = m.group(2)
+						val = values[v] if v in values else int(v, 0)
+					values[m.group(1)] = val
+					val += 1
+
+	def resolve(n):
+		while n in aliases:
+			n = aliases[n]
+		return values[n]
+
+	return resolve
+
+
+def split_args(s):
+	args = []
+	depth = 0
+	cur = ''
+	for c in s:
+		if c == ',' and depth == 0:
+			args.append(cur.strip())
+			cur = ''
+			continue
+		depth += (c == '(') - (c == ')')
+		cur += c
+	args.append(cur.strip())
+	return args
+
+
+def parse_sequences(name):
+	with open(name, 'r') as fh:
+		src = fh.read()
+
+	# Drop comments, they could mention LEADER_SEQ as well
+	src = re.sub(r'/\*.*?\*/', '', src, flags=re.S)
+	src = re.sub(r'//[^\n]*', '', src)
+
+	seqs = []
+	for m in re.finditer(r'^\s*LEADER_SEQ\(', src, re.M):
+		i = m.end()
+		depth = 1
+		while depth:
+			depth += (src[i] == '(') - (src[i] == ')')
+			i += 1
+		args = split_args(src[m.end():i-1])
+		if len(args) < 2:
+			raise ValueError('LEADER_SEQ needs an action and at least one key: ' + src[m.start():i])
+		seqs.append((args[0], args[1:]))
+
+	return seqs
+
+
+class Node:
+	def __init__(self):
+		self.action = None
+		self.edges = {}
+		self.ofs = None
+
+
+def main(argv0, keycode_name, keymap_name, out_name):
+	resolve = parse_keycodes(keycode_name)
+
+	# Build the trie
+	root = Node()
+	for action, keys in parse_sequences(keymap_name):
+		node = root
+		for k in keys:
+			node = node.edges.setdefault(k, Node())
+		if node.action is not None:
+			raise ValueError('duplicate leader sequence ' + ', '.join(keys))
+		node.action = action
+
+	# Lay it out breadth first
+	order = [root]
+	ofs = 0
+	for node in order:
+		node.ofs = ofs
+		node.keys = sorted(node.edges.keys(), key=resolve)
+		ofs += 1 + (node.action is not None) + 2 * len(node.keys)
+		order.extend(node.edges[k] for k in node.keys)
+
+	with open(out_name, 'w') as fh:
+		fh.write('/* Generated by leader_gen.py from %s, do not edit */\n\n' % keymap_name)
+		fh.write('const uint16_t keymap_leader_trie[] = {\n')
+		for node in order:
+			words = ['LEADER_NODE(%d, %d)' % (len(node.keys), node.action is not None)]
+			if node.action is not None:
+				words.append(node.action)
+			words += node.keys
+			words += ['%d' % node.edges[k].ofs for k in node.keys]
+			fh.write('\t/* %4d */ %s,\n' % (node.ofs, ', '.join(words)))
+		fh.write('};\n\n')
+
+		for node in order:
+			for a, b in zip(node.keys, node.keys[1:]):
+				fh.write('_Static_assert(%s < %s, "leader trie edges out of order");\n' % (a, b))
+
+if __name__ == '__main__':
+	main(*sys.argv)
@@ -0,0 +1,305 @@
+/*
+ * macro.c
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Macro player.
+ *
+ * The player doesn't run from the key scanning path. usb_hid_poll() calls
+ * macro_step() each time the HID IN buffer is free, and every step makes
+ * exactly one change to the macro keys / modifiers, which then goes out
+ * as one report. Playback so runs as fast as the host takes reports, and
+ * live keys keep being scanned and reported alongside.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dynamic_macro.h"
+#include "macro.h"
+#include "usb_hid.h"
+
+#include "keycode.h"
+
+#define SH 0x80
+
+/* US layout, keycode with SH set when shift is needed */
+static const uint8_t ascii_to_keycode[128] = {
+    0,               0,               0,               0,   /* 0x00 0x01 0x02 0x03 */
+    0,               0,               0,               0,   /* 0x04 0x05 0x06 0x07 */
+    KC_BSPC,         KC_TAB,          KC_ENT,          0,   /* 0x08 0x09 0x0A 0x0B */
+    0,               0,               0,               0,   /* 0x0C 0x0D 0x0E 0x0F */
+    0,               0,               0,               0,   /* 0x10 0x11 0x12 0x13 */
+    0,               0,               0,               0,   /* 0x14 0x15 0x16 0x17 */
+    0,               0,               0,               KC_ESC,   /* 0x18 0x19 0x1A 0x1B */
+    0,               0,               0,               0,   /* 0x1C 0x1D 0x1E 0x1F */
+    KC_SPC,          SH | KC_1,       SH | KC_QUOT,    SH | KC_3,   /* ' ' '!' '"' '#' */
+    SH | KC_4,       SH | KC_5,       SH | KC_7,       KC_QUOT,   /* '$' '%' '&' '\'' */
+    SH | KC_9,       SH | KC_0,       SH | KC_8,       SH | KC_EQL,   /* '(' ')' '*' '+' */
+    KC_COMM,         KC_MINS,         KC_DOT,          KC_SLSH,   /* ',' '-' '.' '/' */
+    KC_0,            KC_1,            KC_2,            KC_3,   /* '0' '1' '2' '3' */
+    KC_4,            KC_5,            KC_6,            KC_7,   /* '4' '5' '6' '7' */
+    KC_8,            KC_9,            SH | KC_SCLN,    KC_SCLN,   /* '8' '9' ':' ';' */
+    SH | KC_COMM,    KC_EQL,          SH | KC_DOT,     SH | KC_SLSH,   /* '<' '=' '>' '?' */
+    SH | KC_2,       SH | KC_A,       SH | KC_B,       SH | KC_C,   /* '@' 'A' 'B' 'C' */
+    SH | KC_D,       SH | KC_E,       SH | KC_F,       SH | KC_G,   /* 'D' 'E' 'F' 'G' */
+    SH | KC_H,       SH | KC_I,       SH | KC_J,       SH | KC_K,   /* 'H' 'I' 'J' 'K' */
+    SH | KC_L,       SH | KC_M,       SH | KC_N,       SH | KC_O,   /* 'L' 'M' 'N' 'O' */
+    SH | KC_P,       SH | KC_Q,       SH | KC_R,       SH | KC_S,   /* 'P' 'Q' 'R' 'S' */
+    SH | KC_T,       SH | KC_U,       SH | KC_V,       SH | KC_W,   /* 'T' 'U' 'V' 'W' */
+    SH | KC_X,       SH | KC_Y,       SH | KC_Z,       KC_LBRC,   /* 'X' 'Y' 'Z' '[' */
+    KC_BSLS,         KC_RBRC,         SH | KC_6,       SH | KC_MINS,   /* '\\' ']' '^' '_' */
+    KC_GRV,          KC_A,            KC_B,            KC_C,   /* '`' 'a' 'b' 'c' */
+    KC_D,            KC_E,            KC_F,            KC_G,   /* 'd' 'e' 'f' 'g' */
+    KC_H,            KC_I,            KC_J,            KC_K,   /* 'h' 'i' 'j' 'k' */
+    KC_L,            KC_M,            KC_N,            KC_O,   /* 'l' 'm' 'n' 'o' */
+    KC_P,            KC_Q,            KC_R,            KC_S,   /* 'p' 'q' 'r' 's' */
+    KC_T,            KC_U,            KC_V,            KC_W,   /* 't' 'u' 'v' 'w' */
+    KC_X,            KC_Y,            KC_Z,            SH | KC_LBRC,   /* 'x' 'y' 'z' '{' */
+    SH | KC_BSLS,    SH | KC_RBRC,    SH | KC_GRV,     KC_DEL,   /* '|' '}' '~' 0x7F */
+};
+
+static struct {
+    const uint8_t *pc;
+    int id;
+
+    bool waiting;
+    uint32_t wait_until;
+
+    /* Modifiers set by MACRO_MODS_* */
+    uint8_t mods;
+
+    /* Key of the last tap or character, released by the next step */
+    uint8_t tap_key;
+    bool tap_shift;
+} macro_state;
+
+static bool
+macro_is_text(uint8_t c)
+{
+    return (c > MACRO_MODS_OFF) && (c < 0x80) && ascii_to_keycode[c];
+}
+
+static void
+macro_type(uint8_t c)
+{
+    uint8_t code = ascii_to_keycode[c];
+
+    macro_state.tap_key = code & ~SH;
+    macro_state.tap_shift = (code & SH) != 0;
+
+    usb_hid_macro_mods(macro_state.mods | (macro_state.tap_shift ? MOD_BIT(KC_LSHIFT) : 0));
+    usb_hid_macro_press(macro_state.tap_key);
+}
+
+static void
+macro_stop(void)
+{
+    macro_state.pc = NULL;
+    macro_state.id = -1;
+    macro_state.waiting = false;
+    macro_state.mods = 0;
+    macro_state.tap_key = KC_NO;
+    usb_hid_macro_clear();
+}
+
+void
+macro_play(const uint8_t *seq)
+{
+    if (macro_state.pc) {
+        macro_stop();
+    }
+    dynamic_macro_abort();
+
+    macro_state.pc = seq;
+}
+
+void
+macro_start(unsigned int id)
+{
+    /* Pressing the key of a running macro stops it */
+    if (macro_state.pc && (macro_state.id == (int)id)) {
+        macro_stop();
+        return;
+    }
+
+    if (id >= keymap_macro_count) {
+        return;
+    }
+
+    macro_play(keymap_macros[id]);
+    macro_state.id = id;
+}
+
+void
+macro_abort(void)
+{
+    if (macro_state.pc) {
+        macro_stop();
+    }
+}
+
+bool
+macro_playing(void)
+{
+    return macro_state.pc != NULL;
+}
+
+/* Apply the next change, returns true if a report has to be sent for it */
+bool
+macro_step(uint32_t now)
+{
+    const uint8_t *pc = macro_state.pc;
+    uint8_t op;
+
+    if (!pc) {
+        return false;
+    }
+
+    if (macro_state.waiting) {
+        if ((int32_t)(now - macro_state.wait_until) < 0) {
+            return false;
+        }
+        macro_state.waiting = false;
+    }
+
+    if (macro_state.tap_key) {
+        uint8_t released = macro_state.tap_key;
+
+        usb_hid_macro_release(released);
+        macro_state.tap_key = KC_NO;
+
+        /* A different key with the same shift state can be pressed in the
+         * very report releasing the previous one */
+        if (macro_is_text(*pc)) {
+            uint8_t c = *pc;
+            uint8_t code = ascii_to_keycode[c];
+            if (((code & ~SH) != released) && (((code & SH) != 0) == macro_state.tap_shift)) {
+                macro_state.pc = pc + 1;
+                macro_type(c);
+                return true;
+            }
+        }
+
+        if (*pc == MACRO_END) {
+            macro_stop();
+        } else if (macro_state.tap_shift) {
+            usb_hid_macro_mods(macro_state.mods);
+        }
+        return true;
+    }
+
+    while (1) {
+        op = *pc++;
+
+        switch (op) {
+            case MACRO_END:
+                macro_stop();
+                return true;
+
+            case MACRO_PRESS:
+                usb_hid_macro_press(*pc++);
+                break;
+
+            case MACRO_RELEASE:
+                usb_hid_macro_release(*pc++);
+                break;
+
+            case MACRO_TAP:
+                macro_state.tap_key = *pc++;
+                macro_state.tap_shift = false;
+                usb_hid_macro_press(macro_state.tap_key);
+                break;
+
+            case MACRO_DELAY:
+                macro_state.wait_until = now + (pc[0] | (pc[1] << 8));
+                macro_state.waiting = true;
+                macro_state.pc = pc + 2;
+                return false;
+
+            case MACRO_MODS_ON:
+                macro_state.mods |= *pc++;
+                usb_hid_macro_mods(macro_state.mods);
+                break;
+
+            case MACRO_MODS_OFF:
+                macro_state.mods &= ~*pc++;
+                usb_hid_macro_mods(macro_state.mods);
+                break;
+
+            default:
+                if (!macro_is_text(op)) {
+                    /* Nothing we can type, skip it */
+                    continue;
+                }
+                macro_type(op);
+                break;
+        }
+
+        macro_state.pc = pc;
+        return true;
+    }
+}
+
+/* Length of a macro including its terminator, 0 if it doesn't end
+ * within max bytes. Operands can be 0, so this follows the codes. */
+unsigned int
+macro_size(const uint8_t *seq, unsigned int max)
+{
+    unsigned int i = 0;
+
+    while (i < max) {
+        switch (seq[i]) {
+            case MACRO_END:
+                return i + 1;
+            case MACRO_DELAY:
+                i += 3;
+                break;
+            case MACRO_PRESS:
+            case MACRO_RELEASE:
+            case MACRO_TAP:
+            case MACRO_MODS_ON:
+            case MACRO_MODS_OFF:
+                i += 2;
+                break;
+            default:
+                i += 1;
+                break;
+        }
+    }
+
+    return 0;
+}
+
+void
+macro_print_state(void)
+{
+    printf("macros %d playing %d id %d\n", keymap_macro_count, macro_state.pc != NULL, macro_state.id);
+}
+
+void
+macro_init(void)
+{
+    memset(&macro_state, 0, sizeof(macro_state));
+    macro_state.id = -1;
+}
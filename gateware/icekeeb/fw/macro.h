@@ -0,0 +1,64 @@
+/*
+ * macro.h
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Macro byte code.
+ *
+ * A macro is a zero terminated byte string. Printable ASCII as well as
+ * '\b', '\t', '\n' and 0x1b (escape) are typed as text using a US layout,
+ * the following codes are operations taking the listed operand bytes.
+ */
+#define MACRO_END       0x00
+#define MACRO_PRESS     0x01    /* keycode */
+#define MACRO_RELEASE   0x02    /* keycode */
+#define MACRO_TAP       0x03    /* keycode */
+#define MACRO_DELAY     0x04    /* ms (little endian 16 bit) */
+#define MACRO_MODS_ON   0x05    /* HID modifier bits */
+#define MACRO_MODS_OFF  0x06    /* HID modifier bits */
+
+#define MC_PRESS(kc)    MACRO_PRESS, (kc)
+#define MC_RELEASE(kc)  MACRO_RELEASE, (kc)
+#define MC_TAP(kc)      MACRO_TAP, (kc)
+#define MC_DELAY(ms)    MACRO_DELAY, ((ms) & 0xFF), (((ms) >> 8) & 0xFF)
+#define MC_MODS_ON(m)   MACRO_MODS_ON, (m)
+#define MC_MODS_OFF(m)  MACRO_MODS_OFF, (m)
+
+#define MACRO(...)      ((const uint8_t []){ __VA_ARGS__, MACRO_END })
+#define MACRO_TEXT(s)   ((const uint8_t *)(s))
+
+/* Kept by the keymap, referenced from the layers as M(index) */
+extern const uint8_t *keymap_macros[];
+extern unsigned int keymap_macro_count;
+
+unsigned int macro_size(const uint8_t *seq, unsigned int max);
+void macro_start(unsigned int id);
+void macro_play(const uint8_t *seq);
+void macro_abort(void);
+bool macro_playing(void);
+bool macro_step(uint32_t now);
+void macro_print_state(void);
+void macro_init(void);
@@ -0,0 +1,255 @@
+/*
+ * mousekey.c
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Mouse keys.
+ *
+ * Buttons are reported as they change. Movement and wheel are computed
+ * when a report is built, from the time since the previous one, so the
+ * speed doesn't depend on how often the host polls. Everything is fixed
+ * point with shifts and adds only, the core has no multiplier.
+ *
+ * The first report after a press moves by one unit, so taps can be used
+ * for precise positioning.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mousekey.h"
+
+#include "keycode.h"
+
+#include <no2usb/usb.h>
+
+/* Longest gap accounted for, e.g. while the host didn't poll */
+#define MOUSEKEY_MAX_DT     64
+
+struct mousekey_cfg mousekey_cfg = {
+    .move = {
+        { .start =   64, .max = 1536, .shift = 7, .step = 64 },
+        { .start =   32, .max =   32 },
+        { .start =  256, .max =  256 },
+        { .start = 1024, .max = 1024 },
+    },
+    .wheel = {
+        { .start =    2, .max =   16, .shift = 9, .step = 0 },
+        { .start =    1, .max =    1 },
+        { .start =    4, .max =    4 },
+        { .start =   12, .max =   12 },
+    },
+};
+
+struct mousekey_axis {
+    /* Speed with 8 more fraction bits than the curve, and the distance
+     * not reported yet, both in 1/256 units */
+    uint32_t speed;
+    uint32_t frac;
+};
+
+static struct {
+    uint8_t buttons;
+    bool buttons_changed;
+
+    /* Held keys, one bit each from KC_MS_UP, KC_MS_WH_UP and KC_MS_ACCEL0 */
+    uint8_t move;
+    uint8_t wheel;
+    uint8_t accel;
+
+    struct mousekey_axis move_axis;
+    struct mousekey_axis wheel_axis;
+    uint32_t last;
+} mk_state;
+
+static const struct mousekey_curve *
+mk_curve(const struct mousekey_curve *curves)
+{
+    if (mk_state.accel & 4) {
+        return &curves[3];
+    }
+    if (mk_state.accel & 2) {
+        return &curves[2];
+    }
+    if (mk_state.accel & 1) {
+        return &curves[1];
+    }
+    return &curves[0];
+}
+
+static int
+mk_advance(struct mousekey_axis *axis, const struct mousekey_curve *c, uint32_t dt, bool diagonal)
+{
+    uint32_t start = (uint32_t)c->start << 8;
+    uint32_t max = (uint32_t)c->max << 8;
+    uint32_t speed = axis->speed;
+    uint32_t frac = axis->frac;
+
+    /* The curve may have changed with the accel keys */
+    if (speed < start) {
+        speed = start;
+    }
+    if (speed > max) {
+        speed = max;
+    }
+
+    if (dt > MOUSEKEY_MAX_DT) {
+        dt = MOUSEKEY_MAX_DT;
+    }
+
+    while (dt--) {
+        if (speed < max) {
+            speed += (speed >> c->shift) + c->step;
+            if (speed > max) {
+                speed = max;
+            }
+        }
+
+        uint32_t v = speed >> 8;
+        if (diagonal) {
+            /* ~ 1/sqrt(2) on each axis */
+            v -= (v >> 2) + (v >> 5) + (v >> 6);
+        }
+        frac += v;
+    }
+
+    axis->speed = speed;
+
+    int n = frac >> 8;
+    if (n > 127) {
+        axis->frac = 0;
+        return 127;
+    }
+    axis->frac = frac & 0xFF;
+    return n;
+}
+
+/* Starting to move, the first report goes one unit */
+static void
+mk_start(struct mousekey_axis *axis)
+{
+    if (!mk_state.move && !mk_state.wheel) {
+        mk_state.last = usb_get_tick();
+    }
+    axis->speed = 0;
+    axis->frac = 0x100;
+}
+
+static int8_t
+mk_dir(uint8_t held, uint8_t neg, uint8_t pos, int n)
+{
+    if ((held & (neg | pos)) == neg) {
+        return -n;
+    }
+    if ((held & (neg | pos)) == pos) {
+        return n;
+    }
+    return 0;
+}
+
+void
+mousekey_process(uint16_t keycode, bool down)
+{
+    uint8_t *held;
+    uint8_t bit;
+
+    if (IS_MOUSEKEY_BUTTON(keycode)) {
+        held = &mk_state.buttons;
+        bit = 1 << (keycode - KC_MS_BTN1);
+        mk_state.buttons_changed = true;
+    } else if (IS_MOUSEKEY_MOVE(keycode)) {
+        held = &mk_state.move;
+        bit = 1 << (keycode - KC_MS_UP);
+    } else if (IS_MOUSEKEY_WHEEL(keycode)) {
+        held = &mk_state.wheel;
+        bit = 1 << (keycode - KC_MS_WH_UP);
+    } else if (IS_MOUSEKEY_ACCEL(keycode)) {
+        held = &mk_state.accel;
+        bit = 1 << (keycode - KC_MS_ACCEL0);
+    } else {
+        return;
+    }
+
+    if (!down) {
+        *held &= ~bit;
+        return;
+    }
+
+    if ((held == &mk_state.move) && !mk_state.move) {
+        mk_start(&mk_state.move_axis);
+    }
+    if ((held == &mk_state.wheel) && !mk_state.wheel) {
+        mk_start(&mk_state.wheel_axis);
+    }
+
+    *held |= bit;
+}
+
+/* Fills the next report, returns false if there's nothing to send */
+bool
+mousekey_report(struct mouse_report *report, uint32_t now)
+{
+    bool send = mk_state.buttons_changed;
+    uint32_t dt = now - mk_state.last;
+
+    mk_state.last = now;
+    mk_state.buttons_changed = false;
+
+    memset(report, 0, sizeof(*report));
+    report->buttons = mk_state.buttons;
+
+    if (mk_state.move) {
+        /* Bits are up, down, left, right */
+        bool diagonal = (mk_state.move & 0x03) && (mk_state.move & 0x0C) &&
+                        ((mk_state.move & 0x03) != 0x03) && ((mk_state.move & 0x0C) != 0x0C);
+        int n = mk_advance(&mk_state.move_axis, mk_curve(mousekey_cfg.move), dt, diagonal);
+        report->x = mk_dir(mk_state.move, 0x04, 0x08, n);
+        report->y = mk_dir(mk_state.move, 0x01, 0x02, n);
+    }
+
+    if (mk_state.wheel) {
+        int n = mk_advance(&mk_state.wheel_axis, mk_curve(mousekey_cfg.wheel), dt, false);
+        report->v = mk_dir(mk_state.wheel, 0x02, 0x01, n);
+        report->h = mk_dir(mk_state.wheel, 0x04, 0x08, n);
+    }
+
+    return send || report->x || report->y || report->v || report->h;
+}
+
+void
+mousekey_print_state(void)
+{
+    const struct mousekey_curve *c = mk_curve(mousekey_cfg.move);
+
+    printf("mouse buttons %02x move %x wheel %x accel %x\n",
+        mk_state.buttons, mk_state.move, mk_state.wheel, mk_state.accel);
+    printf("speed %d/256 (curve %d..%d) wheel %d/256\n",
+        (int)(mk_state.move_axis.speed >> 8), c->start, c->max,
+        (int)(mk_state.wheel_axis.speed >> 8));
+}
+
+void
+mousekey_init(void)
+{
+    memset(&mk_state, 0, sizeof(mk_state));
+}
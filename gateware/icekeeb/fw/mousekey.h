@@ -0,0 +1,62 @@
+/*
+ * mousekey.h
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Speeds are in 1/256 of a unit (pixel or wheel detent) per ms. Each ms
+ * a key is held, the speed grows by (speed >> shift) plus step/256 until
+ * it reaches max, so shift gives the exponential part and step the linear
+ * one. start == max gives a constant speed.
+ */
+struct mousekey_curve {
+    uint16_t start;
+    uint16_t max;
+    uint8_t shift;
+    uint8_t step;
+};
+
+/* Curve 0 is used by default, 1 to 3 while KC_ACL0 to KC_ACL2 is held */
+#define MOUSEKEY_CURVES 4
+
+struct mousekey_cfg {
+    struct mousekey_curve move[MOUSEKEY_CURVES];
+    struct mousekey_curve wheel[MOUSEKEY_CURVES];
+};
+
+extern struct mousekey_cfg mousekey_cfg;
+
+struct mouse_report {
+    uint8_t buttons;
+    int8_t x;
+    int8_t y;
+    int8_t v;
+    int8_t h;
+} __attribute__((packed));
+
+void mousekey_process(uint16_t keycode, bool down);
+bool mousekey_report(struct mouse_report *report, uint32_t now);
+void mousekey_print_state(void);
+void mousekey_init(void);
@@ -0,0 +1,192 @@
+/*
+ * oneshot.c
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* One-shot modifiers (OSM) and layers (OSL).
+ *
+ * While the key is held it behaves like a regular modifier / momentary
+ * layer. If nothing was pressed while it was held, releasing it arms the
+ * one-shot for the next non-modifier key press. One-shot modifiers are
+ * merged by the HID layer into the very report carrying that key press.
+ * Tapping the key again while armed locks it, another tap unlocks it.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "oneshot.h"
+#include "action_code.h"
+#include "keymap.h"
+#include "usb_hid.h"
+
+#include <no2usb/usb.h>
+
+struct oneshot_cfg oneshot_cfg = {
+    .timeout = ONESHOT_TIMEOUT,
+    .tap_toggle = true,
+};
+
+static struct {
+    /* Modifiers */
+    uint8_t mods_held;
+    uint8_t mods_armed;
+    uint8_t mods_locked;
+    bool mods_used;
+    uint32_t mods_time;
+
+    /* Layer, -1 if none */
+    int layer_held;
+    int layer_armed;
+    int layer_locked;
+    bool layer_used;
+    uint32_t layer_time;
+} os_state;
+
+void
+oneshot_mod(uint8_t mods, bool down)
+{
+    mods = MODS_TO_HID(mods);
+
+    if (down) {
+        if (os_state.mods_locked & mods) {
+            os_state.mods_locked &= ~mods;
+            usb_hid_reset_mod(mods);
+            return;
+        }
+
+        if (oneshot_cfg.tap_toggle && ((os_state.mods_armed & mods) == mods)) {
+            os_state.mods_armed &= ~mods;
+            os_state.mods_locked |= mods;
+            usb_hid_set_oneshot_mod(os_state.mods_armed);
+            usb_hid_set_mod(mods);
+            return;
+        }
+
+        os_state.mods_held |= mods;
+        os_state.mods_used = false;
+        usb_hid_set_mod(mods);
+        return;
+    }
+
+    if (!(os_state.mods_held & mods)) {
+        /* Release of the press that locked or unlocked */
+        return;
+    }
+
+    os_state.mods_held &= ~mods;
+    usb_hid_reset_mod(mods);
+
+    if (!os_state.mods_used) {
+        os_state.mods_armed |= mods;
+        os_state.mods_time = usb_get_tick();
+        usb_hid_set_oneshot_mod(os_state.mods_armed);
+    }
+}
+
+void
+oneshot_layer(int layer, bool down)
+{
+    if (down) {
+        if (os_state.layer_locked == layer) {
+            os_state.layer_locked = -1;
+            keymap_set_layer(keymap_default_layer);
+            return;
+        }
+
+        if (oneshot_cfg.tap_toggle && (os_state.layer_armed == layer)) {
+            os_state.layer_armed = -1;
+            os_state.layer_locked = layer;
+            return;
+        }
+
+        os_state.layer_held = layer;
+        os_state.layer_used = false;
+        keymap_set_layer(layer);
+        return;
+    }
+
+    if (os_state.layer_held != layer) {
+        return;
+    }
+
+    os_state.layer_held = -1;
+
+    if (os_state.layer_used) {
+        keymap_set_layer(keymap_default_layer);
+    } else {
+        os_state.layer_armed = layer;
+        os_state.layer_time = usb_get_tick();
+    }
+}
+
+/* Called after a non-modifier key press was handed to the HID layer,
+ * which already merged and consumed the armed modifiers for it.
+ */
+void
+oneshot_key_pressed(void)
+{
+    os_state.mods_used = true;
+    os_state.mods_armed = 0;
+
+    os_state.layer_used = true;
+    if (os_state.layer_armed >= 0) {
+        os_state.layer_armed = -1;
+        keymap_set_layer(keymap_default_layer);
+    }
+}
+
+void
+oneshot_task(uint32_t now)
+{
+    if (!oneshot_cfg.timeout) {
+        return;
+    }
+
+    if (os_state.mods_armed && ((now - os_state.mods_time) >= oneshot_cfg.timeout)) {
+        os_state.mods_armed = 0;
+        usb_hid_set_oneshot_mod(0);
+    }
+
+    if ((os_state.layer_armed >= 0) && ((now - os_state.layer_time) >= oneshot_cfg.timeout)) {
+        os_state.layer_armed = -1;
+        keymap_set_layer(keymap_default_layer);
+    }
+}
+
+void
+oneshot_print_state(void)
+{
+    printf("oneshot mods armed %02X locked %02X layer armed %d locked %d\n",
+        os_state.mods_armed, os_state.mods_locked,
+        os_state.layer_armed, os_state.layer_locked);
+}
+
+void
+oneshot_init(void)
+{
+    memset(&os_state, 0, sizeof(os_state));
+    os_state.layer_held = -1;
+    os_state.layer_armed = -1;
+    os_state.layer_locked = -1;
+}
@@ -0,0 +1,47 @@
+/*
+ * oneshot.h
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Time in ms after which an unused one-shot is dropped, 0 to keep it forever */
+#ifndef ONESHOT_TIMEOUT
+#define ONESHOT_TIMEOUT 0
+#endif
+
+struct oneshot_cfg {
+    uint16_t timeout;
+    /* Tapping the one-shot key again while it is armed locks it */
+    bool tap_toggle;
+};
+
+extern struct oneshot_cfg oneshot_cfg;
+
+void oneshot_mod(uint8_t mods, bool down);
+void oneshot_layer(int layer, bool down);
+void oneshot_key_pressed(void);
+void oneshot_task(uint32_t now);
+void oneshot_print_state(void);
+void oneshot_init(void);
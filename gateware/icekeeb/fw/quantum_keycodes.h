@@ -542,6 +542,9 @@ enum quantum_keycodes {
     JS_BUTTON31,
     JS_BUTTON_MAX = JS_BUTTON31,
 
+    // Caps word
+    CAPS_WORD,
+
 #if defined(SEQUENCER_ENABLE)
     SQ_ON,
     SQ_OFF,
@@ -842,6 +845,9 @@ enum quantum_keycodes {
 #define KC_HYPR HYPR(KC_NO)
 #define KC_MEH MEH(KC_NO)
 
+// Caps word
+#define CAPSWRD CAPS_WORD
+
 // UNICODE_ENABLE - Allows Unicode input up to 0x7FFF
 #define UC(c) (QK_UNICODE | (c))
 // UNICODEMAP_ENABLE - Allows Unicode input up to 0x10FFFF, requires unicode_map
@@ -121,6 +121,9 @@ spi_xfer(unsigned cs, struct spi_xfer_chunk *xfer, unsigned n)
 #define FLASH_CMD_CHIP_ERASE		0x60
 #define FLASH_CMD_SECTOR_ERASE		0x20
 
+/* A program / erase was started and might still be running */
+static bool flash_busy;
+
 void
 flash_cmd(uint8_t cmd)
 {
@@ -204,6 +207,7 @@ flash_write_sr(uint8_t sr)
 		{ .data = (void*)cmd, .len = 2, .read = false, .write = true,  },
 	};
 	spi_xfer(SPI_CS_FLASH, xfer, 1);
+	flash_busy = true;
 }
 
 void
@@ -214,6 +218,7 @@ flash_read(void *dst, uint32_t addr, unsigned len)
 		{ .data = (void*)cmd, .len = 4,   .read = false, .write = true,  },
 		{ .data = (void*)dst, .len = len, .read = true,  .write = false, },
 	};
+	flash_wait();
 	spi_xfer(SPI_CS_FLASH, xfer, 2);
 }
 
@@ -226,6 +231,7 @@ flash_page_program(void *src, uint32_t addr, unsigned len)
 		{ .data = (void*)src, .len = len, .read = false, .write = true, },
 	};
 	spi_xfer(SPI_CS_FLASH, xfer, 2);
+	flash_busy = true;
 }
 
 void
@@ -236,4 +242,20 @@ flash_sector_erase(uint32_t addr)
 		{ .data = (void*)cmd, .len = 4,   .read = false, .write = true,  },
 	};
 	spi_xfer(SPI_CS_FLASH, xfer, 1);
+	flash_busy = true;
+}
+
+/* Whether the last program / erase is done, without waiting for it */
+bool
+flash_ready(void)
+{
+	if (flash_busy)
+		flash_busy = flash_read_sr() & 1;
+	return !flash_busy;
+}
+
+void
+flash_wait(void)
+{
+	while (!flash_ready());
 }
@@ -50,3 +50,5 @@ void flash_write_sr(uint8_t sr);
 void flash_read(void *dst, uint32_t addr, unsigned len);
 void flash_page_program(void *src, uint32_t addr, unsigned len);
 void flash_sector_erase(uint32_t addr);
+bool flash_ready(void);
+void flash_wait(void);
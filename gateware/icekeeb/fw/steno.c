@@ -0,0 +1,250 @@
+/*
+ * steno.c
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Steno.
+ *
+ * Steno keys never reach the HID report. Each press adds its key to the
+ * chord, and once every steno key is up again the whole chord goes out as
+ * a single stroke on the CDC serial port, in the protocol the steno
+ * software expects:
+ *
+ *  - GeminiPR: 6 bytes, 7 keys per byte from bit 6 down, in the order of
+ *    the STN_* keycodes, with bit 7 only set in the first byte.
+ *  - TX Bolt: one byte per non empty group of keys, the group in the top
+ *    two bits, followed by a zero byte.
+ *
+ * Strokes are queued, so a burst of them is not lost while the IN
+ * endpoint is busy.
+ *
+ * The steno software reads the raw serial stream, anything else in it
+ * desyncs the strokes. Once a steno key was pressed the console and the
+ * trace stay off the CDC port, see steno_active().
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "steno.h"
+#include "keymap.h"
+#include "usb_cdc.h"
+
+#include "quantum_keycodes.h"
+
+#define STENO_QUEUE     64      /* bytes, power of 2 */
+#define STENO_KEYS      (STN_MAX - QK_STENO + 1)
+
+/* TX Bolt group (top 2 bits) and key bits of each STN_* key */
+#define TXB_NUL     0x00
+#define TXB_S_L     0x01
+#define TXB_T_L     0x02
+#define TXB_K_L     0x04
+#define TXB_P_L     0x08
+#define TXB_W_L     0x10
+#define TXB_H_L     0x20
+#define TXB_R_L     0x41
+#define TXB_A_L     0x42
+#define TXB_O_L     0x44
+#define TXB_STR     0x48
+#define TXB_E_R     0x50
+#define TXB_U_R     0x60
+#define TXB_F_R     0x81
+#define TXB_R_R     0x82
+#define TXB_P_R     0x84
+#define TXB_B_R     0x88
+#define TXB_L_R     0x90
+#define TXB_G_R     0xA0
+#define TXB_T_R     0xC1
+#define TXB_S_R     0xC2
+#define TXB_D_R     0xC4
+#define TXB_Z_R     0xC8
+#define TXB_NUM     0xD0
+
+static const uint8_t steno_boltmap[STENO_KEYS] = {
+    TXB_NUL, TXB_NUM, TXB_NUM, TXB_NUM, TXB_NUM, TXB_NUM, TXB_NUM,
+    TXB_S_L, TXB_S_L, TXB_T_L, TXB_K_L, TXB_P_L, TXB_W_L, TXB_H_L,
+    TXB_R_L, TXB_A_L, TXB_O_L, TXB_STR, TXB_STR, TXB_NUL, TXB_NUL,
+    TXB_NUL, TXB_STR, TXB_STR, TXB_E_R, TXB_U_R, TXB_F_R, TXB_R_R,
+    TXB_P_R, TXB_B_R, TXB_L_R, TXB_G_R, TXB_T_R, TXB_S_R, TXB_D_R,
+    TXB_NUM, TXB_NUM, TXB_NUM, TXB_NUM, TXB_NUM, TXB_NUM, TXB_Z_R,
+};
+
+static struct {
+    enum steno_mode mode;
+    bool active;
+
+    /* Matrix positions of the steno keys down, and the chord so far */
+    matrix_mask_t held;
+    uint64_t chord;
+
+    /* Strokes waiting for the IN endpoint */
+    uint8_t queue[STENO_QUEUE];
+    unsigned int head;
+    unsigned int len;
+
+    unsigned int strokes;
+    unsigned int dropped;
+} steno_state;
+
+static void
+steno_queue(const uint8_t *pkt, unsigned int len)
+{
+    /* A partial stroke would desync the host, drop it whole */
+    if (steno_state.len + len > STENO_QUEUE) {
+        steno_state.dropped++;
+        return;
+    }
+
+    for (unsigned int i = 0; i < len; i++) {
+        steno_state.queue[(steno_state.head + steno_state.len++) & (STENO_QUEUE - 1)] = pkt[i];
+    }
+
+    steno_state.strokes++;
+}
+
+static void
+steno_send_gemini(uint64_t chord)
+{
+    uint8_t pkt[6] = { 0x80, 0, 0, 0, 0, 0 };
+    unsigned int byte = 0;
+    uint8_t mask = 0x40;
+
+    for (unsigned int i = 0; i < STENO_KEYS; i++) {
+        if ((chord >> i) & 1) {
+            pkt[byte] |= mask;
+        }
+        mask >>= 1;
+        if (!mask) {
+            byte++;
+            mask = 0x40;
+        }
+    }
+
+    steno_queue(pkt, sizeof(pkt));
+}
+
+static void
+steno_send_bolt(uint64_t chord)
+{
+    uint8_t groups[4] = { 0, 0, 0, 0 };
+    uint8_t pkt[5];
+    unsigned int len = 0;
+
+    for (unsigned int i = 0; i < STENO_KEYS; i++) {
+        if ((chord >> i) & 1) {
+            groups[steno_boltmap[i] >> 6] |= steno_boltmap[i] & 0x3F;
+        }
+    }
+
+    for (unsigned int g = 0; g < 4; g++) {
+        if (groups[g]) {
+            pkt[len++] = (g << 6) | groups[g];
+        }
+    }
+    pkt[len++] = 0;
+
+    steno_queue(pkt, len);
+}
+
+bool
+steno_active(void)
+{
+    return steno_state.active;
+}
+
+void
+steno_process(unsigned int col, unsigned int row, uint16_t keycode, bool down)
+{
+    matrix_mask_t bit = MATRIX_BIT(col, row);
+
+    if ((keycode == QK_STENO_GEMINI) || (keycode == QK_STENO_BOLT)) {
+        if (down) {
+            steno_state.mode = (keycode == QK_STENO_BOLT) ? STENO_MODE_BOLT : STENO_MODE_GEMINI;
+        }
+        return;
+    }
+
+    if (!IS_STENO(keycode)) {
+        return;
+    }
+
+    if (down) {
+        steno_state.active = true;
+        steno_state.held |= bit;
+        steno_state.chord |= (uint64_t)1 << (keycode - QK_STENO);
+        return;
+    }
+
+    if (!(steno_state.held & bit)) {
+        return;
+    }
+
+    steno_state.held &= ~bit;
+
+    /* Last key up, the stroke is complete */
+    if (!steno_state.held && steno_state.chord) {
+        if (steno_state.mode == STENO_MODE_BOLT) {
+            steno_send_bolt(steno_state.chord);
+        } else {
+            steno_send_gemini(steno_state.chord);
+        }
+        steno_state.chord = 0;
+    }
+}
+
+void
+steno_task(void)
+{
+    uint8_t buf[STENO_QUEUE] __attribute__((aligned(4)));
+
+    if (!steno_state.len) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < steno_state.len; i++) {
+        buf[i] = steno_state.queue[(steno_state.head + i) & (STENO_QUEUE - 1)];
+    }
+
+    if (usb_cdc_write(buf, steno_state.len)) {
+        steno_state.head = (steno_state.head + steno_state.len) & (STENO_QUEUE - 1);
+        steno_state.len = 0;
+    }
+}
+
+void
+steno_print_state(void)
+{
+    printf("steno %s held %08x%08x chord %08x%08x\n",
+        steno_state.mode == STENO_MODE_BOLT ? "txbolt" : "gemini",
+        (unsigned int)(steno_state.held >> 32), (unsigned int)steno_state.held,
+        (unsigned int)(steno_state.chord >> 32), (unsigned int)steno_state.chord);
+    printf("queued %d strokes %d dropped %d\n", steno_state.len, steno_state.strokes, steno_state.dropped);
+}
+
+void
+steno_init(void)
+{
+    memset(&steno_state, 0, sizeof(steno_state));
+    steno_state.mode = STENO_MODE_GEMINI;
+}
@@ -0,0 +1,94 @@
+/*
+ * steno.h
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "quantum_keycodes.h"
+
+/* Steno keys, in the bit order of the GeminiPR packet */
+enum steno_keycodes {
+    STN_FN = QK_STENO,
+    STN_N1,
+    STN_N2,
+    STN_N3,
+    STN_N4,
+    STN_N5,
+    STN_N6,
+    STN_S1,
+    STN_S2,
+    STN_TL,
+    STN_KL,
+    STN_PL,
+    STN_WL,
+    STN_HL,
+    STN_RL,
+    STN_A,
+    STN_O,
+    STN_ST1,
+    STN_ST2,
+    STN_RES1,
+    STN_RES2,
+    STN_PWR,
+    STN_ST3,
+    STN_ST4,
+    STN_E,
+    STN_U,
+    STN_FR,
+    STN_RR,
+    STN_PR,
+    STN_BR,
+    STN_LR,
+    STN_GR,
+    STN_TR,
+    STN_SR,
+    STN_DR,
+    STN_N7,
+    STN_N8,
+    STN_N9,
+    STN_NA,
+    STN_NB,
+    STN_NC,
+    STN_ZR,
+    STN_MAX = STN_ZR,
+};
+
+#define STN_BOLT        QK_STENO_BOLT
+#define STN_GEM         QK_STENO_GEMINI
+
+#define IS_STENO(kc)    (((kc) >= QK_STENO) && ((kc) <= STN_MAX))
+
+enum steno_mode {
+    STENO_MODE_GEMINI,
+    STENO_MODE_BOLT,
+};
+
+/* True from the first steno key press on, the CDC port then carries the
+ * steno stream only */
+bool steno_active(void);
+void steno_process(unsigned int col, unsigned int row, uint16_t keycode, bool down);
+void steno_task(void);
+void steno_print_state(void);
+void steno_init(void);
@@ -0,0 +1,195 @@
+/*
+ * swap_hands.c
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Swap hands.
+ *
+ * While swapped, each key event is moved to the mirrored matrix position
+ * before it enters the pipeline, so every later stage sees the key of the
+ * other half. Each press remembers where it went, and its release goes to
+ * the same place whatever the swap state is by then.
+ *
+ * The swap keys themselves are never moved.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "swap_hands.h"
+#include "tap_hold.h"
+
+#include "action_code.h"
+#include "keycode.h"
+#include "quantum_keycodes.h"
+
+#include <no2usb/usb.h>
+
+static struct {
+    /* Toggled / switched state, and the momentary one on top */
+    bool on;
+    bool held;
+    int held_count;
+
+    /* One-shot, swaps the next key press */
+    bool oneshot;
+
+    /* SH_T / SH_TT / SH_OS held: press time, and whether another key was pressed */
+    uint32_t press_time;
+    bool used;
+
+    /* Position each pressed key was resolved to */
+    uint8_t keys[MATRIX_ROWS][MATRIX_COLS];
+    matrix_mask_t pressed;
+} sh_state;
+
+static bool
+sh_swapped(void)
+{
+    return sh_state.on ^ sh_state.held ^ sh_state.oneshot;
+}
+
+static bool
+sh_is_swap_key(uint16_t keycode)
+{
+    return (keycode >= QK_SWAP_HANDS) && (keycode <= QK_SWAP_HANDS_MAX);
+}
+
+void
+swap_hands_event(struct key_event *ev)
+{
+    matrix_mask_t bit = MATRIX_BIT(ev->col, ev->row);
+    uint8_t *key = &sh_state.keys[ev->row][ev->col];
+
+    if (!ev->down) {
+        if (sh_state.pressed & bit) {
+            sh_state.pressed &= ~bit;
+            ev->col = SH_POS_COL(*key);
+            ev->row = SH_POS_ROW(*key);
+        }
+        return;
+    }
+
+    if (sh_is_swap_key(keymap_get_code(ev->col, ev->row))) {
+        return;
+    }
+
+    sh_state.used = true;
+
+    if (!sh_swapped()) {
+        return;
+    }
+
+    *key = keymap_swap_hands[ev->row][ev->col];
+    sh_state.pressed |= bit;
+    ev->col = SH_POS_COL(*key);
+    ev->row = SH_POS_ROW(*key);
+
+    sh_state.oneshot = false;
+}
+
+static void
+sh_hold(bool down)
+{
+    sh_state.held_count += down ? 1 : -1;
+    sh_state.held = sh_state.held_count > 0;
+}
+
+void
+swap_hands_process(unsigned int col, unsigned int row, uint16_t keycode, bool down)
+{
+    uint8_t op = keycode & 0xFF;
+    bool tap = false;
+
+    if (down) {
+        sh_state.press_time = usb_get_tick();
+        sh_state.used = false;
+    } else {
+        tap = !sh_state.used && ((usb_get_tick() - sh_state.press_time) < tap_hold_cfg.tapping_term);
+    }
+
+    switch (op) {
+        case OP_SH_TOGGLE:
+            if (down) {
+                sh_state.on = !sh_state.on;
+            }
+            break;
+
+        case OP_SH_TAP_TOGGLE:
+            sh_hold(down);
+            if (tap) {
+                sh_state.on = !sh_state.on;
+            }
+            break;
+
+        case OP_SH_ON_OFF:
+            sh_hold(down);
+            break;
+
+        case OP_SH_OFF_ON:
+            sh_state.on = !down;
+            break;
+
+        case OP_SH_ON:
+            if (down) {
+                sh_state.on = true;
+            }
+            break;
+
+        case OP_SH_OFF:
+            if (down) {
+                sh_state.on = false;
+            }
+            break;
+
+        case OP_SH_ONESHOT:
+            /* Held, it works like SH_MON. Tapped, the next key is swapped */
+            sh_hold(down);
+            if (down) {
+                sh_state.oneshot = false;
+            } else {
+                sh_state.oneshot = !sh_state.used;
+            }
+            break;
+
+        default:
+            /* SH_T(kc), swapped while held, kc when tapped */
+            sh_hold(down);
+            if (tap) {
+                keyboard_tap_code(col, row, op);
+            }
+            break;
+    }
+}
+
+void
+swap_hands_print_state(void)
+{
+    printf("swap hands on %d held %d oneshot %d\n", sh_state.on, sh_state.held, sh_state.oneshot);
+}
+
+void
+swap_hands_init(void)
+{
+    memset(&sh_state, 0, sizeof(sh_state));
+}
@@ -0,0 +1,42 @@
+/*
+ * swap_hands.h
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "keyboard.h"
+#include "keymap.h"
+
+/* Mirror of each matrix position, generated from LAYOUT() by swap_hands_gen.py */
+#define SH_POS(col, row)    (((row) << 4) | (col))
+#define SH_POS_COL(p)       ((p) & 0x0F)
+#define SH_POS_ROW(p)       ((p) >> 4)
+
+extern const uint8_t keymap_swap_hands[MATRIX_ROWS][MATRIX_COLS];
+
+void swap_hands_event(struct key_event *ev);
+void swap_hands_process(unsigned int col, unsigned int row, uint16_t keycode, bool down);
+void swap_hands_print_state(void);
+void swap_hands_init(void);
@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+#
+# Generates the swap hands mirror table from the LAYOUT() macro of the
+# keymap. Each line of the LAYOUT() parameters is a physical row, mirrored
+# by reversing it. The macro body gives the matrix position of every
+# parameter.
+#
+
+import re
+import sys
+
+
+def parse_layout(name):
+	with open(name, 'r') as fh:
+		src = fh.read()
+
+	m = re.search(r'#define\s+LAYOUT\(((?:[^)]|\n)*)\)\s*\\\n((?:.*\\\n)*.*)', src)
+	if not m:
+		raise ValueError('no LAYOUT() in ' + name)
+
+	params = []
+	for line in m.group(1).split('\n'):
+		keys = re.findall(r'\bk\w+\b', line)
+		if keys:
+			params.append(keys)
+
+	matrix = []
+	for line in m.group(2).split('\n'):
+		line = line.rstrip('\\').strip()
+		if line.startswith('{') and line.count('{') == 1 and '}' in line:
+			matrix.append(re.findall(r'\w+', line))
+
+	return params, matrix
+
+
+def main(argv0, keymap_name, out_name):
+	params, matrix = parse_layout(keymap_name)
+
+	pos = {}
+	for r, row in enumerate(matrix):
+		for c, k in enumerate(row):
+			if k.startswith('k'):
+				pos[k] = (c, r)
+
+	mirror = {}
+	for row in params:
+		for a, b in zip(row, reversed(row)):
+			mirror[pos[a]] = pos[b]
+
+	with open(out_name, 'w') as fh:
+		fh.write('/* Generated by swap_hands_gen.py from %s, do not edit */\n\n' % keymap_name)
+		fh.write('const uint8_t keymap_swap_hands[%d][%d] = {\n' % (len(matrix), len(matrix[0])))
+		for r, row in enumerate(matrix):
+			ents = []
+			for c in range(len(row)):
+				mc, mr = mirror.get((c, r), (c, r))
+				ents.append('SH_POS(%2d, %d)' % (mc, mr))
+			fh.write('\t{ %s },\n' % ', '.join(ents))
+		fh.write('};\n')
+
+if __name__ == '__main__':
+	main(*sys.argv)
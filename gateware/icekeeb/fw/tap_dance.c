@@ -0,0 +1,193 @@
+/*
+ * tap_dance.c
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Tap dance: the action of a TD() key depends on how many times it was
+ * tapped in a row. Each dance keeps its state in its keymap entry, only
+ * one dance counts taps at a time. A dance finishes once the tapping
+ * term passed since its last press, when it reaches max_taps, or as soon
+ * as any other key is pressed.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tap_dance.h"
+#include "tap_hold.h"
+#include "keyboard.h"
+#include "keymap.h"
+
+static struct {
+    /* Dance currently counting taps, -1 if none */
+    int active;
+
+    /* Dance index + 1 owning each matrix position */
+    uint8_t keys[MATRIX_ROWS][MATRIX_COLS];
+} td_state;
+
+static void
+td_reset(struct tap_dance_action *action)
+{
+    struct tap_dance_state *st = &action->state;
+
+    if (action->on_reset) {
+        action->on_reset(st, action->user);
+    }
+
+    td_state.keys[st->row][st->col] = 0;
+    st->count = 0;
+    st->finished = false;
+    st->interrupted = false;
+}
+
+static void
+td_finish(void)
+{
+    struct tap_dance_action *action = &keymap_tap_dances[td_state.active];
+    struct tap_dance_state *st = &action->state;
+
+    td_state.active = -1;
+
+    st->finished = true;
+    if (action->on_finished) {
+        action->on_finished(st, action->user);
+    }
+
+    /* Released already, nothing will come to undo it */
+    if (!st->pressed) {
+        td_reset(action);
+    }
+}
+
+/* Returns true if the event was consumed by the tap dance engine */
+bool
+tap_dance_process(const struct key_event *ev)
+{
+    uint8_t owner = td_state.keys[ev->row][ev->col];
+
+    if (!ev->down) {
+        if (!owner) {
+            return false;
+        }
+
+        struct tap_dance_action *action = &keymap_tap_dances[owner - 1];
+        action->state.pressed = false;
+        if (action->state.finished) {
+            td_reset(action);
+        }
+        return true;
+    }
+
+    uint16_t keycode = keymap_get_code(ev->col, ev->row);
+    int idx = keycode - QK_TAP_DANCE;
+
+    if ((keycode < QK_TAP_DANCE) || (keycode > QK_TAP_DANCE_MAX) ||
+        (idx >= (int)keymap_tap_dance_count)) {
+        /* Any other key settles the running dance before it goes out */
+        if (td_state.active >= 0) {
+            keymap_tap_dances[td_state.active].state.interrupted = true;
+            td_finish();
+        }
+        return false;
+    }
+
+    if ((td_state.active >= 0) && (td_state.active != idx)) {
+        keymap_tap_dances[td_state.active].state.interrupted = true;
+        td_finish();
+    }
+
+    struct tap_dance_action *action = &keymap_tap_dances[idx];
+    struct tap_dance_state *st = &action->state;
+
+    if (st->finished) {
+        /* Finished on hold and pressed again from another position */
+        return true;
+    }
+
+    st->count++;
+    st->pressed = true;
+    st->timer = ev->time;
+    st->col = ev->col;
+    st->row = ev->row;
+    td_state.keys[ev->row][ev->col] = idx + 1;
+    td_state.active = idx;
+
+    if (action->on_each_tap) {
+        action->on_each_tap(st, action->user);
+    }
+
+    if (action->max_taps && (st->count >= action->max_taps)) {
+        td_finish();
+    }
+
+    return true;
+}
+
+void
+tap_dance_task(uint32_t now)
+{
+    if (td_state.active < 0) {
+        return;
+    }
+
+    if ((now - keymap_tap_dances[td_state.active].state.timer) >= tap_hold_cfg.tapping_term) {
+        td_finish();
+    }
+}
+
+void
+tap_dance_pair_finished(struct tap_dance_state *st, const void *user)
+{
+    const uint16_t *pair = user;
+
+    st->keycode = pair[st->count > 1 ? 1 : 0];
+    keyboard_do_code(st->col, st->row, st->keycode, true);
+}
+
+void
+tap_dance_pair_reset(struct tap_dance_state *st, const void *user)
+{
+    keyboard_do_code(st->col, st->row, st->keycode, false);
+}
+
+void
+tap_dance_print_state(void)
+{
+    printf("tap dances %d active %d\n", keymap_tap_dance_count, td_state.active);
+    if (td_state.active >= 0) {
+        struct tap_dance_state *st = &keymap_tap_dances[td_state.active].state;
+        printf("  count %d pressed %d\n", st->count, st->pressed);
+    }
+}
+
+void
+tap_dance_init(void)
+{
+    memset(&td_state, 0, sizeof(td_state));
+    td_state.active = -1;
+
+    for (unsigned int i = 0; i < keymap_tap_dance_count; i++) {
+        memset(&keymap_tap_dances[i].state, 0, sizeof(struct tap_dance_state));
+    }
+}
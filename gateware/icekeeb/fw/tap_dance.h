@@ -0,0 +1,81 @@
+/*
+ * tap_dance.h
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "keyboard.h"
+#include "quantum_keycodes.h"
+
+#define TD(n) (QK_TAP_DANCE | ((n) & 0xFF))
+
+struct tap_dance_state {
+    uint8_t count;
+    bool pressed;
+    bool interrupted;
+    bool finished;
+    uint32_t timer;
+    uint8_t col;
+    uint8_t row;
+    /* Scratch for the handlers, e.g. the keycode to release on reset */
+    uint16_t keycode;
+};
+
+typedef void (*tap_dance_fn)(struct tap_dance_state *state, const void *user);
+
+struct tap_dance_action {
+    tap_dance_fn on_each_tap;
+    tap_dance_fn on_finished;
+    tap_dance_fn on_reset;
+    const void *user;
+    /* Finish right away at this many taps, 0 waits for the term */
+    uint8_t max_taps;
+    struct tap_dance_state state;
+};
+
+void tap_dance_pair_finished(struct tap_dance_state *state, const void *user);
+void tap_dance_pair_reset(struct tap_dance_state *state, const void *user);
+
+/* One tap sends kc1, two taps send kc2, held while the key is */
+#define ACTION_TAP_DANCE_DOUBLE(kc1, kc2) {         \
+    .on_finished = tap_dance_pair_finished,         \
+    .on_reset = tap_dance_pair_reset,               \
+    .user = (const uint16_t []){ (kc1), (kc2) },    \
+    .max_taps = 2,                                  \
+}
+
+#define ACTION_TAP_DANCE_FN(finished, reset) {      \
+    .on_finished = (finished),                      \
+    .on_reset = (reset),                            \
+}
+
+/* Defined by the keymap */
+extern struct tap_dance_action keymap_tap_dances[];
+extern const unsigned int keymap_tap_dance_count;
+
+bool tap_dance_process(const struct key_event *ev);
+void tap_dance_task(uint32_t now);
+void tap_dance_print_state(void);
+void tap_dance_init(void);
@@ -0,0 +1,267 @@
+/*
+ * tap_hold.c
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Tap-hold resolution for the mod-tap (MT) and layer-tap (LT) keycodes.
+ *
+ * Only one key can be undecided at a time. While it is, every following
+ * event is held back in a small buffer. As soon as the outcome is known
+ * (release, timeout, or one of the configured policies triggering) the
+ * decision is applied and the buffered events are replayed in order, all
+ * from within the same keyboard_poll() call.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tap_hold.h"
+#include "keyboard.h"
+#include "keymap.h"
+#include "usb_hid.h"
+
+#include "action_code.h"
+#include "keycode.h"
+#include "quantum_keycodes.h"
+
+struct tap_hold_cfg tap_hold_cfg = {
+    .tapping_term = TAPPING_TERM,
+    .permissive_hold = true,
+    .hold_on_other_key_press = false,
+    .retro_tapping = false,
+};
+
+static struct {
+    /* The key waiting for a decision */
+    bool pending;
+    struct key_event press;
+    uint16_t keycode;
+
+    /* Events that arrived while the decision was pending */
+    struct key_event buf[TAP_HOLD_BUFFER];
+    int buf_len;
+
+    /* Events left to replay after decisions. Nothing new comes in while
+     * replaying, so this never holds more than the buffer plus the event
+     * that triggered the decision. Replaying from here rather than from
+     * the C stack keeps nested decisions from eating the small stack. */
+    struct key_event replay[TAP_HOLD_BUFFER + 1];
+    int replay_head;
+    int replay_len;
+    bool replaying;
+
+    /* Incremented on every other key press, used for retro tapping */
+    uint8_t seq;
+
+    /* Decided keys, indexed by matrix position so releases are O(1) */
+    struct {
+        uint16_t keycode;
+        bool hold;
+        uint8_t seq;
+    } keys[MATRIX_ROWS][MATRIX_COLS];
+} th_state;
+
+static bool
+is_tap_hold(uint16_t keycode)
+{
+    return ((keycode >= QK_MOD_TAP) && (keycode <= QK_MOD_TAP_MAX)) ||
+           ((keycode >= QK_LAYER_TAP) && (keycode <= QK_LAYER_TAP_MAX));
+}
+
+static void
+th_do_hold(uint16_t keycode, bool down)
+{
+    if (keycode >= QK_MOD_TAP) {
+        if (down) {
+            usb_hid_set_mod(MODS_TO_HID((keycode >> 8) & 0x1F));
+        } else {
+            usb_hid_reset_mod(MODS_TO_HID((keycode >> 8) & 0x1F));
+        }
+    } else {
+        keymap_set_layer(down ? ((keycode >> 8) & 0x0F) : keymap_default_layer);
+    }
+}
+
+static void
+th_replay_push_front(const struct key_event *ev)
+{
+    th_state.replay_head = (th_state.replay_head ? th_state.replay_head : TAP_HOLD_BUFFER + 1) - 1;
+    th_state.replay[th_state.replay_head] = *ev;
+    th_state.replay_len++;
+}
+
+/* Apply the decision for the pending key, then replay the buffered
+ * events followed by the one that triggered the decision, if any.
+ */
+static void
+th_resolve(bool hold, const struct key_event *ev)
+{
+    unsigned int col = th_state.press.col;
+    unsigned int row = th_state.press.row;
+
+    th_state.keys[row][col].keycode = th_state.keycode;
+    th_state.keys[row][col].hold = hold;
+    th_state.keys[row][col].seq = th_state.seq;
+
+    if (hold) {
+        th_do_hold(th_state.keycode, true);
+    } else {
+        keyboard_do_code(col, row, th_state.keycode & 0xFF, true);
+    }
+
+    /* Queue in front of what an outer decision still has to replay */
+    if (ev) {
+        th_replay_push_front(ev);
+    }
+    for (int i = th_state.buf_len - 1; i >= 0; i--) {
+        th_replay_push_front(&th_state.buf[i]);
+    }
+
+    th_state.pending = false;
+    th_state.buf_len = 0;
+
+    if (th_state.replaying) {
+        return;
+    }
+
+    /* The replay can start a new pending key which buffers again */
+    th_state.replaying = true;
+    while (th_state.replay_len) {
+        struct key_event e = th_state.replay[th_state.replay_head];
+        if (++th_state.replay_head == TAP_HOLD_BUFFER + 1) {
+            th_state.replay_head = 0;
+        }
+        th_state.replay_len--;
+        keyboard_event(KB_STAGE_TAP_HOLD, &e);
+    }
+    th_state.replaying = false;
+}
+
+static bool
+th_buffered_press(const struct key_event *ev)
+{
+    for (int i = 0; i < th_state.buf_len; i++) {
+        if (th_state.buf[i].down &&
+            (th_state.buf[i].col == ev->col) &&
+            (th_state.buf[i].row == ev->row)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+th_release(const struct key_event *ev)
+{
+    unsigned int col = ev->col;
+    unsigned int row = ev->row;
+    uint16_t keycode = th_state.keys[row][col].keycode;
+
+    if (th_state.keys[row][col].hold) {
+        th_do_hold(keycode, false);
+        if (tap_hold_cfg.retro_tapping && (th_state.keys[row][col].seq == th_state.seq)) {
+            keyboard_tap_code(col, row, keycode & 0xFF);
+        }
+    } else {
+        keyboard_do_code(col, row, keycode & 0xFF, false);
+    }
+
+    th_state.keys[row][col].keycode = KC_NO;
+}
+
+static void
+th_process_pending(const struct key_event *ev)
+{
+    bool own = (ev->col == th_state.press.col) && (ev->row == th_state.press.row);
+    bool expired = (ev->time - th_state.press.time) >= tap_hold_cfg.tapping_term;
+
+    if (own && !ev->down) {
+        /* Released: tap, unless the term ran out before we noticed */
+        th_resolve(expired, ev);
+    } else if (expired) {
+        th_resolve(true, ev);
+    } else if (ev->down && tap_hold_cfg.hold_on_other_key_press) {
+        th_resolve(true, ev);
+    } else if (!ev->down && tap_hold_cfg.permissive_hold && th_buffered_press(ev)) {
+        th_resolve(true, ev);
+    } else if (th_state.buf_len == TAP_HOLD_BUFFER) {
+        /* Out of space, we can't keep the decision open any longer */
+        th_resolve(true, ev);
+    } else {
+        th_state.buf[th_state.buf_len++] = *ev;
+    }
+}
+
+/* Returns true if the event was consumed by the tap-hold engine */
+bool
+tap_hold_process(const struct key_event *ev)
+{
+    /* While undecided, every event is either buffered or replayed */
+    if (th_state.pending) {
+        th_process_pending(ev);
+        return true;
+    }
+
+    if (!ev->down) {
+        if (th_state.keys[ev->row][ev->col].keycode != KC_NO) {
+            th_release(ev);
+            return true;
+        }
+        return false;
+    }
+
+    th_state.seq++;
+
+    uint16_t keycode = keymap_get_code(ev->col, ev->row);
+    if (!is_tap_hold(keycode)) {
+        return false;
+    }
+
+    th_state.pending = true;
+    th_state.press = *ev;
+    th_state.keycode = keycode;
+    th_state.buf_len = 0;
+
+    return true;
+}
+
+void
+tap_hold_task(uint32_t now)
+{
+    if (th_state.pending && ((now - th_state.press.time) >= tap_hold_cfg.tapping_term)) {
+        th_resolve(true, NULL);
+    }
+}
+
+void
+tap_hold_print_state(void)
+{
+    printf("tap-hold term %d pending %d buffered %d\n",
+        tap_hold_cfg.tapping_term, th_state.pending, th_state.buf_len);
+}
+
+void
+tap_hold_init(void)
+{
+    memset(&th_state, 0, sizeof(th_state));
+}
@@ -0,0 +1,56 @@
+/*
+ * tap_hold.h
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "keyboard.h"
+
+/* Default tuning, can be changed at runtime through tap_hold_cfg */
+#ifndef TAPPING_TERM
+#define TAPPING_TERM 200
+#endif
+
+#ifndef TAP_HOLD_BUFFER
+#define TAP_HOLD_BUFFER 8
+#endif
+
+struct tap_hold_cfg {
+    /* Time in ms after which an undecided key becomes a hold */
+    uint16_t tapping_term;
+    /* Another key pressed and released inside the hold selects hold */
+    bool permissive_hold;
+    /* Any other key pressed inside the hold selects hold */
+    bool hold_on_other_key_press;
+    /* A lone hold past the tapping term still sends the tap on release */
+    bool retro_tapping;
+};
+
+extern struct tap_hold_cfg tap_hold_cfg;
+
+bool tap_hold_process(const struct key_event *ev);
+void tap_hold_task(uint32_t now);
+void tap_hold_print_state(void);
+void tap_hold_init(void);
@@ -0,0 +1,160 @@
+/*
+ * trace.c
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Trace records wait in a ring until the main loop has time for them.
+ * When it fills up, new records are dropped and counted, the ones
+ * already there are what explains how it got full.
+ *
+ * On the console, a single record is formatted per pass and only while
+ * the keyboard is idle, that's the cost TRACE() exists to keep out of
+ * the typing path. On the USB serial port the records go out raw, 24
+ * bytes each, little endian words in trace_entry order. Switched off,
+ * the records are thrown away as they come.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "keyboard.h"
+#include "steno.h"
+#include "trace.h"
+#include "usb_cdc.h"
+
+#include <no2usb/usb.h>
+
+#define TRACE_ENTRIES   64      /* power of 2 */
+
+struct trace_entry {
+    const char *fmt;
+    uint32_t tick;
+    uint32_t arg[4];
+};
+
+static struct {
+    struct trace_entry ring[TRACE_ENTRIES];
+    uint32_t head;
+    uint32_t tail;
+
+    enum trace_output out;
+
+    unsigned int logged;
+    unsigned int dropped;
+} trace_state;
+
+static const char * const trace_output_names[] = {
+    [TRACE_OUT_CONSOLE] = "console",
+    [TRACE_OUT_CDC]     = "usb serial",
+    [TRACE_OUT_OFF]     = "off",
+};
+
+void
+trace_put(const char *fmt, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+    struct trace_entry *e;
+
+    if ((trace_state.head - trace_state.tail) == TRACE_ENTRIES) {
+        trace_state.dropped++;
+        return;
+    }
+
+    e = &trace_state.ring[trace_state.head++ & (TRACE_ENTRIES - 1)];
+    e->fmt = fmt;
+    e->tick = usb_get_tick();
+    e->arg[0] = a;
+    e->arg[1] = b;
+    e->arg[2] = c;
+    e->arg[3] = d;
+}
+
+void
+trace_set_output(enum trace_output out)
+{
+    /* Records in the steno stream would desync the steno software */
+    if ((out == TRACE_OUT_CDC) && steno_active()) {
+        out = TRACE_OUT_OFF;
+    }
+
+    trace_state.out = out;
+}
+
+enum trace_output
+trace_get_output(void)
+{
+    return trace_state.out;
+}
+
+void
+trace_print_state(void)
+{
+    printf("trace to %s, %d queued, %d logged, %d dropped\n",
+        trace_output_names[trace_state.out],
+        (int)(trace_state.head - trace_state.tail),
+        trace_state.logged, trace_state.dropped);
+}
+
+void
+trace_poll(void)
+{
+    struct trace_entry *e;
+
+    while (trace_state.head != trace_state.tail) {
+        e = &trace_state.ring[trace_state.tail & (TRACE_ENTRIES - 1)];
+
+        switch (trace_state.out) {
+        case TRACE_OUT_CONSOLE:
+            if (keyboard_active()) {
+                return;
+            }
+            printf("%d ", (int)e->tick);
+            printf(e->fmt, e->arg[0], e->arg[1], e->arg[2], e->arg[3]);
+            trace_state.tail++;
+            trace_state.logged++;
+            return;
+
+        case TRACE_OUT_CDC:
+            if (steno_active()) {
+                trace_state.out = TRACE_OUT_OFF;
+                break;
+            }
+            if (!usb_cdc_write(e, sizeof(*e))) {
+                return;
+            }
+            trace_state.logged++;
+            break;
+
+        case TRACE_OUT_OFF:
+            break;
+        }
+
+        trace_state.tail++;
+    }
+}
+
+void
+trace_init(void)
+{
+    memset(&trace_state, 0, sizeof(trace_state));
+    trace_state.out = TRACE_OUT_OFF;
+}
@@ -0,0 +1,60 @@
+/*
+ * trace.h
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Binary trace log, cheap enough for the hot paths. TRACE() only stores
+ * the address of its format string, the ms tick and up to 4 argument
+ * words. trace_poll() formats the records later, on the device while
+ * the keyboard is idle, or sends them raw on the USB serial port for
+ * trace_decode.py, which reads the format strings from the ELF. Not once
+ * steno uses that port, the trace is turned off then.
+ *
+ * Every argument is stored as a 32 bit word. %s only decodes on the
+ * host for constant strings.
+ */
+
+#ifdef TRACE_ENABLE
+#define TRACE(...)  _TRACE(__VA_ARGS__, 0, 0, 0, 0, 0)
+#define _TRACE(fmt, a, b, c, d, ...) do { \
+        static const char _trace_fmt[] __attribute__((section(".rodata.trace"))) = fmt; \
+        trace_put(_trace_fmt, (uint32_t)(a), (uint32_t)(b), (uint32_t)(c), (uint32_t)(d)); \
+    } while (0)
+#else
+#define TRACE(...)  do { } while (0)
+#endif
+
+enum trace_output {
+    TRACE_OUT_CONSOLE,
+    TRACE_OUT_CDC,
+    TRACE_OUT_OFF,
+};
+
+void trace_put(const char *fmt, uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+void trace_set_output(enum trace_output out);
+enum trace_output trace_get_output(void);
+void trace_print_state(void);
+void trace_poll(void);
+void trace_init(void);
@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+#
+# Decodes the raw trace records the firmware sends on the USB serial port
+# once the trace output is switched there ('T' on the console). A record
+# is 6 little endian words: format string address, ms tick, 4 arguments.
+# The format strings are read from the ELF, they sit between the
+# _trace_fmt_start and _trace_fmt_end symbols.
+#
+# Usage: trace_decode.py fw_app.elf /dev/ttyACM0
+#
+
+import re
+import struct
+import sys
+
+
+class Elf32:
+
+	def __init__(self, name):
+		with open(name, 'rb') as fh:
+			self.data = fh.read()
+
+		if self.data[:4] != b'\x7fELF' or self.data[4] != 1:
+			raise ValueError(name + ' is not a 32 bit ELF')
+
+		phoff, shoff = struct.unpack_from('<II', self.data, 0x1c)
+		phentsize, phnum, shentsize, shnum = struct.unpack_from('<HHHH', self.data, 0x2a)
+
+		# Loaded segments, to read memory by address
+		self.segs = []
+		for i in range(phnum):
+			p_type, p_offset, p_vaddr, _, p_filesz = struct.unpack_from('<IIIII', self.data, phoff + i * phentsize)
+			if p_type == 1:
+				self.segs.append((p_vaddr, p_filesz, p_offset))
+
+		# Symbols
+		sects = [struct.unpack_from('<IIIIIII', self.data, shoff + i * shentsize) for i in range(shnum)]
+		self.syms = {}
+		for _, sh_type, _, _, sh_offset, sh_size, sh_link in sects:
+			if sh_type != 2:
+				continue
+			str_ofs = sects[sh_link][4]
+			for ofs in range(sh_offset, sh_offset + sh_size, 16):
+				st_name, st_value = struct.unpack_from('<II', self.data, ofs)
+				self.syms[self.cstr_at(str_ofs + st_name)] = st_value
+
+	def cstr_at(self, ofs):
+		return self.data[ofs:self.data.index(b'\0', ofs)].decode('latin-1')
+
+	def string(self, addr):
+		for vaddr, size, ofs in self.segs:
+			if vaddr <= addr < vaddr + size:
+				return self.cstr_at(ofs + addr - vaddr)
+		return None
+
+
+FMT_RE = re.compile(r'%(0?[0-9]*)([duxXcs%])')
+
+def format_record(elf, fmt, args):
+	args = iter(args)
+
+	def conv(m):
+		flags, conv = m.groups()
+		if conv == '%':
+			return '%'
+		v = next(args, 0)
+		if conv == 'd':
+			v -= (v & 0x80000000) << 1
+		elif conv == 's':
+			s = elf.string(v)
+			return s if s is not None else '<%08x>' % v
+		elif conv == 'c':
+			v &= 0xff
+		return ('%' + flags + conv) % v
+
+	return FMT_RE.sub(conv, fmt)
+
+
+def main(argv0, elf_name, dev_name):
+	elf = Elf32(elf_name)
+	fmt_start = elf.syms['_trace_fmt_start']
+	fmt_end = elf.syms['_trace_fmt_end']
+
+	buf = b''
+	with open(dev_name, 'rb', buffering=0) as fh:
+		while True:
+			d = fh.read(4096)
+			if not d:
+				break
+			buf += d
+
+			while len(buf) >= 24:
+				fmt, tick, *args = struct.unpack_from('<6I', buf)
+
+				# Not a record start, drop a byte to get back in step
+				if not (fmt_start <= fmt < fmt_end):
+					buf = buf[1:]
+					continue
+
+				sys.stdout.write('%d ' % tick + format_record(elf, elf.string(fmt), args))
+				sys.stdout.flush()
+				buf = buf[24:]
+
+if __name__ == '__main__':
+	main(*sys.argv)
@@ -0,0 +1,275 @@
+/*
+ * unicode.c
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Unicode input.
+ *
+ * A code point turns into the key sequence of the host input method,
+ * queued as a list of frames. Each frame is the full content of one
+ * report: the modifiers and at most one key. usb_hid_poll() calls
+ * unicode_step() each time the IN buffer is free, which puts out the
+ * next frame.
+ *
+ * To take as few reports as possible, a key is released in the very
+ * frame pressing the next one. Only a repeated key needs a frame with
+ * nothing pressed in between. Hosts apply the modifier byte before the
+ * key array, so modifiers change along with the keys as well.
+ *
+ * A six digit code point in Linux mode so takes 9 reports:
+ * Ctrl+Shift+U, the 6 digits, Space and the final release.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dynamic_macro.h"
+#include "macro.h"
+#include "unicode.h"
+#include "usb_hid.h"
+
+#include "keycode.h"
+#include "quantum_keycodes.h"
+
+#define FRAME(mods, key) (((mods) << 8) | (key))
+#define FRAME_MODS(f)    ((f) >> 8)
+#define FRAME_KEY(f)     ((f) & 0xFF)
+
+struct unicode_cfg unicode_cfg = {
+    .mode = UNICODE_LINUX,
+};
+
+static struct {
+    uint16_t queue[UNICODE_QUEUE];
+    unsigned int head;
+    unsigned int len;
+
+    /* Last frame queued, and last one sent */
+    uint16_t last;
+    uint8_t key;
+
+    bool active;
+    unsigned int dropped;
+} uc_state;
+
+static void
+uc_push(uint8_t mods, uint8_t key)
+{
+    /* The same key can't be pressed again without being released */
+    if (key && (FRAME_KEY(uc_state.last) == key)) {
+        uc_push(mods, KC_NO);
+    }
+
+    uc_state.last = FRAME(mods, key);
+    uc_state.queue[(uc_state.head + uc_state.len++) % UNICODE_QUEUE] = uc_state.last;
+}
+
+static void
+uc_push_hex(uint8_t mods, uint32_t v, int digits)
+{
+    while (digits--) {
+        uint8_t d = (v >> (digits * 4)) & 0xF;
+        uc_push(mods, d == 0 ? KC_0 : d < 10 ? KC_1 + d - 1 : KC_A + d - 10);
+    }
+}
+
+static int
+uc_digits(uint32_t cp)
+{
+    int n = 1;
+
+    while (cp >> (n * 4)) {
+        n++;
+    }
+    return n;
+}
+
+void
+unicode_input(uint32_t cp)
+{
+    const uint8_t ctrl_shift = MOD_BIT(KC_LCTRL) | MOD_BIT(KC_LSHIFT);
+    const uint8_t alt = MOD_BIT(KC_LALT);
+
+    if (cp > 0x10FFFF) {
+        return;
+    }
+
+    /* Worst case is a surrogate pair on the Mac, each of the 8 digits
+     * released again, plus the final release */
+    if (UNICODE_QUEUE - uc_state.len < 17) {
+        uc_state.dropped++;
+        return;
+    }
+
+    uc_state.last = FRAME(0, KC_NO);
+
+    switch (unicode_cfg.mode) {
+        case UNICODE_LINUX:
+            uc_push(ctrl_shift, KC_U);
+            uc_push_hex(0, cp, uc_digits(cp));
+            uc_push(0, KC_SPC);
+            break;
+
+        case UNICODE_MAC:
+            if (cp > 0xFFFF) {
+                cp -= 0x10000;
+                uc_push_hex(alt, 0xD800 | (cp >> 10), 4);
+                uc_push_hex(alt, 0xDC00 | (cp & 0x3FF), 4);
+            } else {
+                uc_push_hex(alt, cp, 4);
+            }
+            break;
+
+        case UNICODE_WINCOMPOSE:
+            uc_push(MOD_BIT(KC_RALT), KC_NO);
+            uc_push(0, KC_U);
+            uc_push_hex(0, cp, uc_digits(cp));
+            uc_push(0, KC_ENT);
+            break;
+
+        case UNICODE_WIN:
+            if (cp > 0xFFFF) {
+                /* HexNumpad only goes up to the BMP */
+                uc_state.dropped++;
+                return;
+            }
+            uc_push(alt, KC_KP_PLUS);
+            uc_push_hex(alt, cp, uc_digits(cp));
+            break;
+
+        default:
+            return;
+    }
+
+    uc_push(0, KC_NO);
+}
+
+#ifdef UNICODEMAP_ENABLE
+static uint32_t
+uc_map(unsigned int i)
+{
+    if (i >= keymap_unicode_count) {
+        return 0x110000;
+    }
+    const uint8_t *e = keymap_unicode_map[i];
+    return e[0] | (e[1] << 8) | ((uint32_t)e[2] << 16);
+}
+#endif
+
+void
+unicode_process(uint16_t keycode, bool down)
+{
+    if (!down) {
+        return;
+    }
+
+    switch (keycode) {
+        case UNICODE_MODE_FORWARD:
+            unicode_cfg.mode = (unicode_cfg.mode + 1) % UNICODE_MODE_COUNT;
+            return;
+        case UNICODE_MODE_REVERSE:
+            unicode_cfg.mode = (unicode_cfg.mode + UNICODE_MODE_COUNT - 1) % UNICODE_MODE_COUNT;
+            return;
+        case UNICODE_MODE_MAC:
+            unicode_cfg.mode = UNICODE_MAC;
+            return;
+        case UNICODE_MODE_LNX:
+            unicode_cfg.mode = UNICODE_LINUX;
+            return;
+        case UNICODE_MODE_WIN:
+            unicode_cfg.mode = UNICODE_WIN;
+            return;
+        case UNICODE_MODE_WINC:
+            unicode_cfg.mode = UNICODE_WINCOMPOSE;
+            return;
+    }
+
+#ifdef UNICODEMAP_ENABLE
+    if ((keycode >= QK_UNICODEMAP_PAIR) && (keycode <= QK_UNICODEMAP_PAIR_MAX)) {
+        /* Second code point when shifted */
+        bool shift = (usb_hid_get_mods() & MOD_MASK_SHIFT) != 0;
+        unicode_input(uc_map(shift ? (keycode >> 7) & 0x7F : keycode & 0x7F));
+    } else if ((keycode >= QK_UNICODEMAP) && (keycode <= QK_UNICODEMAP_MAX)) {
+        unicode_input(uc_map(keycode & 0x3FFF));
+    }
+#else
+    if ((keycode >= QK_UNICODE) && (keycode <= QK_UNICODE_MAX)) {
+        unicode_input(keycode & 0x7FFF);
+    }
+#endif
+}
+
+/* Put out the next frame, returns true if a report has to be sent */
+bool
+unicode_step(uint32_t now)
+{
+    (void)now;
+
+    /* The macro players own the macro keys while they run */
+    if (!uc_state.len || macro_playing() || dynamic_macro_playing()) {
+        return false;
+    }
+
+    uint16_t f = uc_state.queue[uc_state.head];
+    uc_state.head = (uc_state.head + 1) % UNICODE_QUEUE;
+    uc_state.len--;
+
+    /* Modifiers held on the keyboard would garble the sequence */
+    if (!uc_state.active) {
+        uc_state.active = true;
+        usb_hid_suppress_mods(0xFF);
+    }
+
+    if (uc_state.key != FRAME_KEY(f)) {
+        if (uc_state.key) {
+            usb_hid_macro_release(uc_state.key);
+        }
+        uc_state.key = FRAME_KEY(f);
+        if (uc_state.key) {
+            usb_hid_macro_press(uc_state.key);
+        }
+    }
+    usb_hid_macro_mods(FRAME_MODS(f));
+
+    if (!uc_state.len) {
+        uc_state.active = false;
+        usb_hid_suppress_mods(0);
+    }
+
+    return true;
+}
+
+void
+unicode_print_state(void)
+{
+    static const char * const names[] = { "linux", "mac", "wincompose", "win" };
+
+    printf("unicode mode %s queued %d dropped %d map %d\n",
+        names[unicode_cfg.mode], uc_state.len, uc_state.dropped, keymap_unicode_count);
+}
+
+void
+unicode_init(void)
+{
+    memset(&uc_state, 0, sizeof(uc_state));
+}
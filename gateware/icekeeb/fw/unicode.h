@@ -0,0 +1,57 @@
+/*
+ * unicode.h
+ *
+ * Copyright (C) 2021 Piotr Esden-Tempski
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Frames (reports) queued for typing code points */
+#define UNICODE_QUEUE 64
+
+/* How the host is told about a code point */
+enum unicode_mode {
+    UNICODE_LINUX,      /* IBus: Ctrl+Shift+U, hex digits, Space */
+    UNICODE_MAC,        /* Unicode Hex Input: hex digits with Option held */
+    UNICODE_WINCOMPOSE, /* WinCompose: Right Alt, u, hex digits, Enter */
+    UNICODE_WIN,        /* Windows HexNumpad: Alt held, keypad +, hex digits */
+    UNICODE_MODE_COUNT
+};
+
+struct unicode_cfg {
+    enum unicode_mode mode;
+};
+
+extern struct unicode_cfg unicode_cfg;
+
+/* Code points of the X(i) and XP(i, j) keycodes, 3 bytes each */
+#define UCP(cp) { (cp) & 0xFF, ((cp) >> 8) & 0xFF, ((cp) >> 16) & 0xFF }
+
+extern const uint8_t keymap_unicode_map[][3];
+extern const unsigned int keymap_unicode_count;
+
+void unicode_input(uint32_t cp);
+void unicode_process(uint16_t keycode, bool down);
+bool unicode_step(uint32_t now);
+void unicode_print_state(void);
+void unicode_init(void);
@@ -0,0 +1,449 @@
+/*
+ * usb_cdc.c
+ *
+ * Copyright (C) 2021 Sylvain Munaut
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* CDC ACM function. The host gets a serial port, backed by a ring
+ * buffer each way that usb_cdc_poll() moves to and from the bulk
+ * endpoints. It carries the steno stream, the console when it is
+ * pointed here and the binary trace.
+ *
+ * They all share the one byte stream, nothing tells them apart on the
+ * host. Steno wins: from the first steno key on, the console goes back to
+ * the UART and the trace stops using the port. What they had queued
+ * before still goes out ahead of the first stroke.
+ *
+ * Both endpoints use their two buffer descriptors, so a packet can go or
+ * come while the main loop is busy with the previous one. When the RX
+ * ring is full the OUT buffers are left full and the host gets NAKed
+ * until the firmware catches up.
+ *
+ * The line coding is only stored and given back, it has no meaning for
+ * a USB only port.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <no2usb/usb.h>
+#include <no2usb/usb_hw.h>
+#include <no2usb/usb_priv.h>
+#include <no2usb/usb_cdc_proto.h>
+
+#include "console.h"
+#include "keyboard.h"
+#include "steno.h"
+#include "usb_cdc.h"
+
+#define CDC_PKT_SIZE	64
+#define CDC_TX_SIZE	2048	/* bytes, power of 2 */
+#define CDC_RX_SIZE	256	/* bytes, power of 2 */
+
+/* Control line state bits */
+#define CDC_LINE_DTR	(1 << 0)
+
+static struct {
+	/* Attached interfaces / eps */
+	uint8_t intf_ctl;
+	uint8_t intf_data;
+	uint8_t ep_ctl;
+	uint8_t ep_out;
+	uint8_t ep_in;
+
+	/* Line state set by the host */
+	struct {
+		uint32_t dwDTERate;
+		uint8_t  bCharFormat;
+		uint8_t  bParityType;
+		uint8_t  bDataBits;
+	} __attribute__ ((packed)) line_coding;
+	uint16_t ctrl_line_state;
+
+	/* Next buffer descriptor of each ping-pong pair */
+	uint8_t bdi_in;
+	uint8_t bdi_out;
+
+	/* The last packet was full and emptied the ring, a zero length one
+	 * has to follow to end the transfer */
+	bool zlp;
+
+	/* Tick of the last packet sent */
+	uint32_t tx_tick;
+
+	/* Rings, the indexes are free running */
+	uint32_t tx_head;
+	uint32_t tx_tail;
+	uint32_t rx_head;
+	uint32_t rx_tail;
+	uint8_t tx_buf[CDC_TX_SIZE];
+	uint8_t rx_buf[CDC_RX_SIZE];
+
+	/* Stats */
+	uint32_t tx_pkts;
+	uint32_t tx_full;
+	uint32_t tx_drop;
+	uint32_t rx_pkts;
+	uint32_t rx_stall;
+} g_cdc;
+
+
+static void
+_cdc_ring_put(uint8_t *ring, uint32_t size, uint32_t pos, const void *data, int len)
+{
+	int n = size - (pos & (size - 1));
+
+	if (n > len)
+		n = len;
+
+	memcpy(&ring[pos & (size - 1)], data, n);
+	memcpy(ring, data + n, len - n);
+}
+
+static void
+_cdc_ring_get(const uint8_t *ring, uint32_t size, uint32_t pos, void *data, int len)
+{
+	int n = size - (pos & (size - 1));
+
+	if (n > len)
+		n = len;
+
+	memcpy(data, &ring[pos & (size - 1)], n);
+	memcpy(data + n, ring, len - n);
+}
+
+static int
+_cdc_tx_room(void)
+{
+	return CDC_TX_SIZE - (g_cdc.tx_head - g_cdc.tx_tail);
+}
+
+/* Queues all of data or nothing, so a steno packet is never split */
+bool
+usb_cdc_write(const void *data, int len)
+{
+	if (g_cdc.ep_in == 0xff)
+		return false;
+
+	if (len <= 0)
+		return false;
+
+	if (len > _cdc_tx_room()) {
+		g_cdc.tx_full++;
+		return false;
+	}
+
+	_cdc_ring_put(g_cdc.tx_buf, CDC_TX_SIZE, g_cdc.tx_head, data, len);
+	g_cdc.tx_head += len;
+
+	return true;
+}
+
+int
+usb_cdc_getchar(void)
+{
+	if (g_cdc.rx_head == g_cdc.rx_tail)
+		return -1;
+
+	return g_cdc.rx_buf[g_cdc.rx_tail++ & (CDC_RX_SIZE - 1)];
+}
+
+/* Console output is dropped rather than waited for, and not queued at
+ * all while no terminal has the port open */
+static void
+_cdc_console_write(const char *p, int len)
+{
+	int room;
+
+	/* The port is the steno one now, the console moves to the UART,
+	 * starting with this text */
+	if (steno_active()) {
+		console_set_port(NULL);
+		while (len--)
+			putchar(*p++);
+		return;
+	}
+
+	if ((g_cdc.ep_in == 0xff) || !(g_cdc.ctrl_line_state & CDC_LINE_DTR))
+		return;
+
+	room = _cdc_tx_room();
+	if (len > room) {
+		g_cdc.tx_drop += len - room;
+		len = room;
+	}
+
+	_cdc_ring_put(g_cdc.tx_buf, CDC_TX_SIZE, g_cdc.tx_head, p, len);
+	g_cdc.tx_head += len;
+}
+
+const struct console_port usb_cdc_console = {
+	.write	= _cdc_console_write,
+	.getc	= usb_cdc_getchar,
+};
+
+void
+usb_cdc_debug_print(void)
+{
+	printf("CDC intf %d/%d ep %02x/%02x/%02x\n",
+		g_cdc.intf_ctl, g_cdc.intf_data,
+		g_cdc.ep_ctl, g_cdc.ep_out, g_cdc.ep_in);
+	printf("Line %d baud, state %04x\n",
+		(int)g_cdc.line_coding.dwDTERate, g_cdc.ctrl_line_state);
+	printf("TX %d packets, %d queued, %d full, %d bytes dropped\n",
+		(int)g_cdc.tx_pkts, (int)(g_cdc.tx_head - g_cdc.tx_tail),
+		(int)g_cdc.tx_full, (int)g_cdc.tx_drop);
+	printf("RX %d packets, %d queued, %d stalled\n",
+		(int)g_cdc.rx_pkts, (int)(g_cdc.rx_head - g_cdc.rx_tail),
+		(int)g_cdc.rx_stall);
+}
+
+
+static bool
+_cdc_set_line_coding_done(struct usb_xfer *xfer)
+{
+	memcpy(&g_cdc.line_coding, xfer->data, sizeof(g_cdc.line_coding));
+	return true;
+}
+
+static enum usb_fnd_resp
+_cdc_ctrl_req(struct usb_ctrl_req *req, struct usb_xfer *xfer)
+{
+	/* Handle all request for the control interface */
+	if (USB_REQ_RCPT(req) != USB_REQ_RCPT_INTF)
+		return USB_FND_CONTINUE;
+
+	if (req->wIndex != g_cdc.intf_ctl)
+		return USB_FND_CONTINUE;
+
+	/* Handle request */
+	switch (req->wRequestAndType)
+	{
+	case USB_RT_CDC_SET_LINE_CODING:
+		if (req->wLength != sizeof(g_cdc.line_coding))
+			return USB_FND_ERROR;
+		xfer->cb_done = _cdc_set_line_coding_done;
+		break;
+
+	case USB_RT_CDC_GET_LINE_CODING:
+		xfer->data = (void*)&g_cdc.line_coding;
+		xfer->len  = sizeof(g_cdc.line_coding);
+		break;
+
+	case USB_RT_CDC_SET_CTRL_LINE_STATE:
+		g_cdc.ctrl_line_state = req->wValue;
+		break;
+
+	default:
+		return USB_FND_ERROR;
+	}
+
+	return USB_FND_SUCCESS;
+}
+
+static enum usb_fnd_resp
+_cdc_set_conf(const struct usb_conf_desc *conf)
+{
+	const struct usb_intf_desc *intf;
+	const struct usb_ep_desc *ep;
+	const void *sod, *eod;
+
+	/* Forget the previous configuration, that's all for deconfig */
+	g_cdc.intf_ctl  = 0xff;
+	g_cdc.intf_data = 0xff;
+	g_cdc.ep_ctl    = 0xff;
+	g_cdc.ep_out    = 0xff;
+	g_cdc.ep_in     = 0xff;
+	g_cdc.bdi_in    = 0;
+	g_cdc.bdi_out   = 0;
+	g_cdc.zlp       = false;
+	g_cdc.tx_tail   = g_cdc.tx_head;
+	g_cdc.rx_tail   = g_cdc.rx_head;
+
+	if (conf == NULL)
+		return USB_FND_SUCCESS;
+
+	/* Find the CDC interfaces */
+	sod = conf;
+	eod = sod + conf->wTotalLength;
+
+	while (1) {
+		sod = usb_desc_find(usb_desc_next(sod), eod, USB_DT_INTF);
+		if (!sod)
+			break;
+
+		intf = (void*)sod;
+		if (intf->bAlternateSetting != 0)
+			continue;
+
+		if ((intf->bInterfaceClass == USB_CLS_CDC_CONTROL) && (g_cdc.intf_ctl == 0xff)) {
+			/* Notification EP */
+			ep = (void*)usb_desc_find(sod, eod, USB_DT_EP);
+			if (!ep || (ep->bEndpointAddress < 0x80))
+				continue;
+
+			g_cdc.intf_ctl = intf->bInterfaceNumber;
+			g_cdc.ep_ctl   = ep->bEndpointAddress;
+			usb_ep_boot(intf, g_cdc.ep_ctl, false);
+		}
+
+		if ((intf->bInterfaceClass == USB_CLS_CDC_DATA) && (g_cdc.intf_data == 0xff)) {
+			/* Bulk EPs, one each way */
+			g_cdc.intf_data = intf->bInterfaceNumber;
+
+			ep = (void*)sod;
+			for (int i = 0; i < intf->bNumEndpoints; i++) {
+				ep = (void*)usb_desc_find(usb_desc_next(ep), eod, USB_DT_EP);
+				if (!ep)
+					break;
+
+				if (ep->bEndpointAddress & 0x80)
+					g_cdc.ep_in  = ep->bEndpointAddress;
+				else
+					g_cdc.ep_out = ep->bEndpointAddress;
+
+				usb_ep_boot(intf, ep->bEndpointAddress, true);
+			}
+
+			/* Ready to receive in both buffers */
+			if (g_cdc.ep_out != 0xff) {
+				for (int i = 0; i < 2; i++)
+					usb_ep_regs[g_cdc.ep_out & 0x1f].out.bd[i].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(CDC_PKT_SIZE + 2);
+			}
+		}
+	}
+
+	return (g_cdc.intf_ctl != 0xff) && (g_cdc.ep_in != 0xff) ? USB_FND_SUCCESS : USB_FND_ERROR;
+}
+
+static void
+_cdc_rx_poll(void)
+{
+	volatile struct usb_ep *ep = &usb_ep_regs[g_cdc.ep_out & 0x1f].out;
+	uint32_t pkt[CDC_PKT_SIZE / 4];
+	uint32_t csr;
+	int len;
+
+	while (1) {
+		csr = ep->bd[g_cdc.bdi_out].csr;
+		if ((csr & USB_BD_STATE_MSK) == USB_BD_STATE_RDY_DATA)
+			break;
+
+		/* Length includes the CRC */
+		len = (csr & USB_BD_LEN_MSK) - 2;
+		if (((csr & USB_BD_STATE_MSK) != USB_BD_STATE_DONE_OK) || (len < 0))
+			len = 0;
+		if (len > CDC_PKT_SIZE)
+			len = CDC_PKT_SIZE;
+
+		/* No room yet, keep it in the buffer and let the host wait */
+		if (len > CDC_RX_SIZE - (int)(g_cdc.rx_head - g_cdc.rx_tail)) {
+			g_cdc.rx_stall++;
+			break;
+		}
+
+		if (len) {
+			usb_data_read(pkt, ep->bd[g_cdc.bdi_out].ptr, len);
+			_cdc_ring_put(g_cdc.rx_buf, CDC_RX_SIZE, g_cdc.rx_head, pkt, len);
+			g_cdc.rx_head += len;
+			g_cdc.rx_pkts++;
+		}
+
+		ep->bd[g_cdc.bdi_out].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(CDC_PKT_SIZE + 2);
+		g_cdc.bdi_out ^= 1;
+	}
+}
+
+static void
+_cdc_tx_poll(void)
+{
+	volatile struct usb_ep *ep = &usb_ep_regs[g_cdc.ep_in & 0x1f].in;
+	uint32_t pkt[CDC_PKT_SIZE / 4];
+	uint32_t now = usb_get_tick();
+	bool active = keyboard_active();
+	int len;
+
+	while ((g_cdc.tx_head != g_cdc.tx_tail) || g_cdc.zlp) {
+		/* While typing, a packet per ms is all it gets so the main
+		 * loop stays short. Idle, both buffers are kept full, some
+		 * 550 to 650 KB/s going by 'usb_model.py cdc', a model
+		 * rather than a measurement. */
+		if (active && (g_cdc.tx_tick == now))
+			break;
+
+		if ((ep->bd[g_cdc.bdi_in].csr & USB_BD_STATE_MSK) == USB_BD_STATE_RDY_DATA)
+			break;
+
+		len = g_cdc.tx_head - g_cdc.tx_tail;
+		if (len > CDC_PKT_SIZE)
+			len = CDC_PKT_SIZE;
+
+		if (len) {
+			_cdc_ring_get(g_cdc.tx_buf, CDC_TX_SIZE, g_cdc.tx_tail, pkt, len);
+			usb_data_write(ep->bd[g_cdc.bdi_in].ptr, pkt, len);
+		}
+		ep->bd[g_cdc.bdi_in].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(len);
+		g_cdc.bdi_in ^= 1;
+
+		g_cdc.tx_tail += len;
+		g_cdc.zlp = (len == CDC_PKT_SIZE) && (g_cdc.tx_head == g_cdc.tx_tail);
+		g_cdc.tx_tick = now;
+		g_cdc.tx_pkts++;
+	}
+}
+
+static struct usb_fn_drv _cdc_drv = {
+	.ctrl_req	= _cdc_ctrl_req,
+	.set_conf	= _cdc_set_conf,
+};
+
+
+void
+usb_cdc_init(void)
+{
+	memset(&g_cdc, 0, sizeof(g_cdc));
+
+	g_cdc.intf_ctl  = 0xff;
+	g_cdc.intf_data = 0xff;
+	g_cdc.ep_ctl    = 0xff;
+	g_cdc.ep_out    = 0xff;
+	g_cdc.ep_in     = 0xff;
+
+	/* 115200 8N1 until the host says otherwise */
+	g_cdc.line_coding.dwDTERate   = 115200;
+	g_cdc.line_coding.bCharFormat = 0;
+	g_cdc.line_coding.bParityType = 0;
+	g_cdc.line_coding.bDataBits   = 8;
+
+	usb_register_function_driver(&_cdc_drv);
+}
+
+void
+usb_cdc_poll(void)
+{
+	if (g_cdc.ep_in == 0xff)
+		return;
+
+	if (g_cdc.ep_out != 0xff)
+		_cdc_rx_poll();
+
+	_cdc_tx_poll();
+}
@@ -0,0 +1,36 @@
+/*
+ * usb_cdc.h
+ *
+ * Copyright (C) 2021 Sylvain Munaut
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+struct console_port;
+
+extern const struct console_port usb_cdc_console;
+
+bool usb_cdc_write(const void *data, int len);
+int  usb_cdc_getchar(void);
+void usb_cdc_debug_print(void);
+void usb_cdc_init(void);
+void usb_cdc_poll(void);
@@ -27,6 +27,10 @@
 #include <no2usb/usb_hid_proto.h>
 #include <no2usb/usb.h>
 
+#include "usb_extra.h"
+#include "usb_hid.h"
+#include "usb_raw.h"
+
 
 usb_cdc_union_desc_def(1);
 
@@ -65,6 +69,101 @@ const uint8_t app_hid_report_desc[63] = {
 	0xc0,		/* End Collection */
 };
 
+const uint8_t app_hid_nkro_report_desc[31] = {
+	0x05, 0x01,	/* Usage Page (Generic Desktop) */
+	0x09, 0x06,	/* Usage (Keyboard) */
+	0xa1, 0x01,	/* Collection (Application) */
+	0x05, 0x07,		/* Usage Page (KeyCodes) */
+	0x19, 0xe0,		/* Usage Minimum (224) */
+	0x29, 0xe7,		/* Usage Maximum (231) */
+	0x15, 0x00,		/* Logical Minimum (0) */
+	0x25, 0x01,		/* Logical Maximum (1) */
+	0x75, 0x01,		/* Report Size (1) */
+	0x95, 0x08,		/* Report Count (8) */
+	0x81, 0x02,		/* Input (Data, Variable, Absolute)	Modifier byte */
+	0x19, 0x00,		/* Usage Minimum (0) */
+	0x29, 0xdf,		/* Usage Maximum (223) */
+	0x95, 0xe0,		/* Report Count (224) */
+	0x81, 0x02,		/* Input (Data, Variable, Absolute)	Key bitmap (28 bytes) */
+	0xc0,		/* End Collection */
+};
+
+const uint8_t app_hid_mouse_report_desc[55] = {
+	0x05, 0x01,	/* Usage Page (Generic Desktop) */
+	0x09, 0x02,	/* Usage (Mouse) */
+	0xa1, 0x01,	/* Collection (Application) */
+	0x09, 0x01,		/* Usage (Pointer) */
+	0xa1, 0x00,		/* Collection (Physical) */
+	0x05, 0x09,			/* Usage Page (Buttons) */
+	0x19, 0x01,			/* Usage Minimum (1) */
+	0x29, 0x08,			/* Usage Maximum (8) */
+	0x15, 0x00,			/* Logical Minimum (0) */
+	0x25, 0x01,			/* Logical Maximum (1) */
+	0x95, 0x08,			/* Report Count (8) */
+	0x75, 0x01,			/* Report Size (1) */
+	0x81, 0x02,			/* Input (Data, Variable, Absolute)	Buttons */
+	0x05, 0x01,			/* Usage Page (Generic Desktop) */
+	0x09, 0x30,			/* Usage (X) */
+	0x09, 0x31,			/* Usage (Y) */
+	0x09, 0x38,			/* Usage (Wheel) */
+	0x15, 0x81,			/* Logical Minimum (-127) */
+	0x25, 0x7f,			/* Logical Maximum (127) */
+	0x75, 0x08,			/* Report Size (8) */
+	0x95, 0x03,			/* Report Count (3) */
+	0x81, 0x06,			/* Input (Data, Variable, Relative)	X, Y, Wheel */
+	0x05, 0x0c,			/* Usage Page (Consumer) */
+	0x0a, 0x38, 0x02,		/* Usage (AC Pan) */
+	0x95, 0x01,			/* Report Count (1) */
+	0x81, 0x06,			/* Input (Data, Variable, Relative)	Horizontal wheel */
+	0xc0,			/* End Collection */
+	0xc0,		/* End Collection */
+};
+
+const uint8_t app_hid_extra_report_desc[50] = {
+	0x05, 0x01,	/* Usage Page (Generic Desktop) */
+	0x09, 0x80,	/* Usage (System Control) */
+	0xa1, 0x01,	/* Collection (Application) */
+	0x85, USB_EXTRA_ID_SYSTEM,	/* Report ID */
+	0x19, 0x01,		/* Usage Minimum (1) */
+	0x2a, 0xb7, 0x00,	/* Usage Maximum (0xb7) */
+	0x15, 0x01,		/* Logical Minimum (1) */
+	0x26, 0xb7, 0x00,	/* Logical Maximum (0xb7) */
+	0x95, 0x01,		/* Report Count (1) */
+	0x75, 0x10,		/* Report Size (16) */
+	0x81, 0x00,		/* Input (Data, Array)			System usage */
+	0xc0,		/* End Collection */
+	0x05, 0x0c,	/* Usage Page (Consumer) */
+	0x09, 0x01,	/* Usage (Consumer Control) */
+	0xa1, 0x01,	/* Collection (Application) */
+	0x85, USB_EXTRA_ID_CONSUMER,	/* Report ID */
+	0x19, 0x01,		/* Usage Minimum (1) */
+	0x2a, 0xa0, 0x02,	/* Usage Maximum (0x2a0) */
+	0x15, 0x01,		/* Logical Minimum (1) */
+	0x26, 0xa0, 0x02,	/* Logical Maximum (0x2a0) */
+	0x95, 0x01,		/* Report Count (1) */
+	0x75, 0x10,		/* Report Size (16) */
+	0x81, 0x00,		/* Input (Data, Array)			Consumer usage */
+	0xc0,		/* End Collection */
+};
+
+const uint8_t app_hid_raw_report_desc[32] = {
+	0x06, 0x60, 0xff,	/* Usage Page (Vendor 0xff60) */
+	0x09, 0x61,	/* Usage (0x61) */
+	0xa1, 0x01,	/* Collection (Application) */
+	0x09, 0x62,		/* Usage (0x62) */
+	0x15, 0x00,		/* Logical Minimum (0) */
+	0x26, 0xff, 0x00,	/* Logical Maximum (255) */
+	0x95, 0x40,		/* Report Count (64) */
+	0x75, 0x08,		/* Report Size (8) */
+	0x81, 0x02,		/* Input (Data, Variable, Absolute)	Answer */
+	0x09, 0x63,		/* Usage (0x63) */
+	0x91, 0x02,		/* Output (Data, Variable, Absolute)	Command */
+	0x09, 0x64,		/* Usage (0x64) */
+	0x96, 0x06, 0x03,	/* Report Count (774) */
+	0xb1, 0x02,		/* Feature (Data, Variable, Absolute)	Command / answer */
+	0xc0,		/* End Collection */
+};
+
 
 static const struct {
 	/* Configuration */
@@ -94,12 +193,41 @@ static const struct {
 		struct usb_intf_desc intf;
 		struct usb_dfu_func_desc func;
 	} __attribute__ ((packed)) dfu;
+
+	/* HID Mouse */
+	struct {
+		struct usb_intf_desc intf;
+		struct usb_hid_hid_desc hid;
+		struct usb_ep_desc ep_data_in;
+	} __attribute__ ((packed)) mouse;
+
+	/* HID Extra keys */
+	struct {
+		struct usb_intf_desc intf;
+		struct usb_hid_hid_desc hid;
+		struct usb_ep_desc ep_data_in;
+	} __attribute__ ((packed)) extra;
+
+	/* HID NKRO Keyboard */
+	struct {
+		struct usb_intf_desc intf;
+		struct usb_hid_hid_desc hid;
+		struct usb_ep_desc ep_data_in;
+	} __attribute__ ((packed)) nkro;
+
+	/* HID Raw, keymap configuration */
+	struct {
+		struct usb_intf_desc intf;
+		struct usb_hid_hid_desc hid;
+		struct usb_ep_desc ep_data_out;
+		struct usb_ep_desc ep_data_in;
+	} __attribute__ ((packed)) raw;
 } __attribute__ ((packed)) _app_conf_desc = {
 	.conf = {
 		.bLength                = sizeof(struct usb_conf_desc),
 		.bDescriptorType        = USB_DT_CONF,
 		.wTotalLength           = sizeof(_app_conf_desc),
-		.bNumInterfaces         = 4,
+		.bNumInterfaces         = 8,
 		.bConfigurationValue    = 1,
 		.iConfiguration         = 4,
 		.bmAttributes           = 0x80,
@@ -134,7 +262,7 @@ static const struct {
 			.bEndpointAddress	= 0x81,
 			.bmAttributes		= 0x03,
 			.wMaxPacketSize		= 8,
-			.bInterval		= 0x0a,
+			.bInterval		= 0x01,
 		},
 	},
 	.cdc = {
@@ -165,7 +293,7 @@ static const struct {
 			.bLength		= sizeof(struct usb_cdc_union_desc) + 1,
 			.bDescriptorType	= USB_CS_DT_INTF,
 			.bDescriptorsubtype	= USB_CDC_DST_UNION,
-			.bMasterInterface	= 0,
+			.bMasterInterface	= 1,
 			.bSlaveInterface	= { 2 },
 		},
 		.ep_ctl = {
@@ -225,6 +353,142 @@ static const struct {
 			.bcdDFUVersion		= 0x0101,
 		},
 	},
+	.mouse = {
+		.intf = {
+			.bLength		= sizeof(struct usb_intf_desc),
+			.bDescriptorType	= USB_DT_INTF,
+			.bInterfaceNumber	= 4,
+			.bAlternateSetting	= 0,
+			.bNumEndpoints		= 1,
+			.bInterfaceClass	= USB_CLS_HID,
+			.bInterfaceSubClass	= USB_HID_SCLS_BOOT,
+			.bInterfaceProtocol	= USB_HID_PROTO_MOUSE,
+			.iInterface		= 9,
+		},
+		.hid = {
+			.bLength		= sizeof(struct usb_hid_hid_desc),
+			.bDescriptorType	= USB_HID_DT_HID,
+			.bcdHID			= 0x0101,
+			.bCountryCode		= 0x00,
+			.bNumDescriptors	= 1,
+			.desc[0]		= {
+				.bDescriptorType	= USB_HID_DT_REPORT,
+				.wDescriptorLength	= sizeof(app_hid_mouse_report_desc),
+			},
+		},
+		.ep_data_in = {
+			.bLength		= sizeof(struct usb_ep_desc),
+			.bDescriptorType	= USB_DT_EP,
+			.bEndpointAddress	= 0x82,
+			.bmAttributes		= 0x03,
+			.wMaxPacketSize		= 8,
+			.bInterval		= 0x0a,
+		},
+	},
+	.extra = {
+		.intf = {
+			.bLength		= sizeof(struct usb_intf_desc),
+			.bDescriptorType	= USB_DT_INTF,
+			.bInterfaceNumber	= USB_INTF_EXTRA,
+			.bAlternateSetting	= 0,
+			.bNumEndpoints		= 1,
+			.bInterfaceClass	= USB_CLS_HID,
+			.bInterfaceSubClass	= USB_HID_SCLS_NONE,
+			.bInterfaceProtocol	= USB_HID_PROTO_NONE,
+			.iInterface		= 10,
+		},
+		.hid = {
+			.bLength		= sizeof(struct usb_hid_hid_desc),
+			.bDescriptorType	= USB_HID_DT_HID,
+			.bcdHID			= 0x0101,
+			.bCountryCode		= 0x00,
+			.bNumDescriptors	= 1,
+			.desc[0]		= {
+				.bDescriptorType	= USB_HID_DT_REPORT,
+				.wDescriptorLength	= sizeof(app_hid_extra_report_desc),
+			},
+		},
+		.ep_data_in = {
+			.bLength		= sizeof(struct usb_ep_desc),
+			.bDescriptorType	= USB_DT_EP,
+			.bEndpointAddress	= 0x83,
+			.bmAttributes		= 0x03,
+			.wMaxPacketSize		= 8,
+			.bInterval		= 0x01,
+		},
+	},
+	.nkro = {
+		.intf = {
+			.bLength		= sizeof(struct usb_intf_desc),
+			.bDescriptorType	= USB_DT_INTF,
+			.bInterfaceNumber	= USB_INTF_NKRO,
+			.bAlternateSetting	= 0,
+			.bNumEndpoints		= 1,
+			.bInterfaceClass	= USB_CLS_HID,
+			.bInterfaceSubClass	= USB_HID_SCLS_NONE,
+			.bInterfaceProtocol	= USB_HID_PROTO_NONE,
+			.iInterface		= 11,
+		},
+		.hid = {
+			.bLength		= sizeof(struct usb_hid_hid_desc),
+			.bDescriptorType	= USB_HID_DT_HID,
+			.bcdHID			= 0x0101,
+			.bCountryCode		= 0x00,
+			.bNumDescriptors	= 1,
+			.desc[0]		= {
+				.bDescriptorType	= USB_HID_DT_REPORT,
+				.wDescriptorLength	= sizeof(app_hid_nkro_report_desc),
+			},
+		},
+		.ep_data_in = {
+			.bLength		= sizeof(struct usb_ep_desc),
+			.bDescriptorType	= USB_DT_EP,
+			.bEndpointAddress	= 0x86,
+			.bmAttributes		= 0x03,
+			.wMaxPacketSize		= 32,
+			.bInterval		= 0x01,
+		},
+	},
+	.raw = {
+		.intf = {
+			.bLength		= sizeof(struct usb_intf_desc),
+			.bDescriptorType	= USB_DT_INTF,
+			.bInterfaceNumber	= USB_INTF_RAW,
+			.bAlternateSetting	= 0,
+			.bNumEndpoints		= 2,
+			.bInterfaceClass	= USB_CLS_HID,
+			.bInterfaceSubClass	= USB_HID_SCLS_NONE,
+			.bInterfaceProtocol	= USB_HID_PROTO_NONE,
+			.iInterface		= 12,
+		},
+		.hid = {
+			.bLength		= sizeof(struct usb_hid_hid_desc),
+			.bDescriptorType	= USB_HID_DT_HID,
+			.bcdHID			= 0x0101,
+			.bCountryCode		= 0x00,
+			.bNumDescriptors	= 1,
+			.desc[0]		= {
+				.bDescriptorType	= USB_HID_DT_REPORT,
+				.wDescriptorLength	= sizeof(app_hid_raw_report_desc),
+			},
+		},
+		.ep_data_out = {
+			.bLength		= sizeof(struct usb_ep_desc),
+			.bDescriptorType	= USB_DT_EP,
+			.bEndpointAddress	= 0x07,
+			.bmAttributes		= 0x03,
+			.wMaxPacketSize		= 64,
+			.bInterval		= 0x01,
+		},
+		.ep_data_in = {
+			.bLength		= sizeof(struct usb_ep_desc),
+			.bDescriptorType	= USB_DT_EP,
+			.bEndpointAddress	= 0x87,
+			.bmAttributes		= 0x03,
+			.wMaxPacketSize		= 64,
+			.bInterval		= 0x01,
+		},
+	},
 };
 
 static const struct usb_conf_desc * const _conf_desc_array[] = {
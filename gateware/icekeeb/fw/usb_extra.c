@@ -0,0 +1,278 @@
+/*
+ * usb_extra.c
+ *
+ * Copyright (C) 2021 Sylvain Munaut
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* HID interface for the keys outside of the keyboard page: system control
+ * (power, sleep, wake) and consumer control (media keys), each with its
+ * own report ID.
+ *
+ * Every change is queued as a full report, so a tap shorter than the
+ * polling interval still sends its press and its release. The queue is
+ * separate from the keyboard report, and drained one report per frame
+ * like it.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <no2usb/usb.h>
+#include <no2usb/usb_hw.h>
+#include <no2usb/usb_priv.h>
+#include <no2usb/usb_hid_proto.h>
+
+#include "action_code.h"
+#include "usb_extra.h"
+
+extern const uint8_t app_hid_extra_report_desc[50];
+
+#define EXTRA_QUEUE	8	/* power of 2 */
+
+struct extra_report {
+	uint8_t id;
+	uint16_t usage;
+} __attribute__ ((packed));
+
+static struct {
+	/* Attached interface / ep */
+	uint8_t intf;
+	uint8_t ep;
+
+	/* Usage held on each page, as last queued */
+	uint16_t usage[2];
+
+	/* Reports waiting for the endpoint */
+	struct extra_report queue[EXTRA_QUEUE];
+	unsigned int head;
+	unsigned int len;
+	unsigned int overflow;
+} g_extra;
+
+static struct extra_report app_extra_report __attribute__ ((aligned(4)));
+
+
+static void
+_extra_queue(uint8_t id, uint16_t usage)
+{
+	struct extra_report *rep;
+
+	if (g_extra.len < EXTRA_QUEUE) {
+		rep = &g_extra.queue[(g_extra.head + g_extra.len++) & (EXTRA_QUEUE - 1)];
+	} else {
+		/* Full, the latest state is the one that must get out */
+		rep = &g_extra.queue[(g_extra.head + EXTRA_QUEUE - 1) & (EXTRA_QUEUE - 1)];
+		g_extra.overflow++;
+	}
+
+	rep->id = id;
+	rep->usage = usage;
+}
+
+void
+usb_extra_usage(uint16_t action, bool down)
+{
+	unsigned int page = (action >> 10) & 3;
+	uint16_t usage = action & 0x3ff;
+
+	if ((action >> 12) != ACT_USAGE)
+		return;
+
+	if (page > PAGE_CONSUMER)
+		return;
+
+	/* One usage per page, releasing another key than the last one
+	 * pressed leaves it alone */
+	if (down) {
+		if (g_extra.usage[page] == usage)
+			return;
+		g_extra.usage[page] = usage;
+	} else {
+		if (g_extra.usage[page] != usage)
+			return;
+		g_extra.usage[page] = 0;
+	}
+
+	_extra_queue(page == PAGE_SYSTEM ? USB_EXTRA_ID_SYSTEM : USB_EXTRA_ID_CONSUMER, g_extra.usage[page]);
+}
+
+void
+usb_extra_debug_print(void)
+{
+	printf("Extra: system %04x consumer %04x, %d queued, %d overflows\n",
+		g_extra.usage[PAGE_SYSTEM], g_extra.usage[PAGE_CONSUMER],
+		g_extra.len, g_extra.overflow);
+}
+
+
+static bool
+_extra_get_report(struct usb_ctrl_req *req, struct usb_xfer *xfer)
+{
+	uint8_t id = req->wValue & 0xff;
+
+	if ((id != USB_EXTRA_ID_SYSTEM) && (id != USB_EXTRA_ID_CONSUMER))
+		return false;
+
+	app_extra_report.id = id;
+	app_extra_report.usage = g_extra.usage[id == USB_EXTRA_ID_SYSTEM ? PAGE_SYSTEM : PAGE_CONSUMER];
+
+	xfer->data = (void*)&app_extra_report;
+	xfer->len  = sizeof(app_extra_report);
+	return true;
+}
+
+static bool
+_extra_get_descriptor(struct usb_ctrl_req *req, struct usb_xfer *xfer)
+{
+	int idx = req->wValue & 0xff;
+
+	xfer->data = NULL;
+
+	switch (req->wValue & 0xff00)
+	{
+	case (USB_HID_DT_REPORT << 8):
+		if (idx == 0) {
+			xfer->data = (void*)app_hid_extra_report_desc;
+			xfer->len  = sizeof(app_hid_extra_report_desc);
+		}
+		break;
+	}
+
+	return xfer->data != NULL;
+}
+
+static enum usb_fnd_resp
+_extra_ctrl_req(struct usb_ctrl_req *req, struct usb_xfer *xfer)
+{
+	bool rv = false;
+
+	/* Handle all request for the extra keys interface */
+	if (USB_REQ_RCPT(req) != USB_REQ_RCPT_INTF)
+		return USB_FND_CONTINUE;
+
+	if (req->wIndex != g_extra.intf)
+		return USB_FND_CONTINUE;
+
+	/* Handle request */
+	switch (req->wRequestAndType)
+	{
+	case USB_RT_HID_GET_REPORT:
+		rv = _extra_get_report(req, xfer);
+		break;
+
+	case USB_RT_HID_GET_DESCRIPTOR:
+		rv = _extra_get_descriptor(req, xfer);
+		break;
+
+	default:
+		/* Idle and protocol are optional, not handled */
+		return USB_FND_ERROR;
+	}
+
+	return rv ? USB_FND_SUCCESS : USB_FND_ERROR;
+}
+
+static enum usb_fnd_resp
+_extra_set_conf(const struct usb_conf_desc *conf)
+{
+	const struct usb_intf_desc *intf;
+	const struct usb_ep_desc *ep;
+	const void *sod, *eod;
+
+	/* Deconfig case */
+	if (conf == NULL) {
+		g_extra.intf = 0xff;
+		g_extra.ep   = 0xff;
+		return USB_FND_SUCCESS;
+	}
+
+	/* Find the extra keys interface */
+	sod = conf;
+	eod = sod + conf->wTotalLength;
+
+	while (1) {
+		sod = usb_desc_find(usb_desc_next(sod), eod, USB_DT_INTF);
+		if (!sod)
+			break;
+
+		intf = (void*)sod;
+		if ((intf->bInterfaceClass != USB_CLS_HID) ||
+		    (intf->bInterfaceNumber != USB_INTF_EXTRA) ||
+		    (intf->bAlternateSetting != 0))
+			continue;
+
+		/* Find EP */
+		ep = (void*)usb_desc_find(sod, eod, USB_DT_EP);
+		if (!ep || (ep->bEndpointAddress < 0x80) || (ep->bmAttributes != 0x03))
+			continue;
+
+		/* Save interface/ep number */
+		g_extra.intf = intf->bInterfaceNumber;
+		g_extra.ep   = ep->bEndpointAddress;
+
+		/* Boot the endpoint */
+		usb_ep_boot(intf, g_extra.ep, false);
+
+		/* Done */
+		return USB_FND_SUCCESS;
+	}
+
+	return USB_FND_ERROR;
+}
+
+static struct usb_fn_drv _extra_drv = {
+	.ctrl_req	= _extra_ctrl_req,
+	.set_conf	= _extra_set_conf,
+};
+
+
+void
+usb_extra_poll(void)
+{
+	volatile struct usb_ep *ep = &usb_ep_regs[g_extra.ep & 0x1f].in;
+
+	if (g_extra.ep == 0xff)
+		return;
+
+	if (!g_extra.len)
+		return;
+
+	if ((ep->bd[0].csr & USB_BD_STATE_MSK) == USB_BD_STATE_RDY_DATA)
+		return;
+
+	/* Through the aligned buffer, the queue entries aren't */
+	app_extra_report = g_extra.queue[g_extra.head];
+	usb_data_write(ep->bd[0].ptr, &app_extra_report, sizeof(app_extra_report));
+	ep->bd[0].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(sizeof(app_extra_report));
+
+	g_extra.head = (g_extra.head + 1) & (EXTRA_QUEUE - 1);
+	g_extra.len--;
+}
+
+void
+usb_extra_init(void)
+{
+	memset(&g_extra, 0, sizeof(g_extra));
+	g_extra.intf = 0xff;
+	g_extra.ep   = 0xff;
+	usb_register_function_driver(&_extra_drv);
+}
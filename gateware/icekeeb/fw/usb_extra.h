@@ -0,0 +1,39 @@
+/*
+ * usb_extra.h
+ *
+ * Copyright (C) 2021 Sylvain Munaut
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Interface number in the configuration descriptor */
+#define USB_INTF_EXTRA		5
+
+/* Report IDs on the extra keys interface */
+#define USB_EXTRA_ID_SYSTEM	1
+#define USB_EXTRA_ID_CONSUMER	2
+
+void usb_extra_usage(uint16_t action, bool down);
+void usb_extra_poll(void);
+void usb_extra_debug_print(void);
+void usb_extra_init(void);
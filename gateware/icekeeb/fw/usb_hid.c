@@ -33,52 +33,233 @@
 
 #include "keycode.h"
 #include "keymap.h"
+#include "dynamic_macro.h"
+#include "key_override.h"
+#include "macro.h"
+#include "unicode.h"
+#include "usb_hid.h"
+#include "utils.h"
 
 extern const uint8_t app_hid_report_desc[63];
+extern const uint8_t app_hid_nkro_report_desc[31];
 
-/* This is the maximum amount of potential keycodes that can be pressed at the same time.
- * We could theoretically just use ROW * COLS here...
- */
-#define MAX_KEYCODES 48
+/* Keyboard usages covered by the NKRO bitmap, modifiers are apart */
+#define NKRO_KEYS 0xE0
+
+/* Reports queued for the host, enough for a burst of taps */
+#define HID_QUEUE 8	/* power of 2 */
+
+struct hid_queued_report {
+	uint32_t data[8];	/* Room for the NKRO report */
+	uint8_t len;
+	bool nkro;
+};
+
+/* Pressed keys are linked by matrix position, in press order */
+#define KEY_POS(col, row)	((row) * MATRIX_COLS + (col))
+#define KEY_NONE		0xff
 static struct {
 	/* Attached interface / ep */
 	uint8_t intf;
 	uint8_t ep;
+	uint8_t intf_nkro;
+	uint8_t ep_nkro;
+
+	/* Next buffer descriptor of each ping-pong pair to fill */
+	uint8_t bdi;
+	uint8_t bdi_nkro;
 
 	/* State */
 	bool boot_proto;
 
+	/* Idle rate of each interface in 4 ms units, 0 to only report
+	 * changes. The last report is repeated from the SOF handler when the
+	 * frame counter reaches idle_due. */
+	uint8_t idle;
+	uint8_t idle_nkro;
+	uint32_t idle_due;
+
+	/* Lock LEDs as last set by the host */
+	uint8_t leds;
+
+	/* NKRO wanted, and whether the last reports went out as NKRO */
+	bool nkro;
+	bool nkro_sent;
+
+	/* Keys pressed as a bitmap, kept up to date with each event */
+	uint8_t nkro_keys[NKRO_KEYS / 8];
+
 	/* Tracks the keys based on which matrix key generated them
 	 * This way we prevent setting/releasing a keys across layers.
 	 */
-	uint8_t keycodes[MATRIX_ROWS][MATRIX_COLS];
-	bool update_keys;
+	uint8_t keycodes[MATRIX_ROWS * MATRIX_COLS];
+
+	/* The matrix positions holding a keycode, oldest press first. Press
+	 * and release only relink one entry, and the 6KRO report takes the
+	 * head of the list without looking at the rest of the matrix.
+	 */
+	uint8_t key_first;
+	uint8_t key_last;
+	uint8_t key_next[MATRIX_ROWS * MATRIX_COLS];
+	uint8_t key_prev[MATRIX_ROWS * MATRIX_COLS];
+	uint8_t key_count;
+
+	/* Keys pressed since the last report was queued. A release of one
+	 * of those is held back until the press has been queued, so that taps
+	 * shorter than the polling interval still reach the host.
+	 */
+	bool unreported[MATRIX_ROWS * MATRIX_COLS];
+	bool release_pending[MATRIX_ROWS * MATRIX_COLS];
+	int n_release_pending;
+
+	/* State changed since the last report was queued */
 	bool update_report;
+
+	/* Reports waiting for the host, a snapshot per state change */
+	struct hid_queued_report queue[HID_QUEUE];
+	unsigned int q_head;
+	unsigned int q_len;
+	struct hid_queued_report q_last;
+
+	/* Changes merged because the queue was full */
+	bool q_full;
+	unsigned int q_collapsed;
+	unsigned int q_max;
 	uint8_t hard_modifier;
 	uint8_t weak_modifier;
+
+	/* One-shot modifiers wait for the next key press, then go out in
+	 * the same report as that press, and only in that one. */
+	uint8_t oneshot_modifier;
+	uint8_t oneshot_apply;
+
+	/* Modifiers held back from the report, e.g. while typing a sequence */
+	uint8_t suppressed_modifier;
+
+	/* Keys and modifiers driven by the macro player */
+	uint8_t macro_keycodes[6];
+	uint8_t macro_modifier;
 } g_hid;
 static struct {
 	uint8_t modifier;
 	uint8_t _res;
 	uint8_t keycodes[6];
 } __attribute__ ((packed,aligned(4))) app_hid_report;
+static struct {
+	uint8_t modifier;
+	uint8_t keys[NKRO_KEYS / 8];
+} __attribute__ ((packed,aligned(4))) app_nkro_report;
+
+static const uint32_t _hid_empty_report[(sizeof(app_nkro_report) + 3) / 4];
+
+static void
+_hid_key_link(uint8_t pos)
+{
+	g_hid.key_next[pos] = KEY_NONE;
+	g_hid.key_prev[pos] = g_hid.key_last;
+
+	if (g_hid.key_last != KEY_NONE)
+		g_hid.key_next[g_hid.key_last] = pos;
+	else
+		g_hid.key_first = pos;
+
+	g_hid.key_last = pos;
+	g_hid.key_count++;
+}
+
+static void
+_hid_key_unlink(uint8_t pos)
+{
+	uint8_t next = g_hid.key_next[pos];
+	uint8_t prev = g_hid.key_prev[pos];
+
+	if (prev != KEY_NONE)
+		g_hid.key_next[prev] = next;
+	else
+		g_hid.key_first = next;
+
+	if (next != KEY_NONE)
+		g_hid.key_prev[next] = prev;
+	else
+		g_hid.key_last = prev;
+
+	g_hid.key_count--;
+}
+
+static void
+_hid_nkro_clear(uint8_t keycode)
+{
+	/* Another pressed key could still be holding the same code */
+	for (uint8_t pos = g_hid.key_first; pos != KEY_NONE; pos = g_hid.key_next[pos]) {
+		if (g_hid.keycodes[pos] == keycode)
+			return;
+	}
+
+	if (keycode < NKRO_KEYS)
+		g_hid.nkro_keys[keycode >> 3] &= ~(1 << (keycode & 7));
+}
+
+static void
+_hid_key_clear(uint8_t pos)
+{
+	uint8_t keycode = g_hid.keycodes[pos];
+
+	if (keycode == KC_NO)
+		return;
+
+	g_hid.keycodes[pos] = KC_NO;
+	_hid_key_unlink(pos);
+	_hid_nkro_clear(keycode);
+}
 
 void
 usb_hid_press_key(int col, int row, uint8_t keycode)
 {
-	/* Find an empty slot and add the scancode to our main list and increment our keycount. */
-	g_hid.keycodes[row][col] = keycode;
+	uint8_t pos = KEY_POS(col, row);
+	uint8_t prev = g_hid.keycodes[pos];
+
+	/* A press goes to the end of the list, even if that matrix key was
+	 * still holding an older code */
+	if (prev != KC_NO)
+		_hid_key_unlink(pos);
+	g_hid.keycodes[pos] = keycode;
+	if (keycode != KC_NO)
+		_hid_key_link(pos);
+	g_hid.unreported[pos] = true;
+
+	if (prev != keycode)
+		_hid_nkro_clear(prev);
+	if (keycode < NKRO_KEYS)
+		g_hid.nkro_keys[keycode >> 3] |= 1 << (keycode & 7);
+
+	g_hid.oneshot_apply |= g_hid.oneshot_modifier;
+	g_hid.oneshot_modifier = 0;
+	if (g_hid.release_pending[pos]) {
+		g_hid.release_pending[pos] = false;
+		g_hid.n_release_pending--;
+	}
 
-	g_hid.update_keys = true;
 	g_hid.update_report = true;
 }
 
 void
 usb_hid_release_key(int col, int row)
 {
-	g_hid.keycodes[row][col] = KC_NO;
+	uint8_t pos = KEY_POS(col, row);
+
+	if (g_hid.keycodes[pos] == KC_NO)
+		return;
+
+	if (g_hid.unreported[pos]) {
+		if (!g_hid.release_pending[pos]) {
+			g_hid.release_pending[pos] = true;
+			g_hid.n_release_pending++;
+		}
+		return;
+	}
+
+	_hid_key_clear(pos);
 
-	g_hid.update_keys = true;
 	g_hid.update_report = true;
 }
 
@@ -86,7 +267,6 @@ void
 usb_hid_set_mod(uint8_t mod)
 {
 	g_hid.hard_modifier |= mod;
-	g_hid.update_keys = true;
 	g_hid.update_report = true;
 }
 
@@ -94,7 +274,6 @@ void
 usb_hid_reset_mod(uint8_t mod)
 {
 	g_hid.hard_modifier &= ~mod;
-	g_hid.update_keys = true;
 	g_hid.update_report = true;
 }
 
@@ -116,54 +295,234 @@ usb_hid_clear_weak_mod(void)
 	g_hid.weak_modifier = 0;
 }
 
+void
+usb_hid_set_oneshot_mod(uint8_t mod)
+{
+	g_hid.oneshot_modifier = mod;
+}
+
+/* Modifiers currently held on the keyboard */
+uint8_t
+usb_hid_get_mods(void)
+{
+	return g_hid.hard_modifier | g_hid.weak_modifier | g_hid.oneshot_modifier;
+}
+
+void
+usb_hid_suppress_mods(uint8_t mod)
+{
+	g_hid.suppressed_modifier = mod;
+	g_hid.update_report = true;
+}
+
+void
+usb_hid_macro_press(uint8_t keycode)
+{
+	for (int i = 0; i < 6; i++) {
+		if (g_hid.macro_keycodes[i] == KC_NO) {
+			g_hid.macro_keycodes[i] = keycode;
+			break;
+		}
+	}
+	g_hid.update_report = true;
+}
+
+void
+usb_hid_macro_release(uint8_t keycode)
+{
+	for (int i = 0; i < 6; i++) {
+		if (g_hid.macro_keycodes[i] == keycode)
+			g_hid.macro_keycodes[i] = KC_NO;
+	}
+	g_hid.update_report = true;
+}
+
+void
+usb_hid_macro_mods(uint8_t mod)
+{
+	g_hid.macro_modifier = mod;
+	g_hid.update_report = true;
+}
+
+void
+usb_hid_macro_clear(void)
+{
+	memset(g_hid.macro_keycodes, KC_NO, sizeof(g_hid.macro_keycodes));
+	g_hid.macro_modifier = 0;
+	g_hid.update_report = true;
+}
+
 void
 usb_hid_collect_keys(void)
 {
+	uint8_t mods = g_hid.hard_modifier | g_hid.weak_modifier | g_hid.oneshot_apply;
+	uint8_t ko_suppressed = 0;
+	uint8_t ko_added = 0;
+
 	memset(app_hid_report.keycodes, KC_NO, sizeof(app_hid_report.keycodes));
 
-	/* Fill the report with the currently pressed keys */
+	/* Fill the report with the currently pressed keys in press order,
+	 * overridden according to the modifiers going out with them */
 	int keys_found = 0;
-	for (int r = 0; r < MATRIX_ROWS; r++) {
-		for (int c = 0; c < MATRIX_COLS; c++) {
-			if (g_hid.keycodes[r][c] != KC_NO) {
-				app_hid_report.keycodes[keys_found] = g_hid.keycodes[r][c];
-				keys_found++;
-				if (keys_found > 6) {
-					memset(app_hid_report.keycodes, KC_ROLL_OVER, sizeof(app_hid_report.keycodes));
-					return;
-				}
-			}
+	if (g_hid.key_count <= 6) {
+		for (uint8_t pos = g_hid.key_first; pos != KEY_NONE; pos = g_hid.key_next[pos]) {
+			app_hid_report.keycodes[keys_found++] =
+				key_override_apply(g_hid.keycodes[pos], mods, &ko_suppressed, &ko_added);
+		}
+	} else {
+		keys_found = 7;
+	}
+
+	for (int i = 0; (i < 6) && (keys_found <= 6); i++) {
+		if (g_hid.macro_keycodes[i] != KC_NO) {
+			if (keys_found < 6)
+				app_hid_report.keycodes[keys_found] = g_hid.macro_keycodes[i];
+			keys_found++;
+		}
+	}
+
+	/* Too many keys for the report, tell the host so. The modifiers still
+	 * go out, and the one-shot and weak ones are used up all the same. */
+	if (keys_found > 6)
+		memset(app_hid_report.keycodes, KC_ROLL_OVER, sizeof(app_hid_report.keycodes));
+
+	app_hid_report.modifier = (mods & ~(g_hid.suppressed_modifier | ko_suppressed)) |
+		ko_added | g_hid.macro_modifier;
+	g_hid.oneshot_apply = 0;
+	usb_hid_clear_weak_mod();
+}
+
+/* Same as usb_hid_collect_keys() for the NKRO report. The keys come from
+ * the bitmap maintained on each event, only the overrides and the macro
+ * keys are applied on top. */
+static void
+_hid_collect_nkro(void)
+{
+	uint8_t mods = g_hid.hard_modifier | g_hid.weak_modifier | g_hid.oneshot_apply;
+	uint8_t ko_suppressed = 0;
+	uint8_t ko_added = 0;
+
+	memcpy(app_nkro_report.keys, g_hid.nkro_keys, sizeof(app_nkro_report.keys));
+
+	/* One probe of the override index per pressed key, as for 6KRO */
+	for (uint8_t pos = g_hid.key_first; pos != KEY_NONE; pos = g_hid.key_next[pos]) {
+		uint8_t kc = g_hid.keycodes[pos];
+		uint8_t repl = key_override_apply(kc, mods, &ko_suppressed, &ko_added);
+
+		if ((repl != kc) && (kc < NKRO_KEYS)) {
+			app_nkro_report.keys[kc >> 3] &= ~(1 << (kc & 7));
+			if (repl < NKRO_KEYS)
+				app_nkro_report.keys[repl >> 3] |= 1 << (repl & 7);
 		}
 	}
 
-	app_hid_report.modifier = g_hid.hard_modifier | g_hid.weak_modifier;
+	for (int i = 0; i < 6; i++) {
+		uint8_t kc = g_hid.macro_keycodes[i];
+		if ((kc != KC_NO) && (kc < NKRO_KEYS))
+			app_nkro_report.keys[kc >> 3] |= 1 << (kc & 7);
+	}
+
+	app_nkro_report.modifier = (mods & ~(g_hid.suppressed_modifier | ko_suppressed)) |
+		ko_added | g_hid.macro_modifier;
+	g_hid.oneshot_apply = 0;
 	usb_hid_clear_weak_mod();
 }
 
+/* NKRO is only used by hosts in report protocol, boot protocol ones
+ * (BIOS, KVM) only know about the 6KRO report */
+static bool
+_hid_nkro_active(void)
+{
+	return g_hid.nkro && !g_hid.boot_proto && (g_hid.ep_nkro != 0xff);
+}
+
+void
+usb_hid_set_nkro(bool enable)
+{
+	g_hid.nkro = enable;
+	g_hid.update_report = true;
+}
+
+bool
+usb_hid_get_nkro(void)
+{
+	return g_hid.nkro;
+}
+
+/* Lock state as shown by the host, USB_HID_LED_* */
+uint8_t
+usb_hid_get_leds(void)
+{
+	return g_hid.leds;
+}
+
 void
 usb_hid_debug_print(void)
 {
-	if (g_hid.update_keys || g_hid.update_report) {
+	if (g_hid.update_report || g_hid.q_len) {
 		for (int r = 0; r < MATRIX_ROWS; r++) {
 			for (int c = 0; c < MATRIX_COLS; c++) {
-				printf("%02X ", g_hid.keycodes[r][c]);
+				printf("%02X ", g_hid.keycodes[KEY_POS(c, r)]);
 			}
 			printf("\n");
 		}
+		printf(" pressed %d:", g_hid.key_count);
+		for (uint8_t pos = g_hid.key_first; pos != KEY_NONE; pos = g_hid.key_next[pos])
+			printf(" %02X", g_hid.keycodes[pos]);
 		printf("\n %02X -- ", app_hid_report.modifier);
 		for (int i = 0; i < 6; i++) {
 			printf("%02X ", app_hid_report.keycodes[i]);
 		}
 		printf("\n");
+		printf(" nkro %d (%s) %02X -- %s\n", g_hid.nkro, g_hid.nkro_sent ? "active" : "inactive",
+			app_nkro_report.modifier, hexstr(app_nkro_report.keys, sizeof(app_nkro_report.keys), false));
+		printf(" queue %d (max %d), %d collapsed\n", g_hid.q_len, g_hid.q_max, g_hid.q_collapsed);
+		printf(" idle %d/%d, leds %02X\n", g_hid.idle, g_hid.idle_nkro, g_hid.leds);
 	}
 }
 
+static void
+_hid_report_queued(void)
+{
+	memset(g_hid.unreported, 0, sizeof(g_hid.unreported));
+
+	if (!g_hid.n_release_pending)
+		return;
+
+	/* Now the presses are queued, apply the releases we held back. Those
+	 * keys are all still in the pressed list. */
+	for (uint8_t pos = g_hid.key_first; pos != KEY_NONE; ) {
+		uint8_t next = g_hid.key_next[pos];
+
+		if (g_hid.release_pending[pos]) {
+			g_hid.release_pending[pos] = false;
+			_hid_key_clear(pos);
+		}
+		pos = next;
+	}
+
+	g_hid.n_release_pending = 0;
+	g_hid.update_report = true;
+}
+
 static bool
 _hid_get_report(struct usb_ctrl_req *req, struct usb_xfer *xfer)
 {
+	static uint32_t report[8];
+
+	/* A copy of the last queued state, it won't change under the
+	 * transfer */
+	if (req->wIndex == g_hid.intf_nkro) {
+		memcpy(report, &app_nkro_report, sizeof(app_nkro_report));
+		xfer->len = sizeof(app_nkro_report);
+	} else {
+		memcpy(report, &app_hid_report, sizeof(app_hid_report));
+		xfer->len = sizeof(app_hid_report);
+	}
 
-	xfer->cb_data = (void *)&app_hid_report;
-	xfer->len = sizeof(app_hid_report);
+	xfer->data = (void *)report;
+	if (xfer->len > req->wLength)
+		xfer->len = req->wLength;
 	return true;
 }
 
@@ -177,7 +536,12 @@ _hid_get_descriptor(struct usb_ctrl_req *req, struct usb_xfer *xfer)
 	switch (req->wValue & 0xff00)
 	{
 	case (USB_HID_DT_REPORT << 8):
-		if (idx == 0) {
+		if (idx != 0)
+			break;
+		if (req->wIndex == g_hid.intf_nkro) {
+			xfer->data = (void*)app_hid_nkro_report_desc;
+			xfer->len  = sizeof(app_hid_nkro_report_desc);
+		} else {
 			xfer->data = (void*)app_hid_report_desc;
 			xfer->len  = sizeof(app_hid_report_desc);
 		}
@@ -187,6 +551,37 @@ _hid_get_descriptor(struct usb_ctrl_req *req, struct usb_xfer *xfer)
 	return xfer->data != NULL;
 }
 
+static bool
+_hid_set_report_done(struct usb_xfer *xfer)
+{
+	g_hid.leds = xfer->data[0];
+	return true;
+}
+
+static bool
+_hid_set_report(struct usb_ctrl_req *req, struct usb_xfer *xfer)
+{
+	/* Only the LED output report of the keyboard, no report ID */
+	if ((req->wIndex != g_hid.intf) || (req->wValue != 0x0200) || (req->wLength != 1))
+		return false;
+
+	xfer->cb_done = _hid_set_report_done;
+
+	return true;
+}
+
+static uint8_t *
+_hid_idle_rate(uint16_t intf)
+{
+	return (intf == g_hid.intf_nkro) ? &g_hid.idle_nkro : &g_hid.idle;
+}
+
+static void
+_hid_idle_restart(bool nkro)
+{
+	g_hid.idle_due = usb_get_tick() + ((nkro ? g_hid.idle_nkro : g_hid.idle) << 2);
+}
+
 static enum usb_fnd_resp
 _hid_ctrl_req(struct usb_ctrl_req *req, struct usb_xfer *xfer)
 {
@@ -196,7 +591,7 @@ _hid_ctrl_req(struct usb_ctrl_req *req, struct usb_xfer *xfer)
 	if (USB_REQ_RCPT(req) != USB_REQ_RCPT_INTF)
 		return USB_FND_CONTINUE;
 
-	if (req->wIndex != g_hid.intf)
+	if ((req->wIndex != g_hid.intf) && (req->wIndex != g_hid.intf_nkro))
 		return USB_FND_CONTINUE;
 
 	/* Handle request */
@@ -207,24 +602,37 @@ _hid_ctrl_req(struct usb_ctrl_req *req, struct usb_xfer *xfer)
 		break;
 
 	case USB_RT_HID_SET_REPORT:
-		/* Optional, Not handled */
-		return USB_FND_ERROR;
+		rv = _hid_set_report(req, xfer);
+		break;
 
 	case USB_RT_HID_GET_IDLE:
-		/* Optional, Not handled */
-		return USB_FND_ERROR;
+		xfer->data[0] = *_hid_idle_rate(req->wIndex);
+		xfer->len = 1;
+		rv = true;
+		break;
 
 	case USB_RT_HID_SET_IDLE:
-		/* Optional, Not handled */
-		return USB_FND_ERROR;
+		/* Same rate for all reports of the interface, whatever ID */
+		*_hid_idle_rate(req->wIndex) = req->wValue >> 8;
+		_hid_idle_restart(g_hid.q_last.nkro);
+		rv = true;
+		break;
 
 	case USB_RT_HID_GET_PROTOCOL:
-		/* Optional, Handled */
-		return USB_FND_ERROR;
+		if (req->wIndex != g_hid.intf)
+			return USB_FND_ERROR;
+		xfer->data[0] = g_hid.boot_proto ? 0 : 1;
+		xfer->len = 1;
+		rv = true;
+		break;
 
 	case USB_RT_HID_SET_PROTOCOL:
-		/* Optional, Handled */
-		return USB_FND_ERROR;
+		if (req->wIndex != g_hid.intf)
+			return USB_FND_ERROR;
+		g_hid.boot_proto = (req->wValue == 0);
+		g_hid.update_report = true;
+		rv = true;
+		break;
 
 	case USB_RT_HID_GET_DESCRIPTOR:
 		rv = _hid_get_descriptor(req, xfer);
@@ -249,13 +657,30 @@ _hid_set_conf(const struct usb_conf_desc *conf)
 	const void *sod, *eod;
 
 	/* Deconfig case */
-	if (conf == NULL) {
-		g_hid.intf = 0xff;
-		g_hid.ep   = 0xff;
+	g_hid.intf      = 0xff;
+	g_hid.ep        = 0xff;
+	g_hid.intf_nkro = 0xff;
+	g_hid.ep_nkro   = 0xff;
+	g_hid.bdi       = 0;
+	g_hid.bdi_nkro  = 0;
+
+	/* Back to report protocol, as after any SET_CONFIGURATION, and to
+	 * the idle rate recommended for keyboards (500 ms) */
+	g_hid.boot_proto = false;
+	g_hid.idle = 125;
+	g_hid.idle_nkro = 125;
+	g_hid.leds = 0;
+
+	/* Whatever was queued was for the previous configuration, and the
+	 * host starts over with no key pressed */
+	g_hid.q_len = 0;
+	g_hid.q_last.len = 0;
+	g_hid.update_report = true;
+
+	if (conf == NULL)
 		return USB_FND_SUCCESS;
-	}
 
-	/* Find first HID interface */
+	/* Find first HID keyboard interface, and the NKRO one */
         sod = conf;
         eod = sod + conf->wTotalLength;
 
@@ -275,47 +700,188 @@ _hid_set_conf(const struct usb_conf_desc *conf)
 			continue;
 
 		/* Save interface/ep number */
-		g_hid.intf = intf->bInterfaceNumber;
-		g_hid.ep   = ep->bEndpointAddress;
-
-		/* Boot the endpoint */
-		usb_ep_boot(intf, g_hid.ep, false);
+		if ((intf->bInterfaceProtocol == USB_HID_PROTO_KEYBOARD) && (g_hid.intf == 0xff)) {
+			g_hid.intf = intf->bInterfaceNumber;
+			g_hid.ep   = ep->bEndpointAddress;
+		} else if (intf->bInterfaceNumber == USB_INTF_NKRO) {
+			g_hid.intf_nkro = intf->bInterfaceNumber;
+			g_hid.ep_nkro   = ep->bEndpointAddress;
+		} else {
+			continue;
+		}
 
-		/* Done */
-		return USB_FND_SUCCESS;
+		/* Boot the endpoint, with both buffer descriptors */
+		usb_ep_boot(intf, ep->bEndpointAddress, true);
 	}
 
-	return USB_FND_ERROR;
+	return (g_hid.intf != 0xff) ? USB_FND_SUCCESS : USB_FND_ERROR;
 }
 
-static struct usb_fn_drv _hid_drv = {
-	.ctrl_req	= _hid_ctrl_req,
-	.set_conf	= _hid_set_conf,
-};
 
+/* The IN endpoints use their two buffer descriptors as a ping-pong pair,
+ * the hardware alternates between them. While the host reads one, the
+ * next report can already be staged in the other, so it goes out on the
+ * next IN token even if the main loop is busy when it comes. Going by
+ * 'usb_model.py latency', a model rather than a measurement, that only
+ * trims the worst case once a main loop pass takes longer than a frame,
+ * the 1 ms bInterval is what brings the average down. */
+static bool
+_hid_ep_free(uint8_t ep_addr, uint8_t bdi)
+{
+	volatile struct usb_ep *ep = &usb_ep_regs[ep_addr & 0x1f].in;
+
+	return (ep->bd[bdi].csr & USB_BD_STATE_MSK) != USB_BD_STATE_RDY_DATA;
+}
+
+static bool
+_hid_ep_write(uint8_t ep_addr, uint8_t *bdi, const void *data, int len)
+{
+	volatile struct usb_ep *ep = &usb_ep_regs[ep_addr & 0x1f].in;
+
+	if (!_hid_ep_free(ep_addr, *bdi))
+		return false;
+
+	usb_data_write(ep->bd[*bdi].ptr, data, len);
+	ep->bd[*bdi].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(len);
+	*bdi ^= 1;
+
+	return true;
+}
+
+/* Queues a snapshot of a report, unless it's the same as the previous one */
+static bool
+_hid_queue_put(const void *data, int len, bool nkro)
+{
+	struct hid_queued_report *qr;
+
+	if ((g_hid.q_last.len == len) && (g_hid.q_last.nkro == nkro) &&
+	    !memcmp(g_hid.q_last.data, data, len))
+		return true;
+
+	if (g_hid.q_len == HID_QUEUE)
+		return false;
+
+	qr = &g_hid.queue[(g_hid.q_head + g_hid.q_len++) & (HID_QUEUE - 1)];
+	memcpy(qr->data, data, len);
+	qr->len  = len;
+	qr->nkro = nkro;
+	g_hid.q_last = *qr;
+
+	if (g_hid.q_len > g_hid.q_max)
+		g_hid.q_max = g_hid.q_len;
+
+	return true;
+}
+
+/* Hands queued reports to the endpoints, one per buffer */
+static void
+_hid_queue_drain(void)
+{
+	while (g_hid.q_len) {
+		struct hid_queued_report *qr = &g_hid.queue[g_hid.q_head];
+		uint8_t ep = qr->nkro ? g_hid.ep_nkro : g_hid.ep;
+		uint8_t *bdi = qr->nkro ? &g_hid.bdi_nkro : &g_hid.bdi;
+
+		/* The interface went away, nobody to send it to */
+		if ((ep != 0xff) && !_hid_ep_write(ep, bdi, qr->data, qr->len))
+			break;
+
+		_hid_idle_restart(qr->nkro);
+
+		g_hid.q_head = (g_hid.q_head + 1) & (HID_QUEUE - 1);
+		g_hid.q_len--;
+	}
+}
+
+/* Repeats the last report when the idle period is over and nothing new
+ * went out meanwhile. Runs from the SOF handler, which usb_poll() calls
+ * from the main loop, so the period follows the host frame counter but a
+ * busy loop still delays the repeat until its next usb_poll(). */
+static void
+_hid_sof(void)
+{
+	bool nkro = g_hid.q_last.nkro;
+	uint8_t ep = nkro ? g_hid.ep_nkro : g_hid.ep;
+
+	if ((ep == 0xff) || !g_hid.q_last.len || g_hid.q_len)
+		return;
+
+	if (!(nkro ? g_hid.idle_nkro : g_hid.idle))
+		return;
+
+	if ((int32_t)(usb_get_tick() - g_hid.idle_due) < 0)
+		return;
+
+	_hid_ep_write(ep, nkro ? &g_hid.bdi_nkro : &g_hid.bdi, g_hid.q_last.data, g_hid.q_last.len);
+	_hid_idle_restart(nkro);
+}
 
 void
 usb_hid_poll(void)
 {
-	volatile struct usb_ep *ep = &usb_ep_regs[g_hid.ep & 0x1f].in;
+	bool nkro = _hid_nkro_active();
 
 	if (g_hid.ep == 0xff)
 		return;
 
-	if (g_hid.update_report) {
-		usb_hid_collect_keys();
-		g_hid.update_report = false;
+	/* Switching between 6KRO and NKRO, the report we stop using must
+	 * not leave keys stuck on the host */
+	if (nkro != g_hid.nkro_sent) {
+		int len_old = g_hid.nkro_sent ? sizeof(app_nkro_report) : 8;
+
+		if (!_hid_queue_put(_hid_empty_report, len_old, g_hid.nkro_sent)) {
+			_hid_queue_drain();
+			return;
+		}
+
+		g_hid.nkro_sent = nkro;
+		g_hid.update_report = true;
+	}
+
+	/* The macro player advances one report worth of change each time
+	 * the queue is empty, so it goes as fast as the host polls us. */
+	if (!g_hid.q_len) {
+		uint32_t now = usb_get_tick();
+		macro_step(now);
+		dynamic_macro_step(now);
+		unicode_step(now);
 	}
 
-	if (g_hid.update_keys) {
-		if ((ep->bd[0].csr & USB_BD_STATE_MSK) != USB_BD_STATE_RDY_DATA) {
-			usb_data_write(ep->bd[0].ptr, &app_hid_report, 8);
-			g_hid.update_keys = false;
-			ep->bd[0].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(8);
+	/* Snapshot the new state. With the queue full the changes keep
+	 * accumulating in the state and go out merged, presses are still
+	 * never lost as their releases are held back until queued. */
+	if (g_hid.update_report) {
+		if (g_hid.q_len < HID_QUEUE) {
+			bool queued;
+
+			if (nkro) {
+				_hid_collect_nkro();
+				queued = _hid_queue_put(&app_nkro_report, sizeof(app_nkro_report), true);
+			} else {
+				usb_hid_collect_keys();
+				queued = _hid_queue_put(&app_hid_report, 8, false);
+			}
+
+			if (queued) {
+				g_hid.update_report = false;
+				g_hid.q_full = false;
+				_hid_report_queued();
+			}
+		} else if (!g_hid.q_full) {
+			g_hid.q_full = true;
+			g_hid.q_collapsed++;
 		}
 	}
+
+	_hid_queue_drain();
 }
 
+static struct usb_fn_drv _hid_drv = {
+	.sof		= _hid_sof,
+	.ctrl_req	= _hid_ctrl_req,
+	.set_conf	= _hid_set_conf,
+};
+
 void
 usb_hid_init(void)
 {
@@ -327,10 +893,35 @@ usb_hid_init(void)
 	app_hid_report.keycodes[3] = 0x00;
 	app_hid_report.keycodes[4] = 0x00;
 	app_hid_report.keycodes[5] = 0x00;
+	memset(&app_nkro_report, 0, sizeof(app_nkro_report));
 	usb_register_function_driver(&_hid_drv);
 	g_hid.intf = 0xff;
 	g_hid.ep   = 0xff;
-
-	g_hid.update_keys = false;
+	g_hid.intf_nkro = 0xff;
+	g_hid.ep_nkro   = 0xff;
+
+	g_hid.nkro = true;
+	g_hid.nkro_sent = false;
+	g_hid.idle = 125;
+	g_hid.idle_nkro = 125;
+	g_hid.leds = 0;
+	memset(g_hid.nkro_keys, 0, sizeof(g_hid.nkro_keys));
+
+	g_hid.update_report = false;
+	g_hid.q_head = 0;
+	g_hid.q_len = 0;
+	g_hid.q_full = false;
+	g_hid.q_collapsed = 0;
+	g_hid.q_max = 0;
+	memset(&g_hid.q_last, 0, sizeof(g_hid.q_last));
 	memset(g_hid.keycodes, 0, sizeof(g_hid.keycodes));
+	g_hid.key_first = KEY_NONE;
+	g_hid.key_last = KEY_NONE;
+	g_hid.key_count = 0;
+	memset(g_hid.macro_keycodes, 0, sizeof(g_hid.macro_keycodes));
+	g_hid.macro_modifier = 0;
+	g_hid.suppressed_modifier = 0;
+	memset(g_hid.unreported, 0, sizeof(g_hid.unreported));
+	memset(g_hid.release_pending, 0, sizeof(g_hid.release_pending));
+	g_hid.n_release_pending = 0;
 }
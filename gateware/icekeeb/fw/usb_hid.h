@@ -23,6 +23,19 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Interface number of the NKRO keyboard in the configuration descriptor */
+#define USB_INTF_NKRO 6
+
+/* Lock LEDs in the output report of the host */
+#define USB_HID_LED_NUM_LOCK	(1 << 0)
+#define USB_HID_LED_CAPS_LOCK	(1 << 1)
+#define USB_HID_LED_SCROLL_LOCK	(1 << 2)
+#define USB_HID_LED_COMPOSE	(1 << 3)
+#define USB_HID_LED_KANA	(1 << 4)
+
 void usb_hid_poll(void);
 void usb_hid_init(void);
 void usb_hid_press_key(int col, int row, uint8_t keycode);
@@ -32,4 +45,14 @@ void usb_hid_reset_mod(uint8_t keycode);
 void usb_hid_set_weak_mod(uint8_t keycode);
 void usb_hid_reset_weak_mod(uint8_t keycode);
 void usb_hid_clear_weak_mod(void);
+void usb_hid_set_oneshot_mod(uint8_t mod);
+uint8_t usb_hid_get_mods(void);
+void usb_hid_suppress_mods(uint8_t mod);
+void usb_hid_set_nkro(bool enable);
+bool usb_hid_get_nkro(void);
+uint8_t usb_hid_get_leds(void);
+void usb_hid_macro_press(uint8_t keycode);
+void usb_hid_macro_release(uint8_t keycode);
+void usb_hid_macro_mods(uint8_t mod);
+void usb_hid_macro_clear(void);
 void usb_hid_debug_print(void);
\ No newline at end of file
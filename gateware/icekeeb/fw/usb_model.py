@@ -0,0 +1,235 @@
+#!/usr/bin/env python3
+#
+# Behavioral models of the USB data paths, for the figures quoted in the
+# sources and the commit logs. They model the firmware's structure, not
+# the RTL: time is in us, the main loop is a series of passes of a given
+# length with jitter, and the host takes whatever is staged on its
+# tokens. The results are estimates, to compare designs with each other.
+#
+# Usage: usb_model.py latency|raw|cdc
+#
+#   latency   Scan-to-host latency of the keyboard IN endpoint, for the
+#             polling interval and the number of buffer descriptors
+#   raw       Frames a keymap dump and upload take over the raw HID
+#             interface, through the interrupt endpoints (29 keycodes a
+#             command) and through the feature report (whole keymap)
+#   cdc       Throughput of the CDC bulk IN endpoint with the TX ring kept
+#             full, idle and while typing
+#
+
+import random
+import sys
+
+
+def latency(interval, nbd, loop_us, stall_every=40, stall_us=2500, n=20000, seed=1):
+	# Typing: taps and rolls down to 5 ms apart. Each key transition
+	# needs its own report, the press and release of a tap, the
+	# overlapping keys of a roll.
+	rnd = random.Random(seed)
+	t = 0
+	evs = []
+	for i in range(n):
+		t += rnd.randint(5000, 150000)
+		evs.append(t)
+		evs.append(t + rnd.randint(8000, 90000))
+	evs.sort()
+	end = evs[-1] + 50000
+
+	# The main loop stages at most one report per free BD per pass. Its
+	# length jitters, with a long pass now and then (console output,
+	# flash reads).
+	staged = []
+	pending = []
+	lat = []
+	ei = 0
+	next_in = 100
+	tl = 0
+	it = 0
+	while tl < end:
+		while next_in <= tl:
+			if staged:
+				for e in staged.pop(0):
+					lat.append(next_in - e)
+			next_in += interval * 1000
+		while ei < len(evs) and evs[ei] <= tl:
+			pending.append(evs[ei])
+			ei += 1
+		while pending and len(staged) < nbd:
+			staged.append([pending.pop(0)])
+		it += 1
+		tl += loop_us + rnd.randint(-loop_us // 2, loop_us // 2)
+		if it % stall_every == 0:
+			tl += stall_us
+
+	lat.sort()
+	return sum(lat) / len(lat) / 1000, lat[int(len(lat) * .999)] / 1000, lat[-1] / 1000
+
+
+def main_latency():
+	for loop_us in [400, 1500]:
+		print('Main loop pass %.1f ms' % (loop_us / 1000))
+		for name, interval, nbd in [('10 ms, single BD', 10, 1), ('1 ms, single BD', 1, 1), ('1 ms, ping-pong', 1, 2)]:
+			print('  %-18s avg %5.2f  p99.9 %5.2f  max %5.2f ms' % ((name,) + latency(interval, nbd, loop_us)))
+
+
+def loop_passes(loop_us, rnd, stall_every=40, stall_us=2500):
+	# Start times of the main loop passes, same shape as above
+	t = 0
+	it = 0
+	while True:
+		yield t
+		it += 1
+		t += loop_us + rnd.randint(-loop_us // 2, loop_us // 2)
+		if it % stall_every == 0:
+			t += stall_us
+
+
+def raw_interrupt(ncmds, loop_us, seed=1):
+	# bInterval 1: each frame the host sends the next command if an OUT
+	# BD is free and takes an answer if one is staged. The device takes
+	# a command in a pass only when an IN BD is free for its answer.
+	rnd = random.Random(seed)
+	passes = loop_passes(loop_us, rnd)
+	tp = next(passes)
+	out_q = 0		# Commands in the OUT BDs
+	in_q = 0		# Answers in the IN BDs
+	sent = 0
+	got = 0
+	frame = 0
+	while got < ncmds:
+		t = frame * 1000
+		while tp < t:
+			if out_q and in_q < 2:
+				out_q -= 1
+				in_q += 1
+			tp = next(passes)
+		if sent < ncmds and out_q < 2:
+			out_q += 1
+			sent += 1
+		if in_q:
+			in_q -= 1
+			got += 1
+		frame += 1
+	return frame
+
+
+def raw_feature(transfers, loop_us, per_frame=15, spin_us=2000, seed=1):
+	# Each control transfer is a SETUP, its data packets and a status
+	# packet, per_frame is what a full speed host fits in a frame next
+	# to the interrupt traffic. The SETUP waits for the next main loop
+	# pass, from there usb_raw_poll() spins on usb_poll() for up to
+	# spin_us and takes the packets as the host sends them. Past the spin
+	# it's one packet a pass again. A new transfer starts on the frame
+	# after the last one completed, the host stack's turnaround.
+	rnd = random.Random(seed)
+	passes = loop_passes(loop_us, rnd)
+	tp = next(passes)
+	frame = 0
+	for nbytes in transfers:
+		pkts = 2 + (nbytes + 63) // 64
+		t0 = frame * 1000
+		while tp < t0:
+			tp = next(passes)
+		t_setup = tp
+		pkts -= 1
+		frame = tp // 1000
+		n = 1
+		tp = next(passes)
+		t = t_setup
+		while pkts:
+			if t - t_setup < spin_us:
+				t += 1000 // per_frame
+			else:
+				while tp < t:
+					tp = next(passes)
+				t = tp
+				tp = next(passes)
+			if t // 1000 != frame:
+				frame = t // 1000
+				n = 0
+			if n == per_frame:
+				continue
+			n += 1
+			pkts -= 1
+		frame += 1
+		while tp < t:
+			tp = next(passes)
+	return frame
+
+
+def main_raw():
+	hdr = 6
+	dump = 4 * 48		# Keycodes of the default 4 layers
+	upload = 8 * 48		# All the layers
+	seeds = range(1, 201)
+	runs = [
+		# 29 keycodes a command, a command and an answer a frame
+		('interrupt EPs',
+			lambda l, s: raw_interrupt((dump + 28) // 29, l, seed=s),
+			lambda l, s: raw_interrupt((upload + 28) // 29, l, seed=s)),
+		# SET_REPORT with the command then GET_REPORT of the answer, or
+		# SET_REPORT with the keycodes then GET_REPORT of the status
+		('feature report',
+			lambda l, s: raw_feature([hdr, hdr + 2 * dump], l, seed=s),
+			lambda l, s: raw_feature([hdr + 2 * upload, hdr], l, seed=s)),
+	]
+	for loop_us in [400, 1500]:
+		print('Main loop pass %.1f ms' % (loop_us / 1000))
+		for name, fdump, fupload in runs:
+			d = [fdump(loop_us, s) for s in seeds]
+			u = [fupload(loop_us, s) for s in seeds]
+			print('  %-16s dump avg %4.1f max %2d  upload avg %4.1f max %2d frames' %
+				(name, sum(d) / len(d), max(d), sum(u) / len(u), max(u)))
+
+
+def cdc(idle_us, pkt_us, typing, per_frame=17, t_end=1000000):
+	# The host reads a bulk packet every 1000 / per_frame us when one is
+	# staged, what a full speed frame holds next to the interrupt traffic.
+	# Each pass, usb_cdc_poll() fills the free IN BDs at pkt_us each, or a
+	# single one per ms while typing. The rest of the pass takes idle_us.
+	slot = 1000 / per_frame
+	bds = []		# Times the staged packets are ready
+	t = 0
+	next_slot = 0
+	last_tick = -1
+	nbytes = 0
+	while t < t_end:
+		while next_slot <= t:
+			if bds and bds[0] <= next_slot:
+				bds.pop(0)
+				nbytes += 64
+			next_slot += slot
+		while len(bds) < 2:
+			if typing and (int(t) // 1000 == last_tick):
+				break
+			t += pkt_us
+			bds.append(t)
+			last_tick = int(t) // 1000
+		t += idle_us
+	return nbytes * 1000000 / t_end / 1000
+
+
+def main_cdc():
+	# picorv32 at 24 MHz, about 4 clocks an instruction out of SPRAM. A
+	# packet is the byte wise memcpy() out of the ring, some 5
+	# instructions a byte, and usb_data_write() of 16 words: about 1600
+	# clocks, 65 us. A main loop pass with nothing to do is the calls
+	# of fw_app.c returning early, some 300 to 600 instructions, 50 to
+	# 100 us. The longer passes are there to see how it degrades.
+	pkt_us = 65
+	for idle_us in [50, 100, 200, 400]:
+		print('Idle pass %.2f ms  idle %4d KB/s  typing %3d KB/s' %
+			(idle_us / 1000, cdc(idle_us, pkt_us, False), cdc(idle_us, pkt_us, True)))
+
+
+models = {
+	'latency': main_latency,
+	'raw': main_raw,
+	'cdc': main_cdc,
+}
+
+if len(sys.argv) != 2 or sys.argv[1] not in models:
+	print('Usage: %s %s' % (sys.argv[0], '|'.join(models)))
+	sys.exit(1)
+
+models[sys.argv[1]]()
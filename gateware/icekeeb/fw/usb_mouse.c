@@ -0,0 +1,228 @@
+/*
+ * usb_mouse.c
+ *
+ * Copyright (C) 2021 Sylvain Munaut
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* HID mouse function, reports come from the mouse keys.
+ *
+ * It's a boot mouse, so it takes the protocol requests. In the boot
+ * protocol only the first 3 bytes of the report go out, buttons and X/Y.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <no2usb/usb.h>
+#include <no2usb/usb_hw.h>
+#include <no2usb/usb_priv.h>
+#include <no2usb/usb_hid_proto.h>
+
+#include "mousekey.h"
+#include "usb_mouse.h"
+
+extern const uint8_t app_hid_mouse_report_desc[55];
+
+#define MOUSE_BOOT_REPORT_SIZE	3
+
+static struct {
+	/* Attached interface / ep */
+	uint8_t intf;
+	uint8_t ep;
+
+	/* State */
+	bool boot_proto;
+
+	/* Only kept to be given back. Movement is relative, repeating a
+	 * report would move the pointer again. */
+	uint8_t idle;
+} g_mouse;
+
+static struct mouse_report app_mouse_report __attribute__ ((aligned(4)));
+
+
+static bool
+_mouse_get_descriptor(struct usb_ctrl_req *req, struct usb_xfer *xfer)
+{
+	int idx = req->wValue & 0xff;
+
+	xfer->data = NULL;
+
+	switch (req->wValue & 0xff00)
+	{
+	case (USB_HID_DT_REPORT << 8):
+		if (idx == 0) {
+			xfer->data = (void*)app_hid_mouse_report_desc;
+			xfer->len  = sizeof(app_hid_mouse_report_desc);
+		}
+		break;
+	}
+
+	return xfer->data != NULL;
+}
+
+static int
+_mouse_report_len(void)
+{
+	return g_mouse.boot_proto ? MOUSE_BOOT_REPORT_SIZE : sizeof(app_mouse_report);
+}
+
+static enum usb_fnd_resp
+_mouse_ctrl_req(struct usb_ctrl_req *req, struct usb_xfer *xfer)
+{
+	bool rv = false;
+
+	/* Handle all request for the mouse interface */
+	if (USB_REQ_RCPT(req) != USB_REQ_RCPT_INTF)
+		return USB_FND_CONTINUE;
+
+	if (req->wIndex != g_mouse.intf)
+		return USB_FND_CONTINUE;
+
+	/* Handle request */
+	switch (req->wRequestAndType)
+	{
+	case USB_RT_HID_GET_REPORT:
+		xfer->data = (void*)&app_mouse_report;
+		xfer->len  = _mouse_report_len();
+		rv = true;
+		break;
+
+	case USB_RT_HID_GET_IDLE:
+		xfer->data[0] = g_mouse.idle;
+		xfer->len = 1;
+		rv = true;
+		break;
+
+	case USB_RT_HID_SET_IDLE:
+		g_mouse.idle = req->wValue >> 8;
+		rv = true;
+		break;
+
+	case USB_RT_HID_GET_PROTOCOL:
+		xfer->data[0] = g_mouse.boot_proto ? 0 : 1;
+		xfer->len = 1;
+		rv = true;
+		break;
+
+	case USB_RT_HID_SET_PROTOCOL:
+		g_mouse.boot_proto = (req->wValue == 0);
+		rv = true;
+		break;
+
+	case USB_RT_HID_GET_DESCRIPTOR:
+		rv = _mouse_get_descriptor(req, xfer);
+		break;
+
+	default:
+		return USB_FND_ERROR;
+	}
+
+	return rv ? USB_FND_SUCCESS : USB_FND_ERROR;
+}
+
+static enum usb_fnd_resp
+_mouse_set_conf(const struct usb_conf_desc *conf)
+{
+	const struct usb_intf_desc *intf;
+	const struct usb_ep_desc *ep;
+	const void *sod, *eod;
+
+	/* Back to the report protocol, as after a reset */
+	g_mouse.boot_proto = false;
+	g_mouse.idle = 0;
+
+	/* Deconfig case */
+	if (conf == NULL) {
+		g_mouse.intf = 0xff;
+		g_mouse.ep   = 0xff;
+		return USB_FND_SUCCESS;
+	}
+
+	/* Find the HID mouse interface */
+	sod = conf;
+	eod = sod + conf->wTotalLength;
+
+	while (1) {
+		sod = usb_desc_find(usb_desc_next(sod), eod, USB_DT_INTF);
+		if (!sod)
+			break;
+
+		intf = (void*)sod;
+		if ((intf->bInterfaceClass != USB_CLS_HID) ||
+		    (intf->bInterfaceProtocol != USB_HID_PROTO_MOUSE) ||
+		    (intf->bAlternateSetting != 0))
+			continue;
+
+		/* Find EP */
+		ep = (void*)usb_desc_find(sod, eod, USB_DT_EP);
+		if (!ep || (ep->bEndpointAddress < 0x80) || (ep->bmAttributes != 0x03))
+			continue;
+
+		/* Save interface/ep number */
+		g_mouse.intf = intf->bInterfaceNumber;
+		g_mouse.ep   = ep->bEndpointAddress;
+
+		/* Boot the endpoint */
+		usb_ep_boot(intf, g_mouse.ep, false);
+
+		/* Done */
+		return USB_FND_SUCCESS;
+	}
+
+	return USB_FND_ERROR;
+}
+
+static struct usb_fn_drv _mouse_drv = {
+	.ctrl_req	= _mouse_ctrl_req,
+	.set_conf	= _mouse_set_conf,
+};
+
+
+void
+usb_mouse_poll(void)
+{
+	volatile struct usb_ep *ep = &usb_ep_regs[g_mouse.ep & 0x1f].in;
+
+	if (g_mouse.ep == 0xff)
+		return;
+
+	/* A new report each time the buffer is free, as long as there is
+	 * something to say. Movement is computed right here, so it matches
+	 * the time since the previous report. */
+	if ((ep->bd[0].csr & USB_BD_STATE_MSK) == USB_BD_STATE_RDY_DATA)
+		return;
+
+	if (!mousekey_report(&app_mouse_report, usb_get_tick()))
+		return;
+
+	usb_data_write(ep->bd[0].ptr, &app_mouse_report, _mouse_report_len());
+	ep->bd[0].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(_mouse_report_len());
+}
+
+void
+usb_mouse_init(void)
+{
+	memset(&app_mouse_report, 0, sizeof(app_mouse_report));
+	g_mouse.intf = 0xff;
+	g_mouse.ep   = 0xff;
+	usb_register_function_driver(&_mouse_drv);
+}
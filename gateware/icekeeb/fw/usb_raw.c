@@ -0,0 +1,497 @@
+/*
+ * usb_raw.c
+ *
+ * Copyright (C) 2021 Sylvain Munaut
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Vendor HID interface to edit the keymap in RAM and save it to flash,
+ * see usb_raw.h for the protocol.
+ *
+ * The host doesn't need to wait for an answer before sending the next
+ * command. Both endpoints have two buffers, and a command is only taken
+ * from the OUT endpoint once there is an IN buffer free for its answer,
+ * the host gets NAKed meanwhile. That's still one 64 byte packet per
+ * frame each way.
+ *
+ * Bulk moves of the keymap should rather use the feature report: the
+ * command goes out with SET_REPORT and runs once its data stage is in,
+ * GET_REPORT then reads the answer back. A block holds the whole keymap,
+ * and once a transfer started usb_raw_poll() services the control
+ * endpoint until it's done, so it moves as many packets a frame as the
+ * host sends. 'usb_model.py raw' has the frame counts of both, modelled
+ * rather than measured.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <no2usb/usb.h>
+#include <no2usb/usb_hw.h>
+#include <no2usb/usb_priv.h>
+#include <no2usb/usb_hid_proto.h>
+
+#include "combo.h"
+#include "keyboard.h"
+#include "keymap.h"
+#include "kvstore.h"
+#include "macro.h"
+#include "usb_raw.h"
+
+extern const uint8_t app_hid_raw_report_desc[32];
+
+#define RAW_HDR			6
+#define RAW_KEYMAP_SIZE		(KEYMAP_LAYERS * MATRIX_ROWS * MATRIX_COLS)
+#define RAW_FEATURE_SPIN	2	/* ms */
+
+_Static_assert(RAW_FEATURE_SIZE >= RAW_HDR + 2 * RAW_KEYMAP_SIZE, "feature report too small");
+
+static struct {
+	/* Attached interface / eps */
+	uint8_t intf;
+	uint8_t ep_in;
+	uint8_t ep_out;
+
+	/* Next buffer descriptor of each pair */
+	uint8_t bdi_in;
+	uint8_t bdi_out;
+
+	/* Feature report transfer under way on EP0, since that tick */
+	bool feature;
+	uint32_t feature_tick;
+
+	/* Stats */
+	unsigned int cmds;
+	unsigned int errors;
+} g_raw;
+
+static uint32_t raw_buf[RAW_REPORT_SIZE / 4];
+static uint32_t raw_feature[(RAW_FEATURE_SIZE + 3) / 4];
+
+
+static uint16_t
+_raw_get16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static void
+_raw_put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+/* Checks the offset / count of a block command against the report and
+ * the area size */
+static bool
+_raw_block(const uint8_t *buf, unsigned int len, unsigned int size, unsigned int unit,
+           unsigned int *ofs, unsigned int *cnt)
+{
+	*ofs = _raw_get16(&buf[2]);
+	*cnt = _raw_get16(&buf[4]);
+
+	return (*cnt * unit <= len - RAW_HDR) && (*ofs <= size) && (*cnt <= size - *ofs);
+}
+
+/* Runs the command in buf, a report of len bytes, and leaves the answer
+ * in its place */
+static uint8_t
+_raw_command(uint8_t *buf, unsigned int len)
+{
+	uint16_t *km = &keymap_layers[0][0][0];
+	unsigned int ofs, cnt, idx, n;
+	matrix_mask_t mask;
+
+	/* The flash store reads the tables while it saves them */
+	if (((buf[0] == RAW_CMD_KEYMAP_WRITE) || (buf[0] == RAW_CMD_COMBO_WRITE) ||
+	     (buf[0] == RAW_CMD_MACRO_WRITE) || (buf[0] == RAW_CMD_DEFAULTS)) && kv_busy())
+		return RAW_ERR_BUSY;
+
+	switch (buf[0])
+	{
+	case RAW_CMD_INFO:
+		buf[2] = RAW_VERSION;
+		buf[3] = keymap_layer_count;
+		buf[4] = KEYMAP_LAYERS;
+		buf[5] = MATRIX_ROWS;
+		buf[6] = MATRIX_COLS;
+		buf[7] = keymap_combo_count;
+		buf[8] = KEYMAP_COMBOS;
+		buf[9] = keymap_macro_count;
+		_raw_put16(&buf[10], KEYMAP_MACRO_SIZE);
+		buf[12] = kv_busy();
+		buf[13] = keymap_default_layer;
+		return RAW_OK;
+
+	case RAW_CMD_KEYMAP_READ:
+		if (!_raw_block(buf, len, RAW_KEYMAP_SIZE, 2, &ofs, &cnt))
+			return RAW_ERR_ARG;
+		for (unsigned int i = 0; i < cnt; i++)
+			_raw_put16(&buf[RAW_HDR + 2 * i], km[ofs + i]);
+		return RAW_OK;
+
+	case RAW_CMD_KEYMAP_WRITE:
+		if (!_raw_block(buf, len, RAW_KEYMAP_SIZE, 2, &ofs, &cnt))
+			return RAW_ERR_ARG;
+		for (unsigned int i = 0; i < cnt; i++)
+			km[ofs + i] = _raw_get16(&buf[RAW_HDR + 2 * i]);
+		return RAW_OK;
+
+	case RAW_CMD_LAYER_COUNT:
+		if (!buf[2] || (buf[2] > KEYMAP_LAYERS))
+			return RAW_ERR_ARG;
+		keymap_layer_count = buf[2];
+		if (keymap_default_layer >= keymap_layer_count)
+			keymap_default_layer = 0;
+		return RAW_OK;
+
+	case RAW_CMD_DEFAULT_LAYER:
+		if (buf[2] >= keymap_layer_count)
+			return RAW_ERR_ARG;
+		keymap_default_layer = buf[2];
+		keymap_set_layer(keymap_default_layer);
+		return RAW_OK;
+
+	case RAW_CMD_COMBO_READ:
+		idx = buf[2];
+		if (idx >= KEYMAP_COMBOS)
+			return RAW_ERR_ARG;
+		for (int i = 0; i < 8; i++)
+			buf[4 + i] = keymap_combos[idx].keys >> (8 * i);
+		_raw_put16(&buf[12], keymap_combos[idx].keycode);
+		return RAW_OK;
+
+	case RAW_CMD_COMBO_WRITE:
+		idx = buf[2];
+		if (idx >= KEYMAP_COMBOS)
+			return RAW_ERR_ARG;
+		mask = 0;
+		n = 0;
+		for (int i = 0; i < 8; i++)
+			mask |= (matrix_mask_t)buf[4 + i] << (8 * i);
+		for (matrix_mask_t m = mask; m; m &= m - 1)
+			n++;
+		if (n > COMBO_MAX_KEYS)
+			return RAW_ERR_ARG;
+		keymap_combos[idx].keys = mask;
+		keymap_combos[idx].keycode = _raw_get16(&buf[12]);
+		combo_reload();
+		return RAW_OK;
+
+	case RAW_CMD_COMBO_COUNT:
+		if (buf[2] > KEYMAP_COMBOS)
+			return RAW_ERR_ARG;
+		keymap_combo_count = buf[2];
+		combo_reload();
+		return RAW_OK;
+
+	case RAW_CMD_MACRO_READ:
+		if (!_raw_block(buf, len, KEYMAP_MACRO_SIZE, 1, &ofs, &cnt))
+			return RAW_ERR_ARG;
+		memcpy(&buf[RAW_HDR], &keymap_macro_buf[ofs], cnt);
+		return RAW_OK;
+
+	case RAW_CMD_MACRO_WRITE:
+		if (!_raw_block(buf, len, KEYMAP_MACRO_SIZE, 1, &ofs, &cnt))
+			return RAW_ERR_ARG;
+		/* Whatever is playing could be overwritten */
+		macro_abort();
+		memcpy(&keymap_macro_buf[ofs], &buf[RAW_HDR], cnt);
+		keymap_macros_update();
+		return RAW_OK;
+
+	case RAW_CMD_SAVE:
+		if (!keymap_save() || !keyboard_settings_save())
+			return RAW_ERR_FLASH;
+		return RAW_OK;
+
+	case RAW_CMD_DEFAULTS:
+		macro_abort();
+		keymap_load_defaults();
+		combo_reload();
+		return RAW_OK;
+
+	default:
+		return RAW_ERR_CMD;
+	}
+}
+
+void
+usb_raw_debug_print(void)
+{
+	printf("Raw: intf %d, %d commands, %d errors\n", g_raw.intf, g_raw.cmds, g_raw.errors);
+}
+
+
+static bool
+_raw_get_descriptor(struct usb_ctrl_req *req, struct usb_xfer *xfer)
+{
+	int idx = req->wValue & 0xff;
+
+	xfer->data = NULL;
+
+	switch (req->wValue & 0xff00)
+	{
+	case (USB_HID_DT_REPORT << 8):
+		if (idx == 0) {
+			xfer->data = (void*)app_hid_raw_report_desc;
+			xfer->len  = sizeof(app_hid_raw_report_desc);
+		}
+		break;
+	}
+
+	return xfer->data != NULL;
+}
+
+static bool
+_raw_feature_done(struct usb_xfer *xfer)
+{
+	uint8_t *buf = (uint8_t *)raw_feature;
+
+	/* Answer in place, for the GET_REPORT that follows */
+	buf[1] = _raw_command(buf, RAW_FEATURE_SIZE);
+	g_raw.cmds++;
+	if (buf[1] != RAW_OK)
+		g_raw.errors++;
+
+	g_raw.feature = false;
+	return true;
+}
+
+static bool
+_raw_feature_sent(struct usb_xfer *xfer)
+{
+	g_raw.feature = false;
+	return true;
+}
+
+static bool
+_raw_set_feature(struct usb_ctrl_req *req, struct usb_xfer *xfer)
+{
+	/* Feature report, no report ID */
+	if ((req->wValue != 0x0300) || (req->wLength == 0) || (req->wLength > RAW_FEATURE_SIZE))
+		return false;
+
+	/* The command lands in our own buffer, it's larger than EP0's */
+	memset(raw_feature, 0, sizeof(raw_feature));
+	xfer->data = (void *)raw_feature;
+	xfer->len  = req->wLength;
+	xfer->cb_done = _raw_feature_done;
+
+	g_raw.feature = true;
+	g_raw.feature_tick = usb_get_tick();
+	return true;
+}
+
+static bool
+_raw_get_feature(struct usb_ctrl_req *req, struct usb_xfer *xfer)
+{
+	if (req->wValue != 0x0300)
+		return false;
+
+	xfer->data = (void *)raw_feature;
+	xfer->len  = RAW_FEATURE_SIZE;
+	if (xfer->len > req->wLength)
+		xfer->len = req->wLength;
+	xfer->cb_done = _raw_feature_sent;
+
+	g_raw.feature = true;
+	g_raw.feature_tick = usb_get_tick();
+	return true;
+}
+
+static enum usb_fnd_resp
+_raw_ctrl_req(struct usb_ctrl_req *req, struct usb_xfer *xfer)
+{
+	bool rv = false;
+
+	/* Handle all request for the raw interface */
+	if (USB_REQ_RCPT(req) != USB_REQ_RCPT_INTF)
+		return USB_FND_CONTINUE;
+
+	if (req->wIndex != g_raw.intf)
+		return USB_FND_CONTINUE;
+
+	/* Handle request */
+	switch (req->wRequestAndType)
+	{
+	case USB_RT_HID_GET_DESCRIPTOR:
+		rv = _raw_get_descriptor(req, xfer);
+		break;
+
+	case USB_RT_HID_SET_IDLE:
+		/* Input reports only ever answer a command */
+		rv = true;
+		break;
+
+	case USB_RT_HID_SET_REPORT:
+		rv = _raw_set_feature(req, xfer);
+		break;
+
+	case USB_RT_HID_GET_REPORT:
+		rv = _raw_get_feature(req, xfer);
+		break;
+
+	default:
+		return USB_FND_ERROR;
+	}
+
+	return rv ? USB_FND_SUCCESS : USB_FND_ERROR;
+}
+
+static enum usb_fnd_resp
+_raw_set_conf(const struct usb_conf_desc *conf)
+{
+	const struct usb_intf_desc *intf;
+	const struct usb_ep_desc *ep;
+	const void *sod, *eod;
+
+	/* Deconfig case */
+	g_raw.intf    = 0xff;
+	g_raw.ep_in   = 0xff;
+	g_raw.ep_out  = 0xff;
+	g_raw.bdi_in  = 0;
+	g_raw.bdi_out = 0;
+
+	if (conf == NULL)
+		return USB_FND_SUCCESS;
+
+	/* Find the raw interface */
+	sod = conf;
+	eod = sod + conf->wTotalLength;
+
+	while (1) {
+		sod = usb_desc_find(usb_desc_next(sod), eod, USB_DT_INTF);
+		if (!sod)
+			break;
+
+		intf = (void*)sod;
+		if ((intf->bInterfaceClass != USB_CLS_HID) ||
+		    (intf->bInterfaceNumber != USB_INTF_RAW) ||
+		    (intf->bAlternateSetting != 0))
+			continue;
+
+		/* Find the two EPs, in either order */
+		ep = (void*)sod;
+		for (int i = 0; i < 2; i++) {
+			ep = (void*)usb_desc_find(usb_desc_next(ep), eod, USB_DT_EP);
+			if (!ep || (ep->bmAttributes != 0x03))
+				break;
+			if (ep->bEndpointAddress & 0x80)
+				g_raw.ep_in = ep->bEndpointAddress;
+			else
+				g_raw.ep_out = ep->bEndpointAddress;
+		}
+
+		if ((g_raw.ep_in == 0xff) || (g_raw.ep_out == 0xff)) {
+			g_raw.ep_in  = 0xff;
+			g_raw.ep_out = 0xff;
+			continue;
+		}
+
+		g_raw.intf = intf->bInterfaceNumber;
+
+		/* Boot the endpoints, both OUT buffers ready for commands.
+		 * The CRC lands in the buffer too. */
+		usb_ep_boot(intf, g_raw.ep_in, true);
+		usb_ep_boot(intf, g_raw.ep_out, true);
+
+		for (int i = 0; i < 2; i++)
+			usb_ep_regs[g_raw.ep_out & 0x1f].out.bd[i].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(RAW_REPORT_SIZE + 2);
+
+		/* Done */
+		return USB_FND_SUCCESS;
+	}
+
+	return USB_FND_ERROR;
+}
+
+static struct usb_fn_drv _raw_drv = {
+	.ctrl_req	= _raw_ctrl_req,
+	.set_conf	= _raw_set_conf,
+};
+
+
+void
+usb_raw_poll(void)
+{
+	volatile struct usb_ep *ep_in = &usb_ep_regs[g_raw.ep_in & 0x1f].in;
+	volatile struct usb_ep *ep_out = &usb_ep_regs[g_raw.ep_out & 0x1f].out;
+	uint8_t *buf = (uint8_t *)raw_buf;
+	uint32_t csr;
+	int len;
+
+	if (g_raw.ep_in == 0xff)
+		return;
+
+	/* Move the rest of a feature report as fast as the host sends it,
+	 * rather than a packet every main loop pass. Bounded, in case the
+	 * host gives up on the transfer. */
+	while (g_raw.feature && ((usb_get_tick() - g_raw.feature_tick) < RAW_FEATURE_SPIN))
+		usb_poll();
+	g_raw.feature = false;
+
+	/* Only take a command when its answer can go out */
+	if ((ep_in->bd[g_raw.bdi_in].csr & USB_BD_STATE_MSK) == USB_BD_STATE_RDY_DATA)
+		return;
+
+	csr = ep_out->bd[g_raw.bdi_out].csr;
+	if ((csr & USB_BD_STATE_MSK) == USB_BD_STATE_RDY_DATA)
+		return;
+
+	/* Length includes the CRC */
+	len = (csr & USB_BD_LEN_MSK) - 2;
+	if (len > RAW_REPORT_SIZE)
+		len = RAW_REPORT_SIZE;
+
+	memset(raw_buf, 0, sizeof(raw_buf));
+	if (((csr & USB_BD_STATE_MSK) == USB_BD_STATE_DONE_OK) && (len > 0))
+		usb_data_read(raw_buf, ep_out->bd[g_raw.bdi_out].ptr, len);
+	else
+		len = 0;
+
+	ep_out->bd[g_raw.bdi_out].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(RAW_REPORT_SIZE + 2);
+	g_raw.bdi_out ^= 1;
+
+	if (!len)
+		return;
+
+	/* Answer in place, past the command and status bytes */
+	buf[1] = _raw_command(buf, RAW_REPORT_SIZE);
+	g_raw.cmds++;
+	if (buf[1] != RAW_OK)
+		g_raw.errors++;
+
+	usb_data_write(ep_in->bd[g_raw.bdi_in].ptr, raw_buf, RAW_REPORT_SIZE);
+	ep_in->bd[g_raw.bdi_in].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(RAW_REPORT_SIZE);
+	g_raw.bdi_in ^= 1;
+}
+
+void
+usb_raw_init(void)
+{
+	memset(&g_raw, 0, sizeof(g_raw));
+	g_raw.intf   = 0xff;
+	g_raw.ep_in  = 0xff;
+	g_raw.ep_out = 0xff;
+	usb_register_function_driver(&_raw_drv);
+}
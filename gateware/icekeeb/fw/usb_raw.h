@@ -0,0 +1,84 @@
+/*
+ * usb_raw.h
+ *
+ * Copyright (C) 2021 Sylvain Munaut
+ * All rights reserved.
+ *
+ * LGPL v3+, see LICENSE.lgpl3
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Interface number in the configuration descriptor */
+#define USB_INTF_RAW		7
+
+/* Vendor HID protocol to edit the keymap from the host.
+ *
+ * Each command is a 64 byte output report, answered by a 64 byte input
+ * report. Both start with the command byte and a status byte, multi byte
+ * values are little endian.
+ *
+ * Keymap and macro blocks: offset (16 bit) at 2, count (16 bit) at 4,
+ * data from 6. The keymap is addressed in keycodes, flattened as
+ * [layer][row][col], the macro buffer in bytes.
+ *
+ * The same commands also go as a RAW_FEATURE_SIZE byte feature report
+ * over the control endpoint: SET_REPORT runs the command, GET_REPORT
+ * reads its answer back. A block then holds the whole keymap, the count
+ * limits in brackets below, and the host can move several packets of it
+ * per frame.
+ *
+ * Combos: index at 2, matrix mask (64 bit) at 4, keycode at 12. There is
+ * room for KEYMAP_COMBOS (255) of them, of COMBO_MAX_KEYS (4) keys at
+ * most, a mask with more is refused.
+ *
+ * Saving queues the keymap and the tuning for the flash store, which
+ * writes them in the background. Info tells whether it's still busy,
+ * until then the keymap, combo and macro writes are refused.
+ */
+#define RAW_REPORT_SIZE		64
+#define RAW_FEATURE_SIZE	774	/* Header and the 8 layer keymap */
+
+#define RAW_CMD_INFO		0x01	/* -> version, layers, max layers, rows, cols,
+					 *    combos, max combos, macros, macro buffer (16 bit),
+					 *    saving, default layer */
+#define RAW_CMD_KEYMAP_READ	0x02	/* offset, count <= 29 (384) -> keycodes */
+#define RAW_CMD_KEYMAP_WRITE	0x03	/* offset, count <= 29 (384), keycodes */
+#define RAW_CMD_LAYER_COUNT	0x04	/* layers */
+#define RAW_CMD_COMBO_READ	0x05	/* index -> mask, keycode */
+#define RAW_CMD_COMBO_WRITE	0x06	/* index, mask, keycode */
+#define RAW_CMD_COMBO_COUNT	0x07	/* combos */
+#define RAW_CMD_MACRO_READ	0x08	/* offset, count <= 58 (512) -> bytes */
+#define RAW_CMD_MACRO_WRITE	0x09	/* offset, count <= 58 (512), bytes */
+#define RAW_CMD_SAVE		0x0a	/* Keymap in use to flash */
+#define RAW_CMD_DEFAULTS	0x0b	/* Compiled in keymap back in use, not saved */
+#define RAW_CMD_DEFAULT_LAYER	0x0c	/* layer active at boot */
+
+#define RAW_VERSION		3
+
+#define RAW_OK			0x00
+#define RAW_ERR_CMD		0x01
+#define RAW_ERR_ARG		0x02
+#define RAW_ERR_FLASH		0x03	/* No room in the flash store */
+#define RAW_ERR_BUSY		0x04	/* Saving, the keymap can't change yet */
+
+void usb_raw_poll(void);
+void usb_raw_debug_print(void);
+void usb_raw_init(void);
@@ -23,6 +23,8 @@
 
 #pragma once
 
+#include <stdint.h>
 #include <stdbool.h>
 
 char *hexstr(void *d, int n, bool space);
+uint32_t crc32(uint32_t crc, const void *d, int n);